@@ -0,0 +1,464 @@
+// Standalone benchmarks for the packers, RectangleTree operations and image
+// resampling, run by `make bench`. Results are printed to stdout as one JSON
+// object per line.
+//
+// Usage: imgpacker-bench [max-items [search-budget-seconds]]
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <glibmm.h>
+#include <giomm.h>
+#include <gdkmm/pixbuf.h>
+#include <nihpp/sigc++/fixfunctors.hh>
+
+#include <imgpack/algorithm/bin-packer.hh>
+#include <imgpack/algorithm/rectangles.hh>
+#include <imgpack/algorithm/shape.hh>
+#include <imgpack/algorithm/spatial-index.hh>
+#include <imgpack/util/resampler.hh>
+
+namespace ip = ImgPack;
+namespace ipa = ip::Algorithm;
+namespace ipu = ip::Util;
+
+namespace {
+    typedef std::chrono::steady_clock Clock;
+    typedef std::pair<double, double> Size;
+    typedef std::function<Size (std::mt19937 &)> Generator;
+
+    const double TARGET_ASPECT = 1.0;
+
+    double seconds_since (Clock::time_point start)
+    {
+        return std::chrono::duration<double> (Clock::now () - start).count ();
+    }
+
+    // Whether the peak resident set size was reset when the running case
+    // started, and so is that case's own peak
+    bool peak_rss_reset = false;
+
+    // Resident set size when the running case started
+    long start_rss_kb = 0;
+
+    // Returns a field of /proc/self/status given in kB, or -1 if there is
+    // no such field
+    long proc_status_kb (const std::string &field)
+    {
+        std::FILE *status = std::fopen ("/proc/self/status", "r");
+
+        if (!status)
+            return -1;
+
+        char line[256];
+        long value = -1;
+
+        while (std::fgets (line, sizeof line, status))
+            if (std::strncmp (line, field.c_str (), field.size ()) == 0 &&
+                line[field.size ()] == ':') {
+                value = std::strtol (line + field.size () + 1, nullptr, 10);
+                break;
+            }
+
+        std::fclose (status);
+
+        return value;
+    }
+
+    // Starts timing a case and measuring the memory it uses. The peak
+    // resident set size of a process never goes down by itself, so every
+    // case after the largest would report that one's peak. Linux resets it
+    // to the current size on request.
+    Clock::time_point start_case ()
+    {
+        std::FILE *clear_refs = std::fopen ("/proc/self/clear_refs", "w");
+        peak_rss_reset = false;
+
+        if (clear_refs) {
+            peak_rss_reset = std::fputs ("5", clear_refs) >= 0;
+            peak_rss_reset = std::fclose (clear_refs) == 0 && peak_rss_reset;
+        }
+
+        start_rss_kb = proc_status_kb ("VmRSS");
+
+        return Clock::now ();
+    }
+
+    // Peak resident set size since the running case started, or -1 if
+    // that cannot be told apart from the peak of earlier cases
+    long peak_rss_kb ()
+    {
+        return peak_rss_reset ? proc_status_kb ("VmHWM") : -1;
+    }
+
+    // Size with the given aspect ratio and a random area around that of a
+    // 12 megapixel photo
+    Size photo (std::mt19937 &random, double aspect)
+    {
+        std::lognormal_distribution<double> area (std::log (12e6), 0.5);
+        double height = std::sqrt (area (random) / aspect);
+
+        return Size (aspect * height, height);
+    }
+
+    Size uniform (std::mt19937 &random)
+    {
+        std::uniform_real_distribution<double> log_aspect (std::log (0.5),
+                                                           std::log (2.0));
+        return photo (random, std::exp (log_aspect (random)));
+    }
+
+    Size portrait_heavy (std::mt19937 &random)
+    {
+        std::uniform_real_distribution<double> uniform (0, 1);
+        double aspects[] = {2.0 / 3, 3.0 / 4, 9.0 / 16};
+
+        if (uniform (random) < 0.2)
+            return photo (random, 3.0 / 2);
+
+        return photo (random, aspects[std::uniform_int_distribution<int>
+                                      (0, 2) (random)]);
+    }
+
+    Size panorama_mixed (std::mt19937 &random)
+    {
+        std::uniform_real_distribution<double> uniform (0, 1);
+
+        if (uniform (random) < 0.1)
+            return photo (random, 3 + 5 * uniform (random));
+
+        return photo (random, uniform (random) < 0.5 ? 4.0 / 3 : 3.0 / 2);
+    }
+
+    // Alternates slivers with extreme aspect ratios and areas a thousand
+    // times apart, which forces heavy downscaling whatever the pairing
+    Size adversarial (std::mt19937 &random)
+    {
+        std::uniform_int_distribution<int> pick (0, 3);
+
+        switch (pick (random)) {
+        case 0:
+            return Size (5000, 100);
+
+        case 1:
+            return Size (100, 5000);
+
+        case 2:
+            return Size (50, 1);
+
+        default:
+            return Size (1, 50);
+        }
+    }
+
+    struct Dataset
+    {
+        std::string generator;
+        std::vector<Size> sizes;
+        double total_area;
+    };
+
+    Dataset generate (const std::string &name, const Generator &generator,
+                      std::size_t n)
+    {
+        std::mt19937 random (n);
+        Dataset dataset = {name, std::vector<Size> (), 0};
+        dataset.sizes.reserve (n);
+
+        for (std::size_t i = 0; i < n; i++) {
+            dataset.sizes.push_back (generator (random));
+            dataset.total_area +=
+                dataset.sizes.back ().first * dataset.sizes.back ().second;
+        }
+
+        return dataset;
+    }
+
+    ipa::RectangleTree::Ptr make_tree (const Dataset &dataset,
+                                       ipa::RectangleTree::NodeList &leaves)
+    {
+        auto tree = ipa::RectangleTree::create ();
+        tree->reserve (dataset.sizes.size ());
+
+        leaves.clear ();
+        leaves.reserve (dataset.sizes.size ());
+
+        for (const Size &size : dataset.sizes)
+            leaves.push_back (tree->add_leaf (size.first, size.second));
+
+        return tree;
+    }
+
+    // Prints the result of the running case. The peak resident set size and
+    // how far it rose above where the case started are -1 where the peak
+    // cannot be reset.
+    void print_result (const Dataset &dataset, const std::string &benchmark,
+                       const std::string &strategy, double seconds,
+                       std::size_t operations, const std::string &extra)
+    {
+        long peak = peak_rss_kb ();
+
+        std::printf ("{\"generator\": \"%s\", \"items\": %zu, "
+                     "\"benchmark\": \"%s\", \"strategy\": \"%s\", "
+                     "\"seconds\": %.6f, \"ns_per_op\": %.2f, "
+                     "\"peak_rss_kb\": %ld, \"rss_growth_kb\": %ld%s}\n",
+                     dataset.generator.c_str (), dataset.sizes.size (),
+                     benchmark.c_str (), strategy.c_str (), seconds,
+                     operations ? seconds * 1e9 / operations : 0.0,
+                     peak, peak < 0 ? -1 : peak - start_rss_kb,
+                     extra.c_str ());
+        std::fflush (stdout);
+    }
+
+    // Runs a packer to completion on the main loop and reports how long it
+    // took and how good the result is
+    void bench_packer (const Dataset &dataset, const std::string &strategy,
+                       double budget)
+    {
+        ipa::RectangleTree::NodeList leaves;
+        ipa::RectangleTree::Ptr tree = make_tree (dataset, leaves);
+
+        ipa::BinPacker::Ptr packer = ipa::BinPacker::create (strategy);
+        packer->target_aspect (TARGET_ASPECT);
+        packer->time_budget (budget);
+        packer->source_rectangles (tree, std::move (leaves));
+
+        Glib::RefPtr<Glib::MainLoop> loop = Glib::MainLoop::create ();
+        packer->connect_signal_finish ([loop] () {loop->quit ();});
+
+        Clock::time_point start = start_case ();
+        packer->start ();
+        loop->run ();
+        double seconds = seconds_since (start);
+
+        ipa::RectangleTree::Node root = packer->result ();
+        ipa::Shape shape = {tree->aspect_ratio (root),
+                            tree->max_height (root)};
+
+        char extra[256];
+        std::snprintf (extra, sizeof extra,
+                       ", \"aspect_ratio\": %.6f, \"aspect_error\": %.6f, "
+                       "\"retained_area\": %.6f, \"cost\": %.6f",
+                       shape.aspect,
+                       std::abs (std::log (shape.aspect / TARGET_ASPECT)),
+                       shape.max_area () / dataset.total_area,
+                       ipa::packing_cost (shape, TARGET_ASPECT,
+                                          dataset.total_area));
+
+        print_result (dataset, "pack", strategy, seconds,
+                      dataset.sizes.size (), extra);
+    }
+
+    // Times the individual RectangleTree operations on a tree packed by
+    // serially combining neighbours
+    void bench_tree (const Dataset &dataset)
+    {
+        std::size_t n = dataset.sizes.size ();
+
+        ipa::RectangleTree::NodeList leaves;
+        ipa::RectangleTree::Ptr tree = make_tree (dataset, leaves);
+        ipa::RectangleTree::NodeList rectangles = leaves;
+
+        Clock::time_point start = start_case ();
+        std::size_t ncombines = 0;
+
+        while (rectangles.size () > 1) {
+            ipa::RectangleTree::NodeList accumulator;
+
+            for (std::size_t i = 0; i + 1 < rectangles.size (); i += 2) {
+                ipa::RectangleTree::Orientation orientation =
+                    tree->aspect_ratio (rectangles[i]) > TARGET_ASPECT ?
+                    ipa::RectangleTree::VERTICAL :
+                    ipa::RectangleTree::HORIZONTAL;
+
+                accumulator.push_back (tree->combine (orientation,
+                                                      rectangles[i],
+                                                      rectangles[i + 1]));
+                ncombines++;
+            }
+
+            if (rectangles.size () % 2)
+                accumulator.push_back (rectangles.back ());
+
+            rectangles = std::move (accumulator);
+        }
+
+        print_result (dataset, "combine", "", seconds_since (start),
+                      ncombines, "");
+
+        ipa::RectangleTree::Node root = rectangles.front ();
+
+        start = start_case ();
+        tree->layout (root);
+        print_result (dataset, "layout", "", seconds_since (start), n, "");
+
+        std::mt19937 random (1);
+        std::uniform_int_distribution<std::size_t> pick (0, n - 1);
+
+        // Every call walks from a leaf up to the root
+        const std::size_t nrecalculations = std::min<std::size_t> (n, 10000);
+
+        start = start_case ();
+
+        for (std::size_t i = 0; i < nrecalculations; i++)
+            tree->recalculate_size (leaves[pick (random)]);
+
+        print_result (dataset, "recalculate_size", "", seconds_since (start),
+                      nrecalculations, "");
+
+        tree->layout (root);
+
+        // Stored somewhere the compiler cannot optimise away
+        volatile double sum = 0;
+        start = start_case ();
+
+        for (ipa::RectangleTree::Node leaf : leaves)
+            sum = sum + tree->offset_x (leaf);
+
+        print_result (dataset, "offset_x", "", seconds_since (start), n, "");
+
+        const std::size_t nqueries = 100000;
+        std::uniform_real_distribution<double> x (0, tree->width (root));
+        std::uniform_real_distribution<double> y (0, tree->height (root));
+
+        std::vector<std::pair<double, double> > points;
+        points.reserve (nqueries);
+
+        for (std::size_t i = 0; i < nqueries; i++)
+            points.push_back (std::make_pair (x (random), y (random)));
+
+        std::size_t nfound = 0;
+        start = start_case ();
+
+        for (const auto &point : points)
+            nfound += tree->find_rect (root, point.first, point.second) !=
+                ipa::RectangleTree::INVALID_NODE;
+
+        print_result (dataset, "find_rect", "tree", seconds_since (start),
+                      nqueries, nfound == nqueries ? "" : ", \"misses\": 1");
+
+        ipa::SpatialIndex index;
+
+        start = start_case ();
+        index.rebuild (*tree, root);
+        print_result (dataset, "index_rebuild", "", seconds_since (start),
+                      n, "");
+
+        nfound = 0;
+        start = start_case ();
+
+        for (const auto &point : points)
+            nfound += index.find_rect (point.first, point.second) !=
+                ipa::RectangleTree::INVALID_NODE;
+
+        print_result (dataset, "find_rect", "index", seconds_since (start),
+                      nqueries, nfound == nqueries ? "" : ", \"misses\": 1");
+    }
+
+    // Scales a noisy 24 megapixel photo down to a few typical sizes, with
+    // gdk-pixbuf and with the Resampler on one thread and on all of them
+    void bench_resample ()
+    {
+        const int width = 6000;
+        const int height = 4000;
+
+        Glib::RefPtr<Gdk::Pixbuf> source =
+            Gdk::Pixbuf::create (Gdk::COLORSPACE_RGB, false, 8, width, height);
+
+        std::mt19937 random (1);
+        guint8 *pixels = source->get_pixels ();
+
+        for (int y = 0; y < height; y++)
+            for (int x = 0; x < width * 3; x++)
+                pixels[y * source->get_rowstride () + x] = random ();
+
+        Dataset dataset = {"noise", std::vector<Size> (1, Size (width, height)),
+                           double (width) * height};
+
+        const int sizes[] = {3000, 1024, 256};
+
+        for (int target_width : sizes) {
+            int target_height = target_width * height / width;
+
+            char extra[256];
+            std::snprintf (extra, sizeof extra,
+                           ", \"width\": %d, \"height\": %d, "
+                           "\"kernel\": \"%s\"",
+                           target_width, target_height,
+                           ipu::Resampler::kernel_name ());
+
+            Clock::time_point start = start_case ();
+            source->scale_simple (target_width, target_height,
+                                  Gdk::INTERP_BILINEAR);
+            print_result (dataset, "resample", "scale_simple",
+                          seconds_since (start), width * height, extra);
+
+            const std::pair<std::string, ipu::Resampler::Filter> filters[] = {
+                std::make_pair ("box", ipu::Resampler::BOX),
+                std::make_pair ("lanczos", ipu::Resampler::LANCZOS)
+            };
+
+            for (const auto &filter : filters)
+                for (bool parallel : {false, true}) {
+                    start = start_case ();
+                    ipu::Resampler::scale (source, target_width, target_height,
+                                           filter.second, parallel);
+                    print_result (dataset, "resample",
+                                  filter.first +
+                                  (parallel ? "-parallel" : ""),
+                                  seconds_since (start), width * height,
+                                  extra);
+                }
+        }
+    }
+}
+
+int main (int argc, char **argv)
+{
+    if (!Glib::thread_supported ())
+        Glib::thread_init ();
+
+    Gio::init ();
+
+    std::size_t max_items = argc > 1 ? std::strtoul (argv[1], nullptr, 10) :
+        1000000;
+    double search_budget = argc > 2 ? std::strtod (argv[2], nullptr) : 0.2;
+
+    // Searching packers keep going until their budget runs out whatever the
+    // input size, so they are only run on inputs they can make progress on
+    const std::size_t max_search_items = 10000;
+
+    bench_resample ();
+
+    const std::pair<std::string, Generator> generators[] = {
+        std::make_pair ("uniform", Generator (uniform)),
+        std::make_pair ("portrait-heavy", Generator (portrait_heavy)),
+        std::make_pair ("panorama-mixed", Generator (panorama_mixed)),
+        std::make_pair ("adversarial", Generator (adversarial))
+    };
+
+    for (std::size_t n = 10; n <= max_items; n *= 10) {
+        for (const auto &generator : generators) {
+            Dataset dataset = generate (generator.first, generator.second, n);
+
+            for (const ipa::BinPacker::Strategy &strategy :
+                     ipa::BinPacker::strategies ()) {
+                if (strategy.uses_budget && n > max_search_items)
+                    continue;
+
+                bench_packer (dataset, strategy.name, search_budget);
+            }
+
+            bench_tree (dataset);
+        }
+    }
+
+    return 0;
+}
@@ -1,11 +1,13 @@
 #include <stdexcept>
+#include <algorithm>
 #include <cmath>
 #include <limits>
 
 #include <nihpp/sharedptrcreator.hh>
-#include <autosprintf.h>
 
 #include <imgpack/algorithm/bin-packer.hh>
+#include <imgpack/algorithm/search-packer.hh>
+#include <imgpack/util/thread-pool.hh>
 #include <imgpack/util/logger.hh>
 
 namespace ip = ImgPack;
@@ -17,22 +19,16 @@ namespace {
         return (v1 < v2) ? v1 / v2 : v2 / v1;
     }
 
-    // Combines two rectangles either horizontally or vertically by equalizing
-    // either width or height
-    ipa::CompositeRectangle::Ptr combine (ipa::Rectangle::Ptr rect1,
-                                          ipa::Rectangle::Ptr rect2,
-                                          double target_aspect)
+    // Combines two rectangles into the preallocated node either horizontally or
+    // vertically by equalizing either width or height
+    void combine (ipa::RectangleTree &tree,
+                  ipa::RectangleTree::Node node,
+                  ipa::RectangleTree::Node rect1,
+                  ipa::RectangleTree::Node rect2,
+                  double target_aspect)
     {
-        LOG(info) << "Combining rectangles: "
-                  << gnu::autosprintf ("%fx%f",
-                                       rect1->width (), rect1->height ())
-                  << " and "
-                  << gnu::autosprintf ("%fx%f",
-                                       rect2->width (), rect2->height ());
-
-
-        double rect1_aspect = rect1->aspect_ratio ();
-        double rect2_aspect = rect2->aspect_ratio ();
+        double rect1_aspect = tree.aspect_ratio (rect1);
+        double rect2_aspect = tree.aspect_ratio (rect2);
 
         double vertical_ratio =
             rect1_aspect * rect2_aspect / (rect1_aspect + rect2_aspect);
@@ -49,10 +45,12 @@ namespace {
         g_assert (horizontal_ratio_ratio <= 1);
 
         if (vertical_ratio_ratio > horizontal_ratio_ratio)
-            return ipa::VCompositeRectangle::create (rect1, rect2);
+            tree.combine_into (node, ipa::RectangleTree::VERTICAL,
+                               rect1, rect2);
 
         else
-            return ipa::HCompositeRectangle::create (rect1, rect2);
+            tree.combine_into (node, ipa::RectangleTree::HORIZONTAL,
+                               rect1, rect2);
     }
 
 
@@ -64,31 +62,171 @@ namespace {
         typedef std::shared_ptr<BinPackerImpl> Ptr;
         using nihpp::SharedPtrCreator<BinPackerImpl>::create;
 
-        BinPackerImpl ();
+        // Key by which the rectangles are sorted before each pairing round,
+        // so that neighbours with similar keys get combined
+        typedef std::function<double (const ipa::RectangleTree &,
+                                      ipa::RectangleTree::Node)> SortKey;
+
+        BinPackerImpl (std::string description, SortKey sort_key);
         virtual ~BinPackerImpl () {}
 
         virtual void target_aspect (double aspect_ratio);
-        virtual void source_rectangles (RectangleList rectangles);
+        virtual void source_rectangles (ipa::RectangleTree::Ptr tree,
+                                        ipa::RectangleTree::NodeList nodes);
 
-        virtual ipa::Rectangle::Ptr result ();
+        virtual ipa::RectangleTree::Node result ();
 
     private:
         virtual void run ();
+        void sort_rectangles ();
+
+        const SortKey sort_key;
 
         double aspect_ratio;
-        RectangleList rectangles;
+        ipa::RectangleTree::Ptr tree;
+        ipa::RectangleTree::NodeList rectangles;
     };
+
+
+    std::vector<ipa::BinPacker::Strategy> builtin_strategies ()
+    {
+        typedef ipa::BinPacker::Strategy Strategy;
+        std::vector<Strategy> strategies;
+
+        strategies.push_back (Strategy {
+                "greedy-pairs",
+                "Combines neighbouring images in list order",
+                0, 1e-6, false,
+                [] () -> ipa::BinPacker::Ptr {
+                    return BinPackerImpl::create ("BinPacker[greedy-pairs]",
+                                                  nullptr);
+                }});
+
+        strategies.push_back (Strategy {
+                "aspect-sorted",
+                "Combines images of similar aspect ratios first",
+                1, 2e-6, false,
+                [] () -> ipa::BinPacker::Ptr {
+                    return BinPackerImpl::create (
+                        "BinPacker[aspect-sorted]",
+                        [] (const ipa::RectangleTree &tree,
+                            ipa::RectangleTree::Node node) {
+                            return tree.aspect_ratio (node);
+                        });
+                }});
+
+        strategies.push_back (Strategy {
+                "area-balanced",
+                "Combines images of similar areas first",
+                2, 2e-6, false,
+                [] () -> ipa::BinPacker::Ptr {
+                    return BinPackerImpl::create (
+                        "BinPacker[area-balanced]",
+                        [] (const ipa::RectangleTree &tree,
+                            ipa::RectangleTree::Node node) {
+                            return tree.width (node) * tree.height (node);
+                        });
+                }});
+
+        strategies.push_back (Strategy {
+                "search",
+                "Searches for the best packing until time runs out",
+                3, 1e-4, true,
+                [] () -> ipa::BinPacker::Ptr {
+                    return ipa::SearchPacker::create ();
+                }});
+
+        return strategies;
+    }
+
+    // Registered strategies, only touched from the main thread
+    std::vector<ipa::BinPacker::Strategy> &registry ()
+    {
+        static std::vector<ipa::BinPacker::Strategy> strategies =
+            builtin_strategies ();
+
+        return strategies;
+    }
 }
 
 
 // BinPacker definitions
 ipa::BinPacker::Ptr ipa::BinPacker::create ()
 {
-    return BinPackerImpl::create ();
+    return create ("greedy-pairs");
+}
+
+ipa::BinPacker::Ptr ipa::BinPacker::create (const std::string &strategy)
+{
+    for (const Strategy &i : registry ())
+        if (i.name == strategy)
+            return i.create ();
+
+    throw std::invalid_argument ("Unknown packing strategy: " + strategy);
+}
+
+ipa::BinPacker::Ptr ipa::BinPacker::create_for_budget (double seconds,
+                                                       std::size_t nrectangles)
+{
+    const std::vector<Strategy> &strategies = registry ();
+    g_assert (!strategies.empty ());
+
+    const Strategy *fastest = &strategies.front ();
+    const Strategy *best = nullptr;
+
+    for (const Strategy &i : strategies) {
+        if (i.cost < fastest->cost)
+            fastest = &i;
+
+        if (i.cost * nrectangles > seconds)
+            continue;
+
+        if (!best || i.quality > best->quality ||
+            (i.quality == best->quality && i.cost < best->cost))
+            best = &i;
+    }
+
+    if (!best)
+        best = fastest;
+
+    LOG(info) << "Using packing strategy " << best->name << " for "
+              << nrectangles << " rectangles within " << seconds << "s";
+
+    Ptr packer = best->create ();
+
+    if (best->uses_budget)
+        packer->time_budget (seconds);
+
+    return packer;
+}
+
+void ipa::BinPacker::register_strategy (Strategy strategy)
+{
+    for (Strategy &i : registry ()) {
+        if (i.name == strategy.name) {
+            i = std::move (strategy);
+            return;
+        }
+    }
+
+    registry ().push_back (std::move (strategy));
 }
 
-BinPackerImpl::BinPackerImpl () :
-    AsyncOperation ("BinPacker"),
+std::vector<ipa::BinPacker::Strategy> ipa::BinPacker::strategies ()
+{
+    return registry ();
+}
+
+ipa::BinPacker::Progress ipa::BinPacker::progress_result ()
+{
+    return Progress {nullptr, ipa::RectangleTree::INVALID_NODE};
+}
+
+
+// BinPackerImpl definitions
+BinPackerImpl::BinPackerImpl (std::string description, SortKey sort_key) :
+    AsyncOperation (std::move (description)),
+    sort_key (std::move (sort_key)),
     aspect_ratio (1)
 {
 }
@@ -98,45 +236,84 @@ void BinPackerImpl::target_aspect (double aspect_ratio)
     this->aspect_ratio = aspect_ratio;
 }
 
-void BinPackerImpl::source_rectangles (RectangleList rectangles)
+void BinPackerImpl::source_rectangles (ipa::RectangleTree::Ptr tree,
+                                       ipa::RectangleTree::NodeList nodes)
 {
-    this->rectangles = std::move (rectangles);
+    this->tree = std::move (tree);
+    this->rectangles = std::move (nodes);
 }
 
 void BinPackerImpl::run ()
 {
-    do {
-        std::list<ipa::Rectangle::Ptr> accumulator;
+    // Pairs per chunk, below which spreading a round over threads costs more
+    // than it saves
+    const std::size_t grain = 1024;
+
+    ip::Util::ThreadPool &pool = ip::Util::ThreadPool::instance ();
+    ipa::RectangleTree::NodeList accumulator;
+
+    while (rectangles.size () > 1) {
+        testcancelled ();
+        sort_rectangles ();
+
+        std::size_t npairs = rectangles.size () / 2;
+
+        // Pairs are disjoint, so each one is combined into its own node of a
+        // consecutive block, numbered in the same order as the serial loop
+        // would allocate them
+        ipa::RectangleTree::Node first = tree->allocate_composites (npairs);
+        accumulator.resize ((rectangles.size () + 1) / 2);
+
+        pool.parallel_for (0, npairs, grain,
+                           [&] (std::size_t begin, std::size_t end) {
+                               for (std::size_t i = begin; i < end; i++) {
+                                   testcancelled ();
+
+                                   combine (*tree, first + i,
+                                            rectangles[2 * i],
+                                            rectangles[2 * i + 1],
+                                            aspect_ratio);
+                                   accumulator[i] = first + i;
+                               }
+                           });
+
+        if (rectangles.size () % 2)
+            accumulator.back () = rectangles.back ();
+
+        rectangles.swap (accumulator);
+    }
 
-        while (!rectangles.empty ()) {
-            testcancelled ();
+    if (rectangles.size () == 1)
+        tree->layout (rectangles.front ());
+}
 
-            using ipa::Rectangle;
+void BinPackerImpl::sort_rectangles ()
+{
+    if (!sort_key)
+        return;
 
-            Rectangle::Ptr rect1 = rectangles.front ();
-            rectangles.pop_front ();
+    typedef std::pair<double, ipa::RectangleTree::Node> Keyed;
 
-            if (rectangles.empty ()) {
-                accumulator.push_back (rect1);
-                break;
-            }
+    std::vector<Keyed> keyed;
+    keyed.reserve (rectangles.size ());
 
-            Rectangle::Ptr rect2 = rectangles.front ();
-            rectangles.pop_front ();
+    for (ipa::RectangleTree::Node node : rectangles)
+        keyed.push_back (Keyed (sort_key (*tree, node), node));
 
-            accumulator.push_back (combine (rect1, rect2, aspect_ratio));
-        }
+    std::stable_sort (keyed.begin (), keyed.end (),
+                      [] (const Keyed &a, const Keyed &b)
+                      {return a.first < b.first;});
 
-        rectangles = std::move (accumulator);
-    } while (rectangles.size () > 1);
+    for (std::size_t i = 0; i < keyed.size (); i++)
+        rectangles[i] = keyed[i].second;
 }
 
-ipa::Rectangle::Ptr BinPackerImpl::result ()
+ipa::RectangleTree::Node BinPackerImpl::result ()
 {
     int nrectangles = rectangles.size ();
 
     if (nrectangles != 1)
-        return ipa::Rectangle::Ptr ();
+        return ipa::RectangleTree::INVALID_NODE;
 
     return rectangles.front ();
 }
@@ -1,7 +1,9 @@
 #ifndef IMGPACK_BINPACKER_HH
 #define IMGPACK_BINPACKER_HH
 
+#include <functional>
 #include <memory>
+#include <string>
 #include <vector>
 
 #include <imgpack/util/async-operation.hh>
@@ -15,19 +17,82 @@ namespace ImgPack
         {
         public:
             typedef std::shared_ptr<BinPacker> Ptr;
-            typedef std::list<Rectangle::Ptr> RectangleList;
+            struct Strategy;
+            struct Progress;
 
+            // Creates a packer using the default strategy, greedy-pairs
             static Ptr create ();
+
+            // Creates a packer using the named strategy. Throws
+            // std::invalid_argument if no such strategy is registered.
+            static Ptr create (const std::string &strategy);
+
+            // Creates a packer using the best strategy expected to pack
+            // nrectangles within the given number of seconds, or the fastest
+            // one if none is. Strategies which use up their whole time budget
+            // are handed the given one.
+            static Ptr create_for_budget (double seconds,
+                                          std::size_t nrectangles);
+
+            // Makes a new strategy available by name, replacing any existing
+            // one of the same name
+            static void register_strategy (Strategy strategy);
+            static std::vector<Strategy> strategies ();
+
             virtual ~BinPacker () {}
 
             virtual void target_aspect (double aspect_ratio) = 0;
-            virtual void source_rectangles (RectangleList rectangles) = 0;
 
-            virtual Rectangle::Ptr result () = 0;
+            // Wall-clock time the packer may spend, in seconds. Ignored by
+            // strategies which do not search.
+            virtual void time_budget (double) {}
+
+            // Packs the given parentless nodes of tree. The tree is modified in
+            // place on the worker thread, so it must be left alone until the
+            // operation finishes.
+            virtual void source_rectangles (RectangleTree::Ptr tree,
+                                            RectangleTree::NodeList nodes) = 0;
+
+            // Root of the packed tree, or RectangleTree::INVALID_NODE
+            virtual RectangleTree::Node result () = 0;
+
+            // Best packing published so far by a packer which keeps refining
+            // it, announced by the progress signal. Each one comes in a tree
+            // of its own, copied from the source tree so that leaves keep
+            // their ids. Returns an empty tree if nothing new was published
+            // since the last call.
+            virtual Progress progress_result ();
 
         protected:
             BinPacker () {}
         };
+
+
+        struct BinPacker::Strategy
+        {
+            std::string name;
+            std::string description;
+
+            // Relative quality of the packings produced, higher is better
+            int quality;
+
+            // Rough estimate of the time taken per source rectangle, in
+            // seconds. For strategies which use their time budget, this is
+            // the least time they need to improve on a greedy packing.
+            double cost;
+
+            // Whether the packer keeps going until its time budget runs out
+            bool uses_budget;
+
+            std::function<Ptr ()> create;
+        };
+
+
+        struct BinPacker::Progress
+        {
+            RectangleTree::Ptr tree;
+            RectangleTree::Node root;
+        };
     }
 }
 
@@ -0,0 +1,250 @@
+#include <algorithm>
+#include <limits>
+
+#include <glibmm.h>
+
+#include <imgpack/algorithm/incremental-packer.hh>
+
+namespace ip = ImgPack;
+namespace ipa = ip::Algorithm;
+
+using ipa::IncrementalPacker;
+using ipa::RectangleTree;
+
+namespace {
+    // Scoring a candidate position walks up to the root, so trying all of
+    // them is quadratic in the depth. Only the top levels of the collage are
+    // tried exhaustively, and about this many nodes below them.
+    const unsigned FULL_SEARCH_DEPTH = 8;
+    const std::size_t MAX_CANDIDATES = 1024;
+}
+
+IncrementalPacker::IncrementalPacker (RectangleTree &tree,
+                                      RectangleTree::Node root,
+                                      double target_aspect) :
+    tree (tree),
+    _root (root),
+    target_aspect (target_aspect),
+    total_area (0)
+{
+    update_shapes ();
+}
+
+void IncrementalPacker::insert (RectangleTree::Node leaf)
+{
+    g_assert (tree.is_leaf (leaf) &&
+              tree.parent (leaf) == RectangleTree::INVALID_NODE);
+
+    shapes.resize (tree.size ());
+
+    Shape shape = leaf_shape (leaf);
+    shapes[leaf] = shape;
+    total_area += shape.max_area ();
+
+    if (_root == RectangleTree::INVALID_NODE) {
+        _root = leaf;
+        return;
+    }
+
+    // Try splicing the leaf in beside the nodes of the collage
+    const RectangleTree::Orientation orientations[] = {
+        RectangleTree::HORIZONTAL,
+        RectangleTree::VERTICAL
+    };
+
+    double best_cost = std::numeric_limits<double>::infinity ();
+    RectangleTree::Node best_node = RectangleTree::INVALID_NODE;
+    RectangleTree::Orientation best_orientation = RectangleTree::HORIZONTAL;
+
+    std::size_t stride = std::max<std::size_t> (1,
+                                                tree.size () / MAX_CANDIDATES);
+    std::size_t nvisited = 0;
+
+    struct Visit
+    {
+        RectangleTree::Node node;
+        unsigned depth;
+    };
+
+    std::vector<Visit> stack = {{_root, 0}};
+
+    while (!stack.empty ()) {
+        RectangleTree::Node node = stack.back ().node;
+        unsigned depth = stack.back ().depth;
+        stack.pop_back ();
+
+        if (!tree.is_leaf (node)) {
+            stack.push_back ({tree.child2 (node), depth + 1});
+            stack.push_back ({tree.child1 (node), depth + 1});
+        }
+
+        if (depth > FULL_SEARCH_DEPTH && nvisited++ % stride)
+            continue;
+
+        for (RectangleTree::Orientation orientation : orientations) {
+            double cost = cost_with (node, Shape::combine (orientation,
+                                                           shapes[node],
+                                                           shape));
+
+            if (cost < best_cost) {
+                best_cost = cost;
+                best_node = node;
+                best_orientation = orientation;
+            }
+        }
+    }
+
+    RectangleTree::Node parent = tree.parent (best_node);
+    bool is_child1 = parent != RectangleTree::INVALID_NODE &&
+        tree.child1 (parent) == best_node;
+
+    tree.orphan (best_node);
+    RectangleTree::Node composite = tree.combine (best_orientation,
+                                                  best_node, leaf);
+
+    if (parent == RectangleTree::INVALID_NODE)
+        _root = composite;
+
+    else if (is_child1)
+        tree.child1 (parent, composite);
+
+    else
+        tree.child2 (parent, composite);
+
+    shapes.resize (tree.size ());
+    update_path (composite);
+    rebalance (composite);
+}
+
+void IncrementalPacker::remove (RectangleTree::Node leaf)
+{
+    g_assert (tree.is_leaf (leaf));
+
+    total_area -= shapes[leaf].max_area ();
+
+    RectangleTree::Node parent = tree.parent (leaf);
+
+    if (parent == RectangleTree::INVALID_NODE) {
+        g_assert (leaf == _root);
+        _root = RectangleTree::INVALID_NODE;
+        return;
+    }
+
+    RectangleTree::Node sibling = tree.child1 (parent) == leaf ?
+        tree.child2 (parent) : tree.child1 (parent);
+    RectangleTree::Node grandparent = tree.parent (parent);
+
+    // The sibling takes the place of the parent, which goes away
+    tree.orphan (leaf);
+    tree.orphan (sibling);
+
+    if (grandparent == RectangleTree::INVALID_NODE)
+        _root = sibling;
+
+    else if (tree.child1 (grandparent) == parent)
+        tree.child1 (grandparent, sibling);
+
+    else
+        tree.child2 (grandparent, sibling);
+
+    tree.release (parent);
+
+    if (grandparent != RectangleTree::INVALID_NODE)
+        update_path (grandparent);
+
+    rebalance (sibling);
+}
+
+ipa::Shape IncrementalPacker::leaf_shape (RectangleTree::Node leaf) const
+{
+    double max_height = tree.max_height (leaf);
+
+    return {tree.max_width (leaf) / max_height, max_height};
+}
+
+void IncrementalPacker::update_shapes ()
+{
+    shapes.assign (tree.size (), Shape ());
+    total_area = 0;
+
+    if (_root == RectangleTree::INVALID_NODE)
+        return;
+
+    // Children come after their parents in preorder, so walking it backwards
+    // sees them first
+    RectangleTree::NodeList preorder = {_root};
+
+    for (std::size_t i = 0; i < preorder.size (); i++) {
+        RectangleTree::Node node = preorder[i];
+
+        if (!tree.is_leaf (node)) {
+            preorder.push_back (tree.child1 (node));
+            preorder.push_back (tree.child2 (node));
+        }
+    }
+
+    for (auto i = preorder.rbegin (); i != preorder.rend (); ++i) {
+        RectangleTree::Node node = *i;
+
+        if (tree.is_leaf (node)) {
+            shapes[node] = leaf_shape (node);
+            total_area += shapes[node].max_area ();
+
+        } else {
+            shapes[node] = Shape::combine (tree.orientation (node),
+                                           shapes[tree.child1 (node)],
+                                           shapes[tree.child2 (node)]);
+        }
+    }
+}
+
+void IncrementalPacker::update_path (RectangleTree::Node node)
+{
+    for (; node != RectangleTree::INVALID_NODE; node = tree.parent (node)) {
+        if (tree.is_leaf (node))
+            continue;
+
+        shapes[node] = Shape::combine (tree.orientation (node),
+                                       shapes[tree.child1 (node)],
+                                       shapes[tree.child2 (node)]);
+    }
+}
+
+double IncrementalPacker::cost_with (RectangleTree::Node node,
+                                     const Shape &shape) const
+{
+    Shape root = shape;
+
+    for (RectangleTree::Node parent = tree.parent (node);
+         parent != RectangleTree::INVALID_NODE;
+         node = parent, parent = tree.parent (parent)) {
+        RectangleTree::Node sibling = tree.child1 (parent) == node ?
+            tree.child2 (parent) : tree.child1 (parent);
+
+        root = Shape::combine (tree.orientation (parent),
+                               root, shapes[sibling]);
+    }
+
+    return packing_cost (root, target_aspect, total_area);
+}
+
+void IncrementalPacker::rebalance (RectangleTree::Node node)
+{
+    for (; node != RectangleTree::INVALID_NODE; node = tree.parent (node)) {
+        if (tree.is_leaf (node))
+            continue;
+
+        RectangleTree::Orientation flipped =
+            tree.orientation (node) == RectangleTree::HORIZONTAL ?
+            RectangleTree::VERTICAL : RectangleTree::HORIZONTAL;
+
+        Shape shape = Shape::combine (flipped,
+                                      shapes[tree.child1 (node)],
+                                      shapes[tree.child2 (node)]);
+
+        if (cost_with (node, shape) < cost_with (node, shapes[node])) {
+            tree.orientation (node, flipped);
+            update_path (node);
+        }
+    }
+}
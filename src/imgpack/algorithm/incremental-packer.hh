@@ -0,0 +1,60 @@
+#ifndef IMGPACK_ALGORITHMS_INCREMENTAL_PACKER_HH
+#define IMGPACK_ALGORITHMS_INCREMENTAL_PACKER_HH
+
+#include <vector>
+
+#include <imgpack/algorithm/rectangles.hh>
+#include <imgpack/algorithm/shape.hh>
+
+namespace ImgPack
+{
+    namespace Algorithm
+    {
+        // Applies insertions and deletions of leaves to an already packed
+        // tree, instead of packing everything again. Subtrees away from the
+        // changes are left as they are.
+        //
+        // New leaves are spliced in beside whichever node gives the best
+        // packing_cost () for the whole collage, and removed leaves are
+        // replaced by their sibling. Either way, composite nodes along the
+        // path to the root are then flipped wherever that lowers the cost.
+        // This runs on the calling thread, and the tree has to be laid out
+        // again afterwards.
+        class IncrementalPacker
+        {
+        public:
+            // root may be RectangleTree::INVALID_NODE for an empty collage
+            IncrementalPacker (RectangleTree &tree, RectangleTree::Node root,
+                               double target_aspect);
+
+            // Adds a parentless leaf to the collage
+            void insert (RectangleTree::Node leaf);
+
+            // Removes a leaf from the collage, leaving it parentless
+            void remove (RectangleTree::Node leaf);
+
+            RectangleTree::Node root () const {return _root;}
+
+        private:
+            Shape leaf_shape (RectangleTree::Node leaf) const;
+            void update_shapes ();
+            void update_path (RectangleTree::Node node);
+
+            // Cost of the collage if node had the given shape
+            double cost_with (RectangleTree::Node node,
+                              const Shape &shape) const;
+
+            void rebalance (RectangleTree::Node node);
+
+            RectangleTree      &tree;
+            RectangleTree::Node _root;
+            double              target_aspect;
+            double              total_area;
+
+            // Shape of every node in the collage, indexed by node
+            std::vector<Shape>  shapes;
+        };
+    }
+}
+
+#endif  // IMGPACK_ALGORITHMS_INCREMENTAL_PACKER_HH
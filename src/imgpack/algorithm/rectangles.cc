@@ -1,298 +1,557 @@
 #include <imgpack/algorithm/rectangles.hh>
 #include <imgpack/util/logger.hh>
-#include <limits>
+#include <algorithm>
+#include <cmath>
 #include <glibmm.h>
 
 namespace ip = ImgPack;
 namespace ipa = ip::Algorithm;
 
-using ipa::Rectangle;
-using ipa::CompositeRectangle;
-using ipa::HCompositeRectangle;
-using ipa::VCompositeRectangle;
-
-CompositeRectangle::Ptr Rectangle::parent () const
-{
-    return _parent ? _parent->shared_from_this () : CompositeRectangle::Ptr ();
-}
-
-void Rectangle::parent (CompositeRectangle *new_parent)
-{
-    if (_parent == new_parent)
-        return;
-
-    // Move _parent away in case of recursion
-    CompositeRectangle* tmp = _parent;
-    _parent = nullptr;
+using ipa::RectangleTree;
+
+const RectangleTree::Node RectangleTree::INVALID_NODE;
+
+RectangleTree::RectangleTree (const RectangleTree &other) :
+    nihpp::SharedPtrCreator<RectangleTree> (other),
+    _orientation (other._orientation),
+    _parent (other._parent),
+    _child1 (other._child1),
+    _child2 (other._child2),
+    _width (other._width),
+    _height (other._height),
+    _max_width (other._max_width),
+    _max_height (other._max_height),
+    _scale (other._scale),
+    _dirty (other._dirty),
+    _npending (other._npending.load ()),
+    _x (other._x),
+    _y (other._y),
+    _placed_width (other._placed_width),
+    _placed_height (other._placed_height),
+    _unplaced (other._unplaced),
+    _free (other._free)
+{
+}
+
+void RectangleTree::reserve (std::size_t nleaves)
+{
+    // A full slicing tree over n leaves has n - 1 composite nodes
+    std::size_t nnodes = nleaves ? 2 * nleaves - 1 : 0;
+
+    _orientation.reserve (nnodes);
+    _parent.reserve (nnodes);
+    _child1.reserve (nnodes);
+    _child2.reserve (nnodes);
+    _width.reserve (nnodes);
+    _height.reserve (nnodes);
+    _max_width.reserve (nnodes);
+    _max_height.reserve (nnodes);
+    _scale.reserve (nnodes);
+    _dirty.reserve (nnodes);
+    _x.reserve (nnodes);
+    _y.reserve (nnodes);
+    _placed_width.reserve (nnodes);
+    _placed_height.reserve (nnodes);
+    _unplaced.reserve (nnodes);
+}
+
+RectangleTree::Node RectangleTree::allocate (Orientation orientation)
+{
+    Node node;
+
+    if (!_free.empty ()) {
+        node = _free.back ();
+        _free.pop_back ();
+
+    } else {
+        node = size ();
+        grow (1);
+    }
 
-    if (tmp)
-        tmp->orphan_child (*this);
+    if (_scale[node] != 1)
+        --_npending;
 
-    g_assert (!tmp || (tmp->child1 ().get () != this &&
-                       tmp->child2 ().get () != this));
+    _orientation[node] = orientation;
+    _parent[node] = INVALID_NODE;
+    _child1[node] = INVALID_NODE;
+    _child2[node] = INVALID_NODE;
+    _scale[node] = 1;
+    _dirty[node] = orientation != NONE;
+    _unplaced[node] = true;
 
-    _parent = new_parent;
+    return node;
 }
 
-void Rectangle::child1 (Ptr)
+void RectangleTree::grow (std::size_t count)
 {
-    g_assert_not_reached ();
-}
+    std::size_t nnodes = size () + count;
+    g_assert (nnodes <= INVALID_NODE);
 
-void Rectangle::child2 (Ptr)
-{
-    g_assert_not_reached ();
+    _orientation.resize (nnodes, NONE);
+    _parent.resize (nnodes, INVALID_NODE);
+    _child1.resize (nnodes, INVALID_NODE);
+    _child2.resize (nnodes, INVALID_NODE);
+    _width.resize (nnodes, 0);
+    _height.resize (nnodes, 0);
+    _max_width.resize (nnodes, 0);
+    _max_height.resize (nnodes, 0);
+    _scale.resize (nnodes, 1);
+    _dirty.resize (nnodes, false);
+    _x.resize (nnodes, 0);
+    _y.resize (nnodes, 0);
+    _placed_width.resize (nnodes, 0);
+    _placed_height.resize (nnodes, 0);
+    _unplaced.resize (nnodes, true);
 }
 
-double Rectangle::offset_x ()
+RectangleTree::Node RectangleTree::allocate_composites (std::size_t count)
 {
-    if (!_parent)
-        return 0;
+    Node first = size ();
+    grow (count);
 
-    double parent_x = _parent->offset_x ();
+    return first;
+}
 
-    if (_parent->orientation () == VERTICAL)
-        return parent_x;
+RectangleTree::Node RectangleTree::add_leaf (double width, double height)
+{
+    Node node = allocate (NONE);
 
-    auto child1 = _parent->child1 ();
-    if (child1.get () == this)
-        return parent_x;
+    _width[node] = _max_width[node] = width;
+    _height[node] = _max_height[node] = height;
 
-    return child1->width () + parent_x;
+    return node;
 }
 
-double Rectangle::offset_y ()
+RectangleTree::Node RectangleTree::combine (Orientation orientation,
+                                            Node child1, Node child2)
 {
-    if (!_parent)
-        return 0;
+    Node node = allocate (orientation);
+    combine_into (node, orientation, child1, child2);
 
-    double parent_y = _parent->offset_y ();
+    return node;
+}
 
-    if (_parent->orientation () == HORIZONTAL)
-        return parent_y;
+void RectangleTree::combine_into (Node node, Orientation orientation,
+                                  Node child1, Node child2)
+{
+    g_assert (orientation != NONE);
+    g_assert (_parent[node] == INVALID_NODE &&
+              _child1[node] == INVALID_NODE &&
+              _child2[node] == INVALID_NODE);
+    g_assert (_parent[child1] == INVALID_NODE &&
+              _parent[child2] == INVALID_NODE);
 
-    auto child1 = _parent->child1 ();
-    if (child1.get () == this)
-        return parent_y;
+    _orientation[node] = orientation;
+    _child1[node] = child1;
+    _child2[node] = child2;
+    _parent[child1] = node;
+    _parent[child2] = node;
+    _dirty[node] = true;
 
-    return child1->height () + parent_y;
+    // node is parentless, so this stays within its own subtree
+    recalculate_size (node);
 }
 
-Rectangle::Ptr Rectangle::find_rect (double x, double y)
+void RectangleTree::release (Node node)
 {
-    if (x <= width () && y <= height ())
-        return shared_from_this ();
+    g_assert (_parent[node] == INVALID_NODE &&
+              _child1[node] == INVALID_NODE &&
+              _child2[node] == INVALID_NODE);
 
-    else
-        return Rectangle::Ptr ();
+    _free.push_back (node);
 }
 
-
-CompositeRectangle::CompositeRectangle (Rectangle::Ptr rect1,
-                                        Rectangle::Ptr rect2) :
-    _children {rect1, rect2}
+double RectangleTree::width (Node node) const
 {
-    rect1->parent (this);
-    rect2->parent (this);
+    resolve (node);
+    update (node);
+    return _width[node];
 }
 
-Rectangle::Ptr CompositeRectangle::child1 ()
+double RectangleTree::height (Node node) const
 {
-    return _children.first;
+    resolve (node);
+    update (node);
+    return _height[node];
 }
 
-Rectangle::Ptr CompositeRectangle::child2 ()
+void RectangleTree::width (Node node, double new_width)
 {
-    return _children.second;
-}
+    double old_width = width (node);
 
-namespace {
-    void set_child (Rectangle::Ptr &dest, Rectangle::Ptr &child,
-                    CompositeRectangle &parent)
-    {
-        if (dest == child)
-            return;
+    if (std::abs (new_width - old_width) < 0.001)
+        return;
+
+    if (new_width - _max_width[node] > 0.001) {
+        LOG(error) << "Attempting to upscale rectangle by width: "
+                   << _max_width[node] << " -> " << new_width;
+        g_assert_not_reached ();
+    }
 
-        Rectangle::Ptr old_child = std::move (dest);
+    scale (node, new_width / old_width);
+}
 
-        if (old_child)
-            old_child->parent (nullptr);
+void RectangleTree::height (Node node, double new_height)
+{
+    double old_height = height (node);
 
-        if (child)
-            child->parent (&parent);
+    if (std::abs (new_height - old_height) < 0.001)
+        return;
 
-        dest = std::move (child);
+    if (new_height - _max_height[node] > 0.001) {
+        LOG(error) << "Attempting to upscale rectangle by height: "
+                   << _max_height[node] << " -> " << new_height;
+        g_assert_not_reached ();
     }
-}
 
-void CompositeRectangle::child1 (Rectangle::Ptr child)
-{
-    set_child (_children.first, child, *this);
-    recalculate_size ();
+    scale (node, new_height / old_height);
 }
 
-void CompositeRectangle::child2 (Rectangle::Ptr child)
+void RectangleTree::scale (Node node, double factor)
 {
-    set_child (_children.second, child, *this);
-    recalculate_size ();
+    // Only the dimensions of node itself are touched. Its subtree picks up the
+    // new scale lazily through push_scale ().
+    _width[node] *= factor;
+    _height[node] *= factor;
+
+    if (!is_leaf (node)) {
+        if (_scale[node] == 1)
+            ++_npending;
+
+        _scale[node] *= factor;
+    }
+
+    if (_parent[node] != INVALID_NODE)
+        invalidate (_parent[node]);
 }
 
-void CompositeRectangle::orphan_child (Rectangle &child)
+void RectangleTree::push_scale (Node node) const
 {
-    if (_children.first.get () == &child)
-        _children.first.reset ();
+    double scale = _scale[node];
+
+    if (scale == 1)
+        return;
+
+    Node children[] = {_child1[node], _child2[node]};
+
+    for (Node child : children) {
+        if (child == INVALID_NODE)
+            continue;
+
+        _width[child] *= scale;
+        _height[child] *= scale;
+
+        if (!is_leaf (child)) {
+            if (_scale[child] == 1)
+                ++_npending;
+
+            _scale[child] *= scale;
+        }
+    }
 
-    else if (child2 ().get () == &child)
-        _children.second.reset ();
+    _scale[node] = 1;
+    --_npending;
 }
 
-void CompositeRectangle::recalculate_size ()
+void RectangleTree::resolve (Node node) const
 {
-    recalculate_size_impl ();
+    if (!_npending)
+        return;
+
+    Node top = INVALID_NODE;
+
+    for (Node parent = _parent[node]; parent != INVALID_NODE;
+         parent = _parent[parent])
+        if (_scale[parent] != 1)
+            top = parent;
+
+    if (top == INVALID_NODE)
+        return;
+
+    // Pending scales have to be applied from the top down, through every
+    // ancestor in between
+    NodeList path;
 
-    if (parent ())
-        parent ()->recalculate_size ();
+    for (Node parent = _parent[node]; parent != top; parent = _parent[parent])
+        path.push_back (parent);
+
+    push_scale (top);
+
+    for (auto i = path.rbegin (); i != path.rend (); ++i)
+        push_scale (*i);
 }
 
-std::shared_ptr<const CompositeRectangle>
-CompositeRectangle::shared_from_this () const
+double RectangleTree::max_width (Node node) const
 {
-    return std::static_pointer_cast<const CompositeRectangle>
-        (Rectangle::shared_from_this ());
+    resolve (node);
+    update (node);
+    return _max_width[node];
 }
 
-CompositeRectangle::Ptr CompositeRectangle::shared_from_this ()
+double RectangleTree::max_height (Node node) const
 {
-    return std::static_pointer_cast<CompositeRectangle>
-        (Rectangle::shared_from_this ());
+    resolve (node);
+    update (node);
+    return _max_height[node];
 }
 
-
-
-// HCompositeRectangle definitions
-HCompositeRectangle::HCompositeRectangle (ipa::Rectangle::Ptr rect1,
-                                          ipa::Rectangle::Ptr rect2) :
-    CompositeRectangle (rect1, rect2)
+void RectangleTree::invalidate (Node node)
 {
-    recalculate_size ();
+    if (is_leaf (node))
+        node = _parent[node];
+
+    for (; node != INVALID_NODE && !_dirty[node]; node = _parent[node])
+        _dirty[node] = true;
 }
 
-double HCompositeRectangle::width ()
+void RectangleTree::unplace (Node node)
 {
-    return child1 ()->width () + child2 ()->width ();
+    for (; node != INVALID_NODE && !_unplaced[node]; node = _parent[node])
+        _unplaced[node] = true;
 }
 
-void HCompositeRectangle::height (double new_height)
+void RectangleTree::update (Node node) const
 {
-    LOG(info) << "Scaling composite by height: "
-              << height () << " -> " << new_height;
+    if (!_dirty[node])
+        return;
 
-    child1 ()->height (new_height);
-    child2 ()->height (new_height);
+    Node child1 = _child1[node];
+    Node child2 = _child2[node];
+
+    push_scale (node);
+    update (child1);
+    update (child2);
+
+    if (orientation (node) == HORIZONTAL) {
+        _width[node] = _width[child1] + _width[child2];
+        _height[node] = _height[child1];
+        _max_height[node] = std::min (_max_height[child1],
+                                      _max_height[child2]);
+        _max_width[node] =
+            _width[node] / _height[node] * _max_height[node];
+
+    } else {
+        _width[node] = _width[child1];
+        _height[node] = _height[child1] + _height[child2];
+        _max_width[node] = std::min (_max_width[child1],
+                                     _max_width[child2]);
+        _max_height[node] =
+            _max_width[node] / (_width[node] / _height[node]);
+    }
 
-    g_assert (std::abs (new_height - child1 ()->height ()) < 0.001 &&
-              std::abs (new_height - child2 ()->height ()) < 0.001);
+    _dirty[node] = false;
 }
 
-void HCompositeRectangle::width (double new_width)
+void RectangleTree::orientation (Node node, Orientation orientation)
 {
-    double new_height = new_width / aspect_ratio ();
-    height (new_height);
-}
+    g_assert (!is_leaf (node) && orientation != NONE);
 
-double HCompositeRectangle::max_height ()
-{
-    return std::min (child1 ()->max_height (), child2 ()->max_height ());
+    if (_orientation[node] == orientation)
+        return;
+
+    _orientation[node] = orientation;
+    invalidate (node);
+    unplace (node);
+
+    recalculate_size (node);
 }
 
-double HCompositeRectangle::max_width ()
+RectangleTree::Node RectangleTree::root (Node node) const
 {
-    return aspect_ratio () * max_height ();
+    while (_parent[node] != INVALID_NODE)
+        node = _parent[node];
+
+    return node;
 }
 
-void HCompositeRectangle::recalculate_size_impl ()
+void RectangleTree::set_child (Node node, NodeList &slots, Node child)
 {
-    double common_height = std::min (child1 ()->max_height (),
-                                     child2 ()->max_height ());
+    g_assert (!is_leaf (node));
 
-    LOG(info) << "Equalizing height to " << common_height;
+    Node &dest = slots[node];
 
-    child1 ()->height (common_height);
-    child2 ()->height (common_height);
+    if (dest == child)
+        return;
 
-    g_assert (std::abs (common_height - child1 ()->height ()) < 0.001 &&
-              std::abs (common_height - child2 ()->height ()) < 0.001);
-}
+    // Settle pending scales, as the old child is about to leave the subtree
+    resolve (node);
+    push_scale (node);
 
-Rectangle::Ptr
-HCompositeRectangle::find_rect (const double x, const double y)
-{
-    if (x < child1 ()->width ())
-        return child1 ()->find_rect (x, y);
+    if (dest != INVALID_NODE)
+        _parent[dest] = INVALID_NODE;
 
-    return child2 ()->find_rect (x - child1 ()->width (), y);
+    if (child != INVALID_NODE) {
+        orphan (child);
+        _parent[child] = node;
+    }
+
+    dest = child;
+    invalidate (node);
+    unplace (node);
 }
 
-
-// VCompositeRectangle definitions
-VCompositeRectangle::VCompositeRectangle (ipa::Rectangle::Ptr rect1,
-                                          ipa::Rectangle::Ptr rect2) :
-    CompositeRectangle (rect1, rect2)
+void RectangleTree::child1 (Node node, Node child)
 {
-    recalculate_size ();
+    set_child (node, _child1, child);
+    recalculate_size (node);
 }
 
-double VCompositeRectangle::height ()
+void RectangleTree::child2 (Node node, Node child)
 {
-    return child1 ()->height () + child2 ()->height ();
+    set_child (node, _child2, child);
+    recalculate_size (node);
 }
 
-void VCompositeRectangle::width (double new_width)
+void RectangleTree::orphan (Node node)
 {
-    LOG(info) << "Scaling composite by width: "
-              << width () << " -> " << new_width;
-    child1 ()->width (new_width);
-    child2 ()->width (new_width);
+    Node parent = _parent[node];
 
-    g_assert (std::abs (new_width - child1 ()->width ()) < 0.001 &&
-              std::abs (new_width - child2 ()->width ()) < 0.001);
-}
+    if (parent == INVALID_NODE)
+        return;
 
-void VCompositeRectangle::height (double new_height)
-{
-    double new_width = new_height * aspect_ratio ();
-    width (new_width);
+    resolve (node);
+
+    if (_child1[parent] == node)
+        _child1[parent] = INVALID_NODE;
+
+    else if (_child2[parent] == node)
+        _child2[parent] = INVALID_NODE;
+
+    _parent[node] = INVALID_NODE;
+    invalidate (parent);
+    unplace (parent);
 }
 
-double VCompositeRectangle::max_height ()
+void RectangleTree::recalculate_size (Node node)
 {
-    return max_width () / aspect_ratio ();
+    for (; node != INVALID_NODE; node = _parent[node])
+        recalculate_size_impl (node);
 }
 
-double VCompositeRectangle::max_width ()
+void RectangleTree::recalculate_size_impl (Node node)
 {
-    return std::min (child1 ()->max_width (), child2 ()->max_width ());
+    Node child1 = _child1[node];
+    Node child2 = _child2[node];
+
+    switch (orientation (node)) {
+    case HORIZONTAL:
+    {
+        double common_height = std::min (max_height (child1),
+                                         max_height (child2));
+
+        height (child1, common_height);
+        height (child2, common_height);
+
+        g_assert (std::abs (common_height - height (child1)) < 0.001 &&
+                  std::abs (common_height - height (child2)) < 0.001);
+        break;
+    }
+
+    case VERTICAL:
+    {
+        double common_width = std::min (max_width (child1),
+                                        max_width (child2));
+
+        width (child1, common_width);
+        width (child2, common_width);
+
+        g_assert (std::abs (common_width - width (child1)) < 0.001 &&
+                  std::abs (common_width - width (child2)) < 0.001);
+        break;
+    }
+
+    default:
+        break;
+    }
 }
 
-void VCompositeRectangle::recalculate_size_impl ()
+void RectangleTree::layout (Node root)
 {
-    double common_width = std::min (child1 ()->max_width (),
-                                    child2 ()->max_width ());
+    g_assert (_parent[root] == INVALID_NODE);
+
+    struct Placement
+    {
+        Node node;
+        double x, y;
+    };
+
+    std::vector<Placement> stack;
+    stack.push_back ({root, 0, 0});
+
+    while (!stack.empty ()) {
+        Node node = stack.back ().node;
+        double x = stack.back ().x;
+        double y = stack.back ().y;
+        stack.pop_back ();
+
+        // Pending scales of the parent were pushed down before node was
+        // queued, so its stored dimensions are its real ones
+        update (node);
+
+        if (!_unplaced[node] && _scale[node] == 1 &&
+            _x[node] == x && _y[node] == y &&
+            _placed_width[node] == _width[node] &&
+            _placed_height[node] == _height[node])
+            continue;
+
+        _x[node] = x;
+        _y[node] = y;
+        _placed_width[node] = _width[node];
+        _placed_height[node] = _height[node];
+        _unplaced[node] = false;
 
-    LOG(info) << "Equalizing width to " << common_width;
+        if (is_leaf (node))
+            continue;
 
-    child1 ()->width (common_width);
-    child2 ()->width (common_width);
+        Node child1 = _child1[node];
+        Node child2 = _child2[node];
 
-    g_assert (std::abs (common_width - child1 ()->width ()) < 0.001 &&
-              std::abs (common_width - child2 ()->width ()) < 0.001);
+        push_scale (node);
+        update (child1);
+
+        stack.push_back ({child1, x, y});
+
+        if (orientation (node) == HORIZONTAL)
+            stack.push_back ({child2, x + _width[child1], y});
+
+        else
+            stack.push_back ({child2, x, y + _height[child1]});
+    }
 }
 
-Rectangle::Ptr
-VCompositeRectangle::find_rect (const double x, const double y)
+RectangleTree::Node RectangleTree::find_rect (Node node,
+                                              double x, double y) const
 {
-    if (y < child1 ()->height ())
-        return child1 ()->find_rect (x, y);
+    resolve (node);
+
+    while (!is_leaf (node)) {
+        Node child1 = _child1[node];
+
+        push_scale (node);
+        update (child1);
+
+        if (orientation (node) == HORIZONTAL) {
+            if (x < _width[child1])
+                node = child1;
+
+            else {
+                x -= _width[child1];
+                node = _child2[node];
+            }
+
+        } else {
+            if (y < _height[child1])
+                node = child1;
+
+            else {
+                y -= _height[child1];
+                node = _child2[node];
+            }
+        }
+    }
+
+    if (x <= _width[node] && y <= _height[node])
+        return node;
 
-    return child2 ()->find_rect (x, y - child1 ()->height ());
+    return INVALID_NODE;
 }
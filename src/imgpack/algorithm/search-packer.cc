@@ -0,0 +1,608 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <random>
+#include <vector>
+
+#include <nihpp/sharedptrcreator.hh>
+
+#include <imgpack/algorithm/search-packer.hh>
+#include <imgpack/algorithm/shape.hh>
+#include <imgpack/util/thread-pool.hh>
+#include <imgpack/util/logger.hh>
+
+namespace ip = ImgPack;
+namespace ipa = ip::Algorithm;
+namespace ipu = ip::Util;
+
+namespace {
+    typedef std::chrono::steady_clock Clock;
+
+    // Slicing trees are searched as postfix (Polish) expressions. Operands
+    // are indices into the source rectangles, and operators combine the top
+    // two subtrees on the stack.
+    typedef std::int32_t Token;
+    typedef std::vector<Token> Expression;
+
+    const Token HORIZONTAL_OP = -1;
+    const Token VERTICAL_OP = -2;
+
+    bool is_operand (Token token) {return token >= 0;}
+
+    double le1_ratio (const double v1, const double v2)
+    {
+        return (v1 < v2) ? v1 / v2 : v2 / v1;
+    }
+
+    typedef ipa::Shape Shape;
+
+    ipa::RectangleTree::Orientation orientation (Token op)
+    {
+        return op == HORIZONTAL_OP ?
+            ipa::RectangleTree::HORIZONTAL : ipa::RectangleTree::VERTICAL;
+    }
+
+    // Scores expressions over a fixed set of source rectangles with
+    // ipa::packing_cost ()
+    class Evaluator
+    {
+    public:
+        Evaluator (std::vector<Shape> sources, double target_aspect);
+
+        double cost (const Expression &expression,
+                     std::vector<Shape> &stack) const;
+
+        // Expression of the greedy packing done by BinPacker
+        Expression greedy () const;
+
+        std::size_t size () const {return sources.size ();}
+
+    private:
+        std::vector<Shape> sources;
+        double target_aspect;
+        double total_area;
+    };
+
+    struct Candidate
+    {
+        Expression expression;
+        double cost;
+    };
+
+    // One simulated annealing chain. Chains are only ever touched by one
+    // thread at a time.
+    class Chain
+    {
+    public:
+        Chain (const Evaluator &evaluator, const Candidate &start,
+               unsigned seed);
+
+        void restart (const Candidate &start);
+
+        // Anneals until deadline or until cancelled returns true, cooling
+        // from temperature_start down to temperature_end
+        void anneal (Clock::time_point deadline,
+                     double temperature_start, double temperature_end,
+                     const std::function<bool ()> &cancelled);
+
+        const Candidate &best () const {return _best;}
+        std::size_t moves () const {return _moves;}
+
+    private:
+        // Applies a random move to the current expression. Every move is its
+        // own inverse, so the same call undoes it.
+        bool perturb (std::size_t &pos1, std::size_t &pos2);
+        void apply (std::size_t pos1, std::size_t pos2);
+
+        std::size_t random_token (bool operand);
+
+        const Evaluator &evaluator;
+        std::mt19937 random;
+
+        Candidate _current;
+        Candidate _best;
+        std::vector<Shape> stack;
+        std::size_t _moves;
+    };
+
+
+    class SearchPackerImpl :
+        public ipa::SearchPacker,
+        public nihpp::SharedPtrCreator<SearchPackerImpl>
+    {
+    public:
+        typedef std::shared_ptr<SearchPackerImpl> Ptr;
+        using nihpp::SharedPtrCreator<SearchPackerImpl>::create;
+
+        SearchPackerImpl ();
+        virtual ~SearchPackerImpl () {}
+
+        virtual void target_aspect (double aspect_ratio);
+        virtual void time_budget (double seconds);
+        virtual void source_rectangles (ipa::RectangleTree::Ptr tree,
+                                        ipa::RectangleTree::NodeList nodes);
+
+        virtual ipa::RectangleTree::Node result ();
+        virtual Progress progress_result ();
+
+    private:
+        virtual void run ();
+
+        Candidate search (const Evaluator &evaluator);
+
+        // Builds the tree described by expression out of the source
+        // rectangles in tree, which has to be a copy of the source tree if it
+        // is not the source tree itself. Returns the root, laid out.
+        ipa::RectangleTree::Node build (ipa::RectangleTree &tree,
+                                        const Expression &expression) const;
+
+        // Hands candidate over to the main loop, which builds its own copy of
+        // the tree from it in progress_result (). Only the latest one is
+        // kept, so the tree is not copied for candidates that are never seen.
+        void publish (const Candidate &candidate);
+
+        double aspect_ratio;
+        double budget;
+        ipa::RectangleTree::Ptr tree;
+        ipa::RectangleTree::NodeList rectangles;
+
+        // Guards progress, and tree and rectangles once the search is done
+        Glib::Mutex progress_mutex;
+        Expression progress;
+    };
+}
+
+
+// Evaluator definitions
+Evaluator::Evaluator (std::vector<Shape> sources, double target_aspect) :
+    sources (std::move (sources)),
+    target_aspect (target_aspect),
+    total_area (0)
+{
+    for (const Shape &shape : this->sources)
+        total_area += shape.max_area ();
+}
+
+double Evaluator::cost (const Expression &expression,
+                        std::vector<Shape> &stack) const
+{
+    stack.clear ();
+
+    for (Token token : expression) {
+        if (is_operand (token)) {
+            stack.push_back (sources[token]);
+            continue;
+        }
+
+        Shape shape2 = stack.back ();
+        stack.pop_back ();
+
+        stack.back () = Shape::combine (orientation (token),
+                                        stack.back (), shape2);
+    }
+
+    return ipa::packing_cost (stack.back (), target_aspect, total_area);
+}
+
+Expression Evaluator::greedy () const
+{
+    struct Fragment
+    {
+        Expression expression;
+        Shape shape;
+    };
+
+    std::vector<Fragment> fragments;
+    fragments.reserve (sources.size ());
+
+    for (std::size_t i = 0; i < sources.size (); i++)
+        fragments.push_back ({Expression (1, Token (i)), sources[i]});
+
+    while (fragments.size () > 1) {
+        std::vector<Fragment> accumulator;
+        accumulator.reserve ((fragments.size () + 1) / 2);
+
+        for (std::size_t i = 0; i < fragments.size (); i += 2) {
+            if (i + 1 == fragments.size ()) {
+                accumulator.push_back (std::move (fragments[i]));
+                break;
+            }
+
+            Fragment &fragment1 = fragments[i];
+            Fragment &fragment2 = fragments[i + 1];
+
+            double aspect1 = fragment1.shape.aspect;
+            double aspect2 = fragment2.shape.aspect;
+
+            double vertical_ratio = aspect1 * aspect2 / (aspect1 + aspect2);
+            double horizontal_ratio = aspect1 + aspect2;
+
+            Token op = le1_ratio (target_aspect, vertical_ratio) >
+                le1_ratio (target_aspect, horizontal_ratio) ?
+                VERTICAL_OP : HORIZONTAL_OP;
+
+            Fragment combined;
+            combined.expression = std::move (fragment1.expression);
+            combined.expression.insert (combined.expression.end (),
+                                        fragment2.expression.begin (),
+                                        fragment2.expression.end ());
+            combined.expression.push_back (op);
+            combined.shape = Shape::combine (orientation (op),
+                                             fragment1.shape,
+                                             fragment2.shape);
+
+            accumulator.push_back (std::move (combined));
+        }
+
+        fragments = std::move (accumulator);
+    }
+
+    return std::move (fragments.front ().expression);
+}
+
+
+// Chain definitions
+Chain::Chain (const Evaluator &evaluator, const Candidate &start,
+              unsigned seed) :
+    evaluator (evaluator),
+    random (seed),
+    _current (start),
+    _best (start),
+    _moves (0)
+{
+}
+
+void Chain::restart (const Candidate &start)
+{
+    _current = start;
+    _best = start;
+}
+
+void Chain::anneal (Clock::time_point deadline,
+                    double temperature_start, double temperature_end,
+                    const std::function<bool ()> &cancelled)
+{
+    std::uniform_real_distribution<double> uniform (0, 1);
+
+    Clock::time_point start = Clock::now ();
+    double duration = std::chrono::duration<double> (deadline - start).count ();
+    double temperature = temperature_start;
+
+    for (std::size_t i = 0; ; i++) {
+        // Checking the clock is comparatively expensive for small inputs
+        if (i % 64 == 0) {
+            Clock::time_point now = Clock::now ();
+
+            if (now >= deadline || cancelled ())
+                break;
+
+            double elapsed = std::chrono::duration<double> (now - start).count ();
+            temperature = temperature_start *
+                std::pow (temperature_end / temperature_start,
+                          elapsed / duration);
+        }
+
+        std::size_t pos1, pos2;
+
+        if (!perturb (pos1, pos2))
+            continue;
+
+        double cost = evaluator.cost (_current.expression, stack);
+        double delta = cost - _current.cost;
+
+        _moves++;
+
+        if (delta <= 0 || uniform (random) < std::exp (-delta / temperature)) {
+            _current.cost = cost;
+
+            if (cost < _best.cost)
+                _best = _current;
+
+        } else {
+            apply (pos1, pos2);
+        }
+    }
+}
+
+std::size_t Chain::random_token (bool operand)
+{
+    std::uniform_int_distribution<std::size_t>
+        distribution (0, _current.expression.size () - 1);
+
+    // At least half of the tokens are operands, and all but one are
+    // operators when the other half is, so this terminates quickly
+    for (;;) {
+        std::size_t pos = distribution (random);
+
+        if (is_operand (_current.expression[pos]) == operand)
+            return pos;
+    }
+}
+
+bool Chain::perturb (std::size_t &pos1, std::size_t &pos2)
+{
+    Expression &expression = _current.expression;
+
+    switch (std::uniform_int_distribution<int> (0, 2) (random)) {
+    case 0:
+        // Swap two source rectangles
+        pos1 = random_token (true);
+        pos2 = random_token (true);
+        break;
+
+    case 1:
+        // Flip the orientation of a composite node
+        pos1 = pos2 = random_token (false);
+        break;
+
+    default:
+    {
+        // Swap an operand with an adjacent operator, which restructures the
+        // tree. The operator moves either left past the operand before it,
+        // or right past the operand after it, so that any tree can reach
+        // any other. Either way it is only valid if the stack still holds
+        // two subtrees where the operator ends up.
+        bool left = std::uniform_int_distribution<int> (0, 1) (random);
+
+        pos1 = random_token (left);
+        pos2 = pos1 + 1;
+
+        if (pos2 == expression.size () || is_operand (expression[pos2]) == left)
+            return false;
+
+        // Moving right, the operand at pos2 comes before the operator
+        long depth = left ? 0 : 1;
+
+        for (std::size_t i = 0; i < pos1; i++)
+            depth += is_operand (expression[i]) ? 1 : -1;
+
+        if (depth < 2)
+            return false;
+
+        break;
+    }
+    }
+
+    if (pos1 == pos2 && is_operand (expression[pos1]))
+        return false;
+
+    apply (pos1, pos2);
+    return true;
+}
+
+void Chain::apply (std::size_t pos1, std::size_t pos2)
+{
+    Expression &expression = _current.expression;
+
+    if (pos1 != pos2)
+        std::swap (expression[pos1], expression[pos2]);
+
+    else
+        expression[pos1] = expression[pos1] == HORIZONTAL_OP ?
+            VERTICAL_OP : HORIZONTAL_OP;
+}
+
+
+// SearchPacker definitions
+ipa::SearchPacker::Ptr ipa::SearchPacker::create ()
+{
+    return SearchPackerImpl::create ();
+}
+
+SearchPackerImpl::SearchPackerImpl () :
+    AsyncOperation ("SearchPacker"),
+    aspect_ratio (1),
+    budget (1)
+{
+}
+
+void SearchPackerImpl::target_aspect (double aspect_ratio)
+{
+    this->aspect_ratio = aspect_ratio;
+}
+
+void SearchPackerImpl::time_budget (double seconds)
+{
+    budget = seconds;
+}
+
+void SearchPackerImpl::source_rectangles (ipa::RectangleTree::Ptr tree,
+                                          ipa::RectangleTree::NodeList nodes)
+{
+    this->tree = std::move (tree);
+    this->rectangles = std::move (nodes);
+}
+
+void SearchPackerImpl::run ()
+{
+    if (rectangles.empty ())
+        return;
+
+    std::vector<Shape> sources;
+    sources.reserve (rectangles.size ());
+
+    for (ipa::RectangleTree::Node node : rectangles)
+        sources.push_back ({tree->aspect_ratio (node),
+                            tree->max_height (node)});
+
+    Evaluator evaluator (std::move (sources), aspect_ratio);
+    Candidate best = search (evaluator);
+
+    testcancelled ();
+
+    Glib::Mutex::Lock l (progress_mutex);
+
+    ipa::RectangleTree::Node root = build (*tree, best.expression);
+    rectangles.assign (1, root);
+    progress.clear ();
+}
+
+Candidate SearchPackerImpl::search (const Evaluator &evaluator)
+{
+    std::vector<Shape> stack;
+
+    Candidate best;
+    best.expression = evaluator.greedy ();
+    best.cost = evaluator.cost (best.expression, stack);
+
+    LOG(info) << "Greedy packing cost: " << best.cost;
+
+    // Nothing to search with fewer than three rectangles
+    if (evaluator.size () < 3)
+        return best;
+
+    // Something can be shown while the search runs
+    publish (best);
+
+    // Temperatures are in units of cost, which is logarithmic, so these are
+    // roughly relative changes of 5% and 0.01%
+    const double temperature_start = 0.05;
+    const double temperature_end = 0.0001;
+
+    // Chains exchange their best candidates between epochs
+    const int nepochs = 10;
+
+    ipu::ThreadPool &pool = ipu::ThreadPool::instance ();
+    int nchains = std::max (1L, ipu::ThreadPool::hardware_concurrency ());
+
+    std::vector<Chain> chains;
+    chains.reserve (nchains);
+
+    for (int i = 0; i < nchains; i++)
+        chains.push_back (Chain (evaluator, best, i + 1));
+
+    Glib::RefPtr<Gio::Cancellable> cancellable = this->cancellable ();
+    std::function<bool ()> cancelled = [cancellable] () {
+        return cancellable->is_cancelled ();
+    };
+
+    Clock::time_point start = Clock::now ();
+    std::chrono::duration<double> duration (budget);
+
+    for (int epoch = 0; epoch < nepochs; epoch++) {
+        double progress_start = double (epoch) / nepochs;
+        double progress_end = double (epoch + 1) / nepochs;
+
+        double epoch_temperature_start = temperature_start *
+            std::pow (temperature_end / temperature_start, progress_start);
+        double epoch_temperature_end = temperature_start *
+            std::pow (temperature_end / temperature_start, progress_end);
+
+        Clock::time_point deadline = start +
+            std::chrono::duration_cast<Clock::duration> (duration *
+                                                         progress_end);
+
+        std::vector<std::future<double> > results;
+        results.reserve (nchains);
+
+        for (Chain &chain : chains)
+            results.push_back (pool.async ([&chain, deadline,
+                                            epoch_temperature_start,
+                                            epoch_temperature_end,
+                                            &cancelled] () {
+                        chain.anneal (deadline,
+                                      epoch_temperature_start,
+                                      epoch_temperature_end,
+                                      cancelled);
+                        return chain.best ().cost;
+                    }));
+
+        // Every chain has to stop before the locals they use go away, even if
+        // one of them failed
+        for (auto &result : results)
+            result.wait ();
+
+        for (auto &result : results)
+            result.get ();
+
+        testcancelled ();
+
+        Chain *worst = &chains.front ();
+        bool improved = false;
+
+        for (Chain &chain : chains) {
+            if (chain.best ().cost < best.cost) {
+                best = chain.best ();
+                improved = true;
+            }
+
+            if (chain.best ().cost > worst->best ().cost)
+                worst = &chain;
+        }
+
+        worst->restart (best);
+
+        // The final result is delivered by the finish signal instead
+        if (improved && epoch + 1 < nepochs)
+            publish (best);
+    }
+
+    std::size_t nmoves = 0;
+
+    for (const Chain &chain : chains)
+        nmoves += chain.moves ();
+
+    LOG(info) << "Best packing cost after " << nmoves << " moves: "
+              << best.cost;
+
+    return best;
+}
+
+ipa::RectangleTree::Node
+SearchPackerImpl::build (ipa::RectangleTree &tree,
+                         const Expression &expression) const
+{
+    ipa::RectangleTree::NodeList stack;
+    stack.reserve (rectangles.size ());
+
+    for (Token token : expression) {
+        if (is_operand (token)) {
+            stack.push_back (rectangles[token]);
+            continue;
+        }
+
+        ipa::RectangleTree::Node child2 = stack.back ();
+        stack.pop_back ();
+
+        stack.back () = tree.combine (orientation (token),
+                                      stack.back (), child2);
+    }
+
+    tree.layout (stack.front ());
+    return stack.front ();
+}
+
+void SearchPackerImpl::publish (const Candidate &candidate)
+{
+    {
+        Glib::Mutex::Lock l (progress_mutex);
+        progress = candidate.expression;
+    }
+
+    publish_progress ();
+}
+
+ipa::RectangleTree::Node SearchPackerImpl::result ()
+{
+    if (rectangles.size () != 1)
+        return ipa::RectangleTree::INVALID_NODE;
+
+    return rectangles.front ();
+}
+
+ipa::BinPacker::Progress SearchPackerImpl::progress_result ()
+{
+    Glib::Mutex::Lock l (progress_mutex);
+
+    if (progress.empty ())
+        return Progress {nullptr, ipa::RectangleTree::INVALID_NODE};
+
+    auto snapshot = ipa::RectangleTree::create (*tree);
+    ipa::RectangleTree::Node root = build (*snapshot, progress);
+    progress.clear ();
+
+    return Progress {snapshot, root};
+}
@@ -0,0 +1,35 @@
+#ifndef IMGPACK_SEARCH_PACKER_HH
+#define IMGPACK_SEARCH_PACKER_HH
+
+#include <memory>
+
+#include <imgpack/algorithm/bin-packer.hh>
+
+namespace ImgPack
+{
+    namespace Algorithm
+    {
+        // Packer which searches over slicing trees instead of committing to
+        // the first pairing it finds. Starting from the greedy packing, a
+        // number of simulated annealing chains run in parallel on the thread
+        // pool until the time budget runs out, and the best tree found by any
+        // of them is built.
+        //
+        // Trees are scored by how far the aspect ratio of the collage is from
+        // the target, and by how much of the source pixel area survives the
+        // downscaling needed to fit the images together.
+        class SearchPacker : public BinPacker
+        {
+        public:
+            typedef std::shared_ptr<SearchPacker> Ptr;
+
+            static Ptr create ();
+            virtual ~SearchPacker () {}
+
+        protected:
+            SearchPacker () {}
+        };
+    }
+}
+
+#endif  // IMGPACK_SEARCH_PACKER_HH
@@ -0,0 +1,68 @@
+#ifndef IMGPACK_ALGORITHMS_SHAPE_HH
+#define IMGPACK_ALGORITHMS_SHAPE_HH
+
+#include <algorithm>
+#include <cmath>
+
+#include <imgpack/algorithm/rectangles.hh>
+
+namespace ImgPack
+{
+    namespace Algorithm
+    {
+        // Aspect ratio and maximum height of a subtree of a RectangleTree,
+        // which together determine its size once combined with others. This
+        // allows candidate trees to be scored without building them.
+        struct Shape
+        {
+            double aspect;
+            double max_height;
+
+            double max_area () const {return aspect * max_height * max_height;}
+
+            // Shape of a composite node with the given children
+            static Shape combine (RectangleTree::Orientation orientation,
+                                  const Shape &shape1, const Shape &shape2);
+        };
+
+        // Cost of a packing whose root has the given shape, lower being
+        // better: the log-distance of its aspect ratio from the target plus
+        // the log of the fraction of the source pixel area lost
+        double packing_cost (const Shape &root, double target_aspect,
+                             double total_area);
+
+
+        // Inline Definitions
+        inline Shape Shape::combine (RectangleTree::Orientation orientation,
+                                     const Shape &shape1, const Shape &shape2)
+        {
+            Shape shape;
+
+            if (orientation == RectangleTree::HORIZONTAL) {
+                shape.aspect = shape1.aspect + shape2.aspect;
+                shape.max_height = std::min (shape1.max_height,
+                                             shape2.max_height);
+
+            } else {
+                shape.aspect = shape1.aspect * shape2.aspect /
+                    (shape1.aspect + shape2.aspect);
+
+                double max_width =
+                    std::min (shape1.aspect * shape1.max_height,
+                              shape2.aspect * shape2.max_height);
+                shape.max_height = max_width / shape.aspect;
+            }
+
+            return shape;
+        }
+
+        inline double packing_cost (const Shape &root, double target_aspect,
+                                    double total_area)
+        {
+            return std::abs (std::log (root.aspect / target_aspect)) +
+                std::log (total_area / root.max_area ());
+        }
+    }
+}
+
+#endif  // IMGPACK_ALGORITHMS_SHAPE_HH
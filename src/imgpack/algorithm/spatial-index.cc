@@ -0,0 +1,217 @@
+#include <algorithm>
+#include <cmath>
+#include <functional>
+
+#include <glibmm.h>
+
+#include <imgpack/algorithm/spatial-index.hh>
+
+namespace ip = ImgPack;
+namespace ipa = ip::Algorithm;
+
+using ipa::SpatialIndex;
+using ipa::RectangleTree;
+
+SpatialIndex::SpatialIndex () :
+    _width (0), _height (0),
+    _cell_width (0), _cell_height (0)
+{}
+
+void SpatialIndex::clear ()
+{
+    _leaves.clear ();
+    _grids.clear ();
+    _cells.clear ();
+    _items.clear ();
+
+    _width = _height = 0;
+    _cell_width = _cell_height = 0;
+}
+
+void SpatialIndex::rebuild (const RectangleTree &tree, RectangleTree::Node root)
+{
+    clear ();
+
+    // Collect the placed bounds of every leaf
+    RectangleTree::NodeList stack = {root};
+
+    while (!stack.empty ()) {
+        RectangleTree::Node node = stack.back ();
+        stack.pop_back ();
+
+        if (tree.is_leaf (node)) {
+            double left = tree.offset_x (node);
+            double top = tree.offset_y (node);
+
+            _leaves.push_back ({node,
+                                left, top,
+                                left + tree.width (node),
+                                top + tree.height (node),
+                                0});
+
+        } else {
+            stack.push_back (tree.child2 (node));
+            stack.push_back (tree.child1 (node));
+        }
+    }
+
+    _width = tree.width (root);
+    _height = tree.height (root);
+
+    if (_leaves.empty () || _width <= 0 || _height <= 0)
+        return;
+
+    // Aim for square cells in the finest grid, about one per leaf
+    double nleaves = _leaves.size ();
+    double aspect = _width / _height;
+
+    std::size_t columns = std::max (1.0, std::round (std::sqrt (nleaves *
+                                                                aspect)));
+    std::size_t rows = std::max (1.0, std::round (std::sqrt (nleaves /
+                                                             aspect)));
+
+    _cell_width = _width / columns;
+    _cell_height = _height / rows;
+
+    // Each grid has half the columns and rows of the one below it, rounding
+    // up, so that the cells line up
+    std::size_t ncells = 0;
+
+    while (true) {
+        _grids.push_back ({columns, rows, ncells});
+        ncells += columns * rows;
+
+        if (columns == 1 && rows == 1)
+            break;
+
+        columns = (columns + 1) / 2;
+        rows = (rows + 1) / 2;
+    }
+
+    for (Bounds &bounds : _leaves)
+        while (bounds.level + 1 < _grids.size () &&
+               (bounds.right - bounds.left >
+                std::ldexp (_cell_width, bounds.level) ||
+                bounds.bottom - bounds.top >
+                std::ldexp (_cell_height, bounds.level)))
+            ++bounds.level;
+
+    // Bucket leaves by the cells they overlap in their grid, counting first
+    // so that all items can live in a single array
+    _cells.assign (ncells + 1, 0);
+
+    for (const Bounds &bounds : _leaves)
+        for_each_cell (bounds.level,
+                       bounds.left, bounds.top, bounds.right, bounds.bottom,
+                       [this] (std::size_t i) {++_cells[i + 1];});
+
+    for (std::size_t i = 1; i < _cells.size (); ++i)
+        _cells[i] += _cells[i - 1];
+
+    _items.resize (_cells.back ());
+    std::vector<std::size_t> fill (_cells.begin (), _cells.end () - 1);
+
+    for (std::size_t i = 0; i < _leaves.size (); ++i) {
+        const Bounds &bounds = _leaves[i];
+
+        for_each_cell (bounds.level,
+                       bounds.left, bounds.top, bounds.right, bounds.bottom,
+                       [&] (std::size_t index) {_items[fill[index]++] = i;});
+    }
+}
+
+std::size_t SpatialIndex::cell (std::size_t level, double x, double y) const
+{
+    const Grid &grid = _grids[level];
+
+    double column = std::floor (x / std::ldexp (_cell_width, level));
+    double row = std::floor (y / std::ldexp (_cell_height, level));
+
+    column = std::min<double> (std::max (column, 0.0), grid.columns - 1);
+    row = std::min<double> (std::max (row, 0.0), grid.rows - 1);
+
+    return grid.first_cell + std::size_t (row) * grid.columns +
+        std::size_t (column);
+}
+
+void SpatialIndex::for_each_cell (std::size_t level,
+                                  double left, double top,
+                                  double right, double bottom,
+                                  const std::function<void (std::size_t)> &
+                                  func) const
+{
+    const Grid &grid = _grids[level];
+
+    std::size_t first = cell (level, left, top) - grid.first_cell;
+    std::size_t last = cell (level, right, bottom) - grid.first_cell;
+
+    std::size_t first_column = first % grid.columns;
+    std::size_t last_column = last % grid.columns;
+
+    for (std::size_t row = first / grid.columns;
+         row <= last / grid.columns; ++row)
+        for (std::size_t column = first_column;
+             column <= last_column; ++column)
+            func (grid.first_cell + row * grid.columns + column);
+}
+
+RectangleTree::Node SpatialIndex::find_rect (double x, double y) const
+{
+    if (_cells.empty () ||
+        x < 0 || y < 0 || x > _width || y > _height)
+        return RectangleTree::INVALID_NODE;
+
+    RectangleTree::Node fallback = RectangleTree::INVALID_NODE;
+
+    for (std::size_t level = 0; level < _grids.size (); ++level) {
+        std::size_t i = cell (level, x, y);
+
+        for (std::size_t j = _cells[i]; j < _cells[i + 1]; ++j) {
+            const Bounds &bounds = _leaves[_items[j]];
+
+            if (x < bounds.left || x > bounds.right ||
+                y < bounds.top || y > bounds.bottom)
+                continue;
+
+            // Shared edges belong to the right or bottom neighbour, except
+            // along the far edges of the collage
+            if (x < bounds.right && y < bounds.bottom)
+                return bounds.node;
+
+            fallback = bounds.node;
+        }
+    }
+
+    return fallback;
+}
+
+void SpatialIndex::find_rects (double left, double top,
+                               double right, double bottom,
+                               RectangleTree::NodeList &result) const
+{
+    if (_cells.empty () || right < 0 || bottom < 0 ||
+        left > _width || top > _height)
+        return;
+
+    // Leaves spanning several cells turn up once in each of them
+    std::vector<std::size_t> found;
+
+    auto search_cell = [&] (std::size_t i) {
+        for (std::size_t j = _cells[i]; j < _cells[i + 1]; ++j) {
+            const Bounds &bounds = _leaves[_items[j]];
+
+            if (bounds.right >= left && bounds.left <= right &&
+                bounds.bottom >= top && bounds.top <= bottom)
+                found.push_back (_items[j]);
+        }
+    };
+
+    for (std::size_t level = 0; level < _grids.size (); ++level)
+        for_each_cell (level, left, top, right, bottom, search_cell);
+
+    std::sort (found.begin (), found.end ());
+    found.erase (std::unique (found.begin (), found.end ()), found.end ());
+
+    for (std::size_t i : found)
+        result.push_back (_leaves[i].node);
+}
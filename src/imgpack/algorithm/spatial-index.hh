@@ -0,0 +1,87 @@
+#ifndef IMGPACK_ALGORITHMS_SPATIAL_INDEX_HH
+#define IMGPACK_ALGORITHMS_SPATIAL_INDEX_HH
+
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include <imgpack/algorithm/rectangles.hh>
+
+namespace ImgPack
+{
+    namespace Algorithm
+    {
+        // Hierarchy of grids over the leaves of a laid out RectangleTree, for
+        // hit-testing without descending the tree. The finest grid has
+        // roughly one cell per leaf, and each coarser one has cells twice as
+        // large, up to a single cell over the whole collage.
+        //
+        // Every leaf is put in the finest grid whose cells are at least its
+        // size, so it overlaps at most four cells there, and panoramas
+        // spanning the collage cost no more than small leaves. Lookups look
+        // at one cell of every grid, and only a handful of candidates in
+        // each, however unbalanced the tree is.
+        class SpatialIndex
+        {
+        public:
+            SpatialIndex ();
+
+            // Indexes the leaves below root, which must have been laid out.
+            // Has to be called again whenever the layout changes.
+            void rebuild (const RectangleTree &tree, RectangleTree::Node root);
+            void clear ();
+
+            // Leaf containing the point, or RectangleTree::INVALID_NODE
+            RectangleTree::Node find_rect (double x, double y) const;
+
+            // Appends every leaf overlapping the given region to result, each
+            // only once
+            void find_rects (double left, double top,
+                             double right, double bottom,
+                             RectangleTree::NodeList &result) const;
+
+        private:
+            struct Bounds
+            {
+                RectangleTree::Node node;
+                double left, top, right, bottom;
+                std::size_t level;
+            };
+
+            // Cells of grid level are numbered from first_cell on, row by row
+            struct Grid
+            {
+                std::size_t columns, rows;
+                std::size_t first_cell;
+            };
+
+            std::size_t cell (std::size_t level, double x, double y) const;
+
+            // Calls func with every cell of grid level overlapping the region
+            void for_each_cell (std::size_t level,
+                                double left, double top,
+                                double right, double bottom,
+                                const std::function<void (std::size_t)> &
+                                func) const;
+
+            std::vector<Bounds>      _leaves;
+
+            // Finest first
+            std::vector<Grid>        _grids;
+
+            // Leaves put in cell i are _items[_cells[i]] up to
+            // _items[_cells[i + 1]]
+            std::vector<std::size_t> _cells;
+            std::vector<std::size_t> _items;
+
+            double                   _width;
+            double                   _height;
+
+            // Cell size of the finest grid, doubled for each coarser one
+            double                   _cell_width;
+            double                   _cell_height;
+        };
+    }
+}
+
+#endif  // IMGPACK_ALGORITHMS_SPATIAL_INDEX_HH
@@ -0,0 +1,460 @@
+#include <algorithm>
+#include <atomic>
+#include <new>
+
+#include <autosprintf.h>
+
+#include <glibmm/i18n.h>
+#include <imgpack/gtkui/collage-exporter.hh>
+#include <imgpack/gtkui/image-store.hh>
+#include <imgpack/util/image-reader.hh>
+#include <imgpack/util/image-writer.hh>
+#include <imgpack/util/logger.hh>
+#include <imgpack/util/resampler.hh>
+#include <imgpack/util/thread-pool.hh>
+
+namespace ip = ImgPack;
+namespace ipg = ip::GtkUI;
+namespace ipu = ip::Util;
+
+using ipg::CollageExporter;
+
+namespace {
+    // Bytes of pixels rendered at once
+    const std::size_t BAND_SIZE = 32 * 1024 * 1024;
+
+    // Rows of a band at least, however wide the collage is
+    const int MIN_BAND_ROWS = 16;
+
+    // Rows of an image resampled by one thread at a time, so that tall
+    // images are spread over the pool as well as many small ones
+    const int PIECE_ROWS = 16;
+
+    // Largest width and height of a Cairo surface, which is how formats
+    // without a streaming encoder are handed to gdk-pixbuf in one piece
+    const int MAX_SURFACE_SIZE = 32767;
+
+    // Rows of the mipmap level a leaf is resampled from. Levels the
+    // ImageStore holds already are read from there. Others are decoded from
+    // the file as the bands reach them, keeping only the rows that are still
+    // needed, so that sources of any size take little memory.
+    class SourceRows
+    {
+    public:
+        explicit SourceRows (const ipg::SharedSurface &surface);
+        explicit SourceRows (const ipu::ImageReader::Ptr &reader);
+
+        int width () const;
+        int height () const;
+        int stride () const;
+
+        // Makes rows [begin, end) of the level available, and drops those
+        // above begin. Rows must be asked for from the top down.
+        void advance (int begin, int end);
+
+        // The rows held, from first_row () on
+        const unsigned char *data () const;
+        int first_row () const {return first;}
+
+    private:
+        ipg::SharedSurface surface;
+        ipu::ImageReader::Ptr reader;
+
+        std::vector<unsigned char> window;
+        int first;
+        int nrows;
+    };
+
+    // An image reached by the bands drawn so far, along with the mipmap
+    // level it is resampled from and the weights to do it with
+    struct ActiveLeaf
+    {
+        const CollageExporter::Leaf *leaf;
+        std::unique_ptr<SourceRows> source;
+        std::unique_ptr<ipu::Resampler::Plan> plan;
+    };
+
+    // Rows of an image drawn into the band by one thread
+    struct Piece
+    {
+        const ActiveLeaf *active;
+        int first_row;
+        int nrows;
+    };
+
+    // Sets [top, bottom) to the rows of leaf among the nrows rows of the
+    // collage from y on, counting from its top edge
+    void rows_in_band (const CollageExporter::Leaf &leaf, int y, int nrows,
+                       int &top, int &bottom)
+    {
+        top = std::max (y, leaf.y) - leaf.y;
+        bottom = std::min (y + nrows, leaf.y + leaf.height) - leaf.y;
+    }
+}
+
+struct CollageExporter::Private
+{
+    Private (CollageExporter &self,
+             const Glib::RefPtr<Gio::File> &file,
+             const std::string &format,
+             int width, int height,
+             std::vector<Leaf> &&leaves);
+
+    CollageExporter &self;
+
+    const Glib::RefPtr<Gio::File> file;
+    const std::string format;
+    const int width;
+    const int height;
+
+    // Sorted by their top edge
+    std::vector<Leaf> leaves;
+
+    std::atomic<int> rows_written;
+
+    // Only touched by run (), until it finishes
+    Glib::ustring error;
+
+    // Renders the collage into stream, and closes it
+    void write (const Glib::RefPtr<Gio::OutputStream> &stream);
+
+    // Draws the nrows rows of the collage from y on into data. Leaves the
+    // band reaches are added to active from next_leaf on, and those it
+    // finishes are removed.
+    void draw_band (unsigned char *data, int stride, int y, int nrows,
+                    std::vector<ActiveLeaf> &active,
+                    std::size_t &next_leaf);
+
+    // Opens the mipmap level of the leaf and plans its resampling
+    void start_leaf (ActiveLeaf &active);
+
+    // Encodes the whole collage through gdk-pixbuf
+    void save_pixbuf (const Glib::RefPtr<Gio::OutputStream> &stream,
+                      unsigned char *data, int stride);
+
+    void remove_partial (const Glib::RefPtr<Gio::File> &partial);
+};
+
+CollageExporter::Private::Private (CollageExporter &self,
+                                   const Glib::RefPtr<Gio::File> &file,
+                                   const std::string &format,
+                                   int width, int height,
+                                   std::vector<Leaf> &&leaves) :
+    self (self),
+    file (file),
+    format (format),
+    width (width),
+    height (height),
+    leaves (std::move (leaves)),
+    rows_written (0)
+{
+    std::sort (this->leaves.begin (), this->leaves.end (),
+               [] (const Leaf &a, const Leaf &b) {return a.y < b.y;});
+}
+
+void CollageExporter::Private::write (const Glib::RefPtr<Gio::OutputStream> &
+                                      stream)
+{
+    auto writer = ipu::ImageWriter::create (format, stream, width, height);
+
+    // Rows are laid out as Cairo::FORMAT_RGB24, which is what the writers
+    // take. Formats without a streaming encoder are drawn in one band.
+    int stride = width * 4;
+    int band_rows = writer ?
+        std::max<int> (BAND_SIZE / stride, MIN_BAND_ROWS) : height;
+    std::vector<unsigned char> band (std::size_t (stride) *
+                                     std::min (band_rows, height));
+
+    std::vector<ActiveLeaf> active;
+    std::size_t next_leaf = 0;
+
+    for (int y = 0; y < height; y += band_rows) {
+        int nrows = std::min (band_rows, height - y);
+
+        draw_band (band.data (), stride, y, nrows, active, next_leaf);
+
+        if (writer)
+            writer->write_rows (band.data (), stride, nrows);
+
+        rows_written = y + nrows;
+        self.publish_progress ();
+        self.testcancelled ();
+    }
+
+    if (writer)
+        writer->finish ();
+
+    else
+        save_pixbuf (stream, band.data (), stride);
+
+    stream->close ();
+}
+
+void CollageExporter::Private::draw_band (unsigned char *data, int stride,
+                                          int y, int nrows,
+                                          std::vector<ActiveLeaf> &active,
+                                          std::size_t &next_leaf)
+{
+    ipu::ThreadPool &pool = ipu::ThreadPool::instance ();
+
+    std::fill (data, data + std::size_t (stride) * nrows, 0);
+
+    for (; next_leaf < leaves.size () && leaves[next_leaf].y < y + nrows;
+         next_leaf++) {
+        active.push_back (ActiveLeaf ());
+        active.back ().leaf = &leaves[next_leaf];
+    }
+
+    // Leaves are opened and read up to the rows the band needs side by side
+    auto read = [&] (std::size_t begin, std::size_t end) {
+        for (std::size_t i = begin; i < end; i++) {
+            if (!active[i].plan)
+                start_leaf (active[i]);
+
+            int top, bottom, src_begin, src_end;
+            rows_in_band (*active[i].leaf, y, nrows, top, bottom);
+
+            active[i].plan->source_rows (top, bottom - top,
+                                         src_begin, src_end);
+            active[i].source->advance (src_begin, src_end);
+        }
+    };
+
+    pool.parallel_for (0, active.size (), 1, read);
+
+    std::vector<Piece> pieces;
+
+    for (const ActiveLeaf &i : active) {
+        int top, bottom;
+        rows_in_band (*i.leaf, y, nrows, top, bottom);
+
+        for (int row = top; row < bottom; row += PIECE_ROWS)
+            pieces.push_back ({&i, row, std::min (PIECE_ROWS, bottom - row)});
+    }
+
+    // Levels are premultiplied, so writing them straight into the cleared
+    // band is the same as painting them over black
+    auto draw = [&] (std::size_t begin, std::size_t end) {
+        for (std::size_t i = begin; i < end; i++) {
+            const ActiveLeaf &active = *pieces[i].active;
+            const Leaf &leaf = *active.leaf;
+            unsigned char *dest = data +
+                std::size_t (leaf.y + pieces[i].first_row - y) * stride +
+                std::size_t (leaf.x) * 4;
+
+            active.plan->scale_rows (active.source->data (),
+                                     active.source->stride (), dest, stride,
+                                     pieces[i].first_row, pieces[i].nrows, 4,
+                                     false, active.source->first_row ());
+        }
+    };
+
+    pool.parallel_for (0, pieces.size (), 1, draw);
+
+    // Leaves which end within the band are done with
+    active.erase (std::remove_if (active.begin (), active.end (),
+                                  [=] (const ActiveLeaf &i) {
+                                      return i.leaf->y + i.leaf->height <=
+                                          y + nrows;
+                                  }),
+                  active.end ());
+}
+
+void CollageExporter::Private::start_leaf (ActiveLeaf &active)
+{
+    const Leaf &leaf = *active.leaf;
+    const SourceImage &image = *leaf.image;
+    int level = image.level_for (leaf.width, leaf.height);
+    int width = image.level_width (level);
+    int height = image.level_height (level);
+
+    SharedSurface surface = ImageStore::instance ().lookup (image, width,
+                                                            height);
+
+    if (surface)
+        active.source.reset (new SourceRows (surface));
+
+    else {
+        ipu::ImageReader::Ptr reader =
+            ipu::ImageReader::create (image.file ()->read (self.cancellable ()),
+                                      level);
+
+        // Other formats are decoded whole, though only at the level's size
+        if (!reader)
+            reader = ipu::ImageReader::create
+                (ipu::Resampler::scale (image.load (width, height,
+                                                    self.cancellable ()),
+                                        width, height));
+
+        active.source.reset (new SourceRows (reader));
+    }
+
+    active.plan.reset (new ipu::Resampler::Plan
+                       (active.source->width (), active.source->height (),
+                        leaf.width, leaf.height,
+                        ipu::Resampler::LANCZOS));
+}
+
+void CollageExporter::Private::save_pixbuf (const Glib::RefPtr<
+                                                Gio::OutputStream> &stream,
+                                            unsigned char *data, int stride)
+{
+    auto surface = Cairo::ImageSurface::create (data, Cairo::FORMAT_RGB24,
+                                                width, height, stride);
+    auto pixbuf = Gdk::Pixbuf::create (surface, 0, 0, width, height);
+
+    gchar *buffer;
+    gsize size;
+    pixbuf->save_to_buffer (buffer, size, format);
+
+    std::unique_ptr<gchar, void (*) (gpointer)> owned (buffer, &g_free);
+
+    gsize bytes_written;
+    stream->write_all (buffer, size, bytes_written);
+}
+
+void CollageExporter::Private::remove_partial (const Glib::RefPtr<Gio::File> &
+                                               partial)
+{
+    try {
+        partial->remove ();
+
+    } catch (Glib::Error &e) {
+        LOG(warning) << "Could not remove " << partial->get_uri () << ": "
+                     << e.what ();
+    }
+}
+
+
+// SourceRows definitions
+SourceRows::SourceRows (const ipg::SharedSurface &surface) :
+    surface (surface),
+    first (0),
+    nrows (surface.height ())
+{}
+
+SourceRows::SourceRows (const ipu::ImageReader::Ptr &reader) :
+    reader (reader),
+    first (0),
+    nrows (0)
+{}
+
+int SourceRows::width () const
+{
+    return reader ? reader->width () : surface.width ();
+}
+
+int SourceRows::height () const
+{
+    return reader ? reader->height () : surface.height ();
+}
+
+int SourceRows::stride () const
+{
+    return reader ? reader->width () * 4 : surface.stride ();
+}
+
+void SourceRows::advance (int begin, int end)
+{
+    if (!reader)
+        return;
+
+    g_assert (begin >= first);
+
+    std::size_t row_size = stride ();
+    end = std::min (end, height ());
+
+    // Rows skipped between bands are read and dropped along with the rest
+    if (end > first + nrows) {
+        window.resize (std::size_t (end - first) * row_size);
+        reader->read_rows (window.data () + std::size_t (nrows) * row_size,
+                           row_size, end - first - nrows);
+        nrows = end - first;
+    }
+
+    int dropped = std::min (begin - first, nrows);
+
+    window.erase (window.begin (),
+                  window.begin () + std::size_t (dropped) * row_size);
+    first += dropped;
+    nrows -= dropped;
+}
+
+const unsigned char *SourceRows::data () const
+{
+    return reader ? window.data () : surface.data ();
+}
+
+
+// CollageExporter definitions
+CollageExporter::CollageExporter (const Glib::RefPtr<Gio::File> &file,
+                                  const Gdk::PixbufFormat &format,
+                                  int width, int height,
+                                  std::vector<Leaf> leaves) :
+    AsyncOperation ("CollageExporter"),
+    _priv (new Private (*this, file, format.get_name (), width, height,
+                        std::move (leaves)))
+{
+    int max_size = ipu::ImageWriter::max_size (_priv->format);
+
+    if (max_size == 0)
+        max_size = MAX_SURFACE_SIZE;
+
+    if (width > max_size || height > max_size)
+        throw ipu::ImageWriter::Error
+            (gnu::autosprintf (_("The collage is %d by %d pixels, but %s "
+                                 "images can be at most %d pixels across"),
+                               width, height, _priv->format.c_str (),
+                               max_size));
+}
+
+CollageExporter::~CollageExporter ()
+{
+    // run () uses _priv, so it has to stop before _priv goes
+    abort ();
+}
+
+double CollageExporter::fraction () const
+{
+    return double (_priv->rows_written) / _priv->height;
+}
+
+Glib::ustring CollageExporter::error () const
+{
+    return _priv->error;
+}
+
+void CollageExporter::run ()
+{
+    Glib::RefPtr<Gio::File> partial =
+        _priv->file->get_parent ()->get_child
+        ("." + _priv->file->get_basename () + ".part");
+
+    try {
+        _priv->write (partial->replace ());
+        partial->move (_priv->file, Gio::FILE_COPY_OVERWRITE);
+
+        return;
+
+    } catch (Cancelled &) {
+        _priv->remove_partial (partial);
+        throw;
+
+    } catch (ipu::ImageWriter::Error &e) {
+        _priv->error = e.what ();
+
+    } catch (ipu::ImageReader::Error &e) {
+        _priv->error = e.what ();
+
+    } catch (Glib::Error &e) {
+        _priv->error = e.what ();
+
+    } catch (std::bad_alloc &) {
+        _priv->error = _("There is not enough memory to export the collage");
+    }
+
+    _priv->remove_partial (partial);
+
+    // Reading an image fails too when the export is aborted
+    testcancelled ();
+}
@@ -0,0 +1,64 @@
+#ifndef IMGPACK_COLLAGE_EXPORTER_HH
+#define IMGPACK_COLLAGE_EXPORTER_HH
+
+#include <string>
+#include <vector>
+
+#include <nihpp/sharedptrcreator.hh>
+#include <gtkmm.h>
+
+#include <imgpack/gtkui/source-image.hh>
+#include <imgpack/util/async-operation.hh>
+
+namespace ImgPack
+{
+    namespace GtkUI
+    {
+        // Renders a collage at full size and writes it to a file, a band of
+        // rows at a time. Images are decoded as the bands reach them, at the
+        // mipmap level they are resampled from, and only the rows the next
+        // bands need are kept. Bands are resampled on the Util::ThreadPool.
+        //
+        // The image is written next to the file and only moved over it once
+        // complete, so the file is left as it was if the export fails or is
+        // aborted.
+        class CollageExporter : public Util::AsyncOperation,
+                                public nihpp::SharedPtrCreator<CollageExporter>
+        {
+        public:
+            // Where an image goes in the collage, in whole pixels. Images
+            // must not overlap.
+            struct Leaf
+            {
+                SourceImage::Ptr image;
+                int x, y;
+                int width, height;
+            };
+
+            // Throws Util::ImageWriter::Error if format cannot hold an image
+            // of width x height, before the file is touched
+            CollageExporter (const Glib::RefPtr<Gio::File> &file,
+                             const Gdk::PixbufFormat &format,
+                             int width, int height,
+                             std::vector<Leaf> leaves);
+            CollageExporter (const CollageExporter &) = delete;
+            ~CollageExporter ();
+
+            // Fraction of the rows written so far. This may be called while
+            // the exporter is running.
+            double fraction () const;
+
+            // Why the export failed once it has finished, or an empty string
+            // if it succeeded
+            Glib::ustring error () const;
+
+        private:
+            struct Private;
+            std::unique_ptr<Private> _priv;
+
+            virtual void run ();
+        };
+    }
+}
+
+#endif  // IMGPACK_COLLAGE_EXPORTER_HH
@@ -1,141 +1,281 @@
-#include <queue>
+#include <algorithm>
 #include <cmath>
+#include <deque>
+#include <list>
+#include <map>
+#include <set>
+#include <tuple>
+#include <nihpp/sigc++/fixfunctors.hh>
 
-#include <nihpp/sharedptrcreator.hh>
 #include <imgpack/gtkui/collage-viewer.hh>
 #include <imgpack/algorithm/bin-packer.hh>
+#include <imgpack/algorithm/incremental-packer.hh>
+#include <imgpack/algorithm/spatial-index.hh>
 #include <imgpack/util/logger.hh>
+#include <imgpack/util/thread-pool.hh>
 
 namespace ip = ImgPack;
 namespace ipg = ip::GtkUI;
 namespace ipa = ip::Algorithm;
 
 namespace {
-    class PixbufRectangle :
-        public ipa::Rectangle,
-        public nihpp::SharedPtrCreator<PixbufRectangle>
-    {
-    public:
-        typedef std::shared_ptr<PixbufRectangle> Ptr;
+    typedef ipa::RectangleTree::Node Node;
 
-        PixbufRectangle (const Glib::RefPtr<Gdk::Pixbuf> &pixbuf) :
-            _pixbuf (pixbuf),
-            _width (pixbuf->get_width ()),
-            _height (pixbuf->get_height ())
-        {
-            LOG(info) << "Constructed PixbufRectangle with width: [" << _width
-                      << "] and height: [" << _height << "]";
-        }
+    // Seconds the collage may take to be packed after the images change
+    const double PACKING_BUDGET = 0.5;
+
+    const double TARGET_ASPECT = 1.0;
+
+    // Fraction of the images which may change before the collage is packed
+    // again from scratch rather than updated in place
+    const double MAX_INCREMENTAL_CHANGE = 0.25;
 
-        virtual ~PixbufRectangle (){}
+    // Side of the squares the collage is rendered in, in widget pixels
+    const int TILE_SIZE = 256;
 
-        virtual double width () {return _width;}
-        virtual void width (double);
+    // Rendered tiles kept around, about 128MiB worth
+    const std::size_t MAX_TILES = 512;
 
-        virtual double height () {return _height;}
-        virtual void height (double);
+    // Milliseconds without zooming or dragging after which tiles drawn in a
+    // hurry are drawn again properly
+    const unsigned INTERACTION_SETTLE_TIME = 150;
+
+    // Largest side of the icon shown while dragging a leaf
+    const double DRAG_ICON_SIZE = 120;
+
+    // Leaves whose placement may change at once before every tile is thrown
+    // away rather than only those under the leaves
+    const std::size_t MAX_DAMAGED_LEAVES = 256;
+
+    // Source image of a leaf in the collage. It is drawn from the nearest
+    // mipmap level of the image at least as large as the leaf, which the
+    // ImageStore keeps for every zoom factor that needs it.
+    class LeafImage
+    {
+    public:
+        LeafImage () {}
+        explicit LeafImage (const ipg::SourceImage::Ptr &image) :
+            _image (image) {}
 
-        virtual double max_width () {return _pixbuf->get_width ();}
-        virtual double max_height () {return _pixbuf->get_height ();}
+        ipg::SourceImage::Ptr image () const {return _image;}
+        int level (double width, double height) const;
 
-        Glib::RefPtr<Gdk::Pixbuf> orig_pixbuf () const {return _pixbuf;}
-        Glib::RefPtr<Gdk::Pixbuf> pixbuf () const;
+        // Paints whatever level of the image is at hand, or a placeholder if
+        // none is, sampled with filter. Returns false if that was not the
+        // level the leaf needs.
+        bool paint_cached (const Cairo::RefPtr<Cairo::Context> &cr,
+                           double x, double y,
+                           double width, double height,
+                           Cairo::Filter filter = Cairo::FILTER_GOOD) const;
 
     private:
-        Glib::RefPtr<Gdk::Pixbuf> _pixbuf;
-        mutable Glib::RefPtr<Gdk::Pixbuf> scaled_pixbuf_cache;
-        double _width;
-        double _height;
+        static void paint_surface (const Cairo::RefPtr<Cairo::Context> &cr,
+                                   const ipg::SharedSurface &source,
+                                   double x, double y,
+                                   double width, double height,
+                                   Cairo::Filter filter = Cairo::FILTER_GOOD);
+
+        ipg::SourceImage::Ptr _image;
     };
 }
 
-void PixbufRectangle::width (double new_width)
+int LeafImage::level (double width, double height) const
 {
-    if (std::abs (new_width - width ()) < 0.001)
-        return;
-
-    if (new_width - max_width () > 0.001) {
-        LOG(error) << "Attempting to upscale pixbuf by width: "
-                   << max_width () << " -> " << new_width;
-        g_assert_not_reached ();
-    }
-
-    _height = new_width / aspect_ratio ();
-    _width = std::min (new_width, max_width ());
+    return _image->level_for (std::max<int> (width + 0.5, 1),
+                              std::max<int> (height + 0.5, 1));
 }
 
-void PixbufRectangle::height (double new_height)
+bool LeafImage::paint_cached (const Cairo::RefPtr<Cairo::Context> &cr,
+                              double x, double y,
+                              double width, double height,
+                              Cairo::Filter filter) const
 {
-    if (std::abs (new_height <= max_height ()) < 0.001)
-        return;
+    int wanted = level (width, height);
+    ipg::SharedSurface source = _image->cached_mipmap (wanted);
 
-    if (new_height - max_height () > 0.001) {
-        LOG(error) << "Attempting to upscale pixbuf by height: "
-                   << max_height () << " -> " << new_height;
-        g_assert_not_reached ();
+    if (!source) {
+        cr->save ();
+        cr->set_source_rgb (0.5, 0.5, 0.5);
+        cr->rectangle (x, y, width, height);
+        cr->fill ();
+        cr->restore ();
+
+        return false;
     }
 
-    _width = new_height * aspect_ratio ();
-    _height = std::min (new_height, max_height ());
+    paint_surface (cr, source, x, y, width, height, filter);
+
+    return source.width () == _image->level_width (wanted) &&
+        source.height () == _image->level_height (wanted);
 }
 
-inline Glib::RefPtr<Gdk::Pixbuf> PixbufRectangle::pixbuf () const
+void LeafImage::paint_surface (const Cairo::RefPtr<Cairo::Context> &cr,
+                               const ipg::SharedSurface &source,
+                               double x, double y,
+                               double width, double height,
+                               Cairo::Filter filter)
 {
-    int height = _height + 0.5;
-    int width = _width + 0.5;
+    // The level is at most twice the size of the leaf, which is little
+    // enough for Cairo to filter the rest of the way
+    cr->save ();
+    cr->rectangle (x, y, width, height);
+    cr->clip ();
+    cr->translate (x, y);
+    cr->scale (width / source.width (), height / source.height ());
+
+    Cairo::RefPtr<Cairo::SurfacePattern> pattern =
+        Cairo::SurfacePattern::create (source.wrap ());
+    pattern->set_filter (filter);
+    cr->set_source (pattern);
+    cr->paint ();
+    cr->restore ();
+}
+
 
-    if (!scaled_pixbuf_cache ||
-        scaled_pixbuf_cache->get_height () != height ||
-        scaled_pixbuf_cache->get_width () != width) {
-        // HACK: Work around bug in gdk-pixbuf hanging when scaling large image
-        // down.
+namespace {
+    struct RectangleCoord
+    {
+        Node node;
+        double x, y;
 
-        Glib::RefPtr<Gdk::Pixbuf> intermediate_pixbuf = _pixbuf;
-        double intermediate_width = _pixbuf->get_width ();
-        double intermediate_height = _pixbuf->get_height ();
+        RectangleCoord (Node node, double x, double y) :
+            node (node), x (x), y (y) {}
+    };
 
-        while (intermediate_width / width > 10) {
-            intermediate_width /= 10;
-            intermediate_height /= 10;
+    // Where a leaf was placed, and with what image, when the tiles under it
+    // were rendered
+    struct LeafBounds
+    {
+        double left, top, right, bottom;
+        const ipg::SourceImage *image;
 
-            intermediate_pixbuf =
-                intermediate_pixbuf->scale_simple (intermediate_width,
-                                                   intermediate_height,
-                                                   Gdk::INTERP_BILINEAR);
+        bool operator!= (const LeafBounds &other) const
+        {
+            return left != other.left || top != other.top ||
+                right != other.right || bottom != other.bottom ||
+                image != other.image;
         }
+    };
 
-        scaled_pixbuf_cache =
-            intermediate_pixbuf->scale_simple (width, height,
-                                               Gdk::INTERP_BILINEAR);
-    }
+    // Part of the collage rendered at some zoom factor
+    struct Tile
+    {
+        typedef std::tuple<double, int, int> Key; // zoom, column, row
+
+        Key key;
+        Cairo::RefPtr<Cairo::ImageSurface> surface;
+
+        // Drawn with nearest neighbour sampling while the user was zooming
+        // or dragging, to be drawn again once they stop
+        bool rough;
+    };
+
+    // Mipmap levels of leaves being made on the thread pool, so that the
+    // main thread never has to wait on a decode
+    struct ScaleJobs
+    {
+        struct Request
+        {
+            Node node;
+            ipg::SourceImage::Ptr image;
+            int level;
+        };
+
+        Glib::Mutex mutex;
+
+        // Leaves on screen go to the front, the rest of a new layout to the
+        // back
+        std::deque<Request> queue;
+        std::list<Request> finished;
+
+        // Pool threads working through the queue
+        int nworkers;
+
+        // Cleared once the viewer goes away, after which nothing is posted
+        // back
+        Glib::Dispatcher *ready;
+    };
 
-    return scaled_pixbuf_cache;
+    // Takes a worker off ScaleJobs::nworkers however it finishes. Must be
+    // made after the worker's lock, so that it goes while that is held.
+    struct ScaleWorker
+    {
+        ScaleJobs &jobs;
+
+        ~ScaleWorker () {jobs.nworkers--;}
+    };
 }
 
 
 struct ipg::CollageViewer::Private : public sigc::trackable
 {
-    Private (ipg::CollageViewer &parent) :
-        parent (parent), zoom_factor (1.0),
-        dragging (false), click_handled (false),
-        pointer_x (0.0), pointer_y (0.0) {}
+    Private (ipg::CollageViewer &parent);
+    ~Private ();
+
+    CollageViewer           &parent;
+    ipa::BinPacker::Ptr      packer;
+    ImageList                images;
+
+    // Tree and leaf images handed to the packer, swapped in once it finishes
+    ipa::RectangleTree::Ptr  packing_tree;
+    std::vector<LeafImage>   packing_leaves;
 
-    CollageViewer       &parent;
-    ipa::BinPacker::Ptr  packer;
-    PixbufList           pixbufs;
-    ipa::Rectangle::Ptr  collage;
-    ipa::Rectangle::Ptr  selected;
+    ipa::RectangleTree::Ptr  tree;
+    std::vector<LeafImage>   leaves; // indexed by leaf node
+    ipa::SpatialIndex        index;
+    Node                     collage;
+    Node                     selected;
 
-    double               zoom_factor;
-    bool                 dragging;
-    bool                 click_handled;
+    // Rendered tiles, most recently used first
+    std::list<Tile>          tiles;
+    std::map<Tile::Key, std::list<Tile>::iterator> tile_index;
+    std::vector<LeafBounds>  laid_out; // indexed by leaf node
 
-    double               pointer_x;
-    double               pointer_y;
+    // Shared with the pool threads, which may outlive the viewer
+    std::shared_ptr<ScaleJobs> scale_jobs;
+    Glib::Dispatcher         leaves_scaled;
 
+    // Image and level of every request queued or running
+    std::set<std::pair<const ipg::SourceImage *, int> > scaling;
+
+    double                   zoom_factor;
+
+    // Set while zooming or dragging, and for INTERACTION_SETTLE_TIME after
+    bool                     interacting;
+    sigc::connection         settle_connection;
+
+    bool                     dragging;
+    bool                     click_handled;
+
+    double                   pointer_x;
+    double                   pointer_y;
+
+    void on_binpack_progress ();
     void on_binpack_finish ();
+    void show_collage ();
+    bool update_incrementally (const ImageList &new_images);
     void update_drag_status ();
 
+    void layout_changed ();
+    void damage (const LeafBounds &bounds);
+    void clear_tiles ();
+
+    void begin_interaction ();
+    bool end_interaction ();
+
+    void scale_leaf (Node node, bool urgent);
+    void drop_queued_scaling ();
+    void on_leaves_scaled ();
+
+    Cairo::RefPtr<Cairo::ImageSurface> tile (int column, int row);
+    void draw_tiles (const Cairo::RefPtr<Cairo::Context> &cr,
+                     double x1, double y1, double x2, double y2);
+
+    // Draws the leaves below rect from whatever mipmap levels are at hand,
+    // without decoding any
+    void draw_rect (const Cairo::RefPtr<Cairo::Context> &cr,
+                    RectangleCoord rect);
+
     enum Side {
         TOP,
         BOTTOM,
@@ -145,26 +285,160 @@ struct ipg::CollageViewer::Private : public sigc::trackable
     };
 
     void update_pointer_location (double x, double y);
-    ipa::Rectangle::Ptr get_dnd_target ();
+    Node get_dnd_target ();
     Side get_dnd_target_side ();
+
+    // Area of the collage under the drop target hilight, returning false if
+    // there is no target
+    bool get_dnd_hilight (double &x, double &y,
+                          double &width, double &height);
+
+    // Redraws the widget area under the drop target hilight
+    void damage_dnd_hilight ();
+    bool rect_contains (Node rect, double x, double y);
 };
 
+ipg::CollageViewer::Private::Private (ipg::CollageViewer &parent) :
+    parent (parent),
+    collage (ipa::RectangleTree::INVALID_NODE),
+    selected (ipa::RectangleTree::INVALID_NODE),
+    scale_jobs (new ScaleJobs),
+    zoom_factor (1.0),
+    interacting (false),
+    dragging (false), click_handled (false),
+    pointer_x (0.0), pointer_y (0.0)
+{
+    scale_jobs->nworkers = 0;
+    scale_jobs->ready = &leaves_scaled;
+
+    leaves_scaled.connect (sigc::mem_fun (*this, &Private::on_leaves_scaled));
+}
+
+ipg::CollageViewer::Private::~Private ()
+{
+    Glib::Mutex::Lock l (scale_jobs->mutex);
+
+    scale_jobs->ready = nullptr;
+    scale_jobs->queue.clear ();
+}
+
+void ipg::CollageViewer::Private::on_binpack_progress ()
+{
+    ipa::BinPacker::Progress progress = packer->progress_result ();
+
+    if (!progress.tree)
+        return;
+
+    // Intermediate trees share their leaf ids with packing_tree, so the leaf
+    // images can be taken over right away
+    if (!packing_leaves.empty ())
+        leaves = std::move (packing_leaves);
+
+    tree = progress.tree;
+    collage = progress.root;
+
+    show_collage ();
+}
+
 void ipg::CollageViewer::Private::on_binpack_finish ()
 {
+    if (!packing_leaves.empty ())
+        leaves = std::move (packing_leaves);
+
+    tree = std::move (packing_tree);
     collage = packer->result ();
-    selected.reset ();
 
-    if (!collage)
-        return;
+    show_collage ();
+}
+
+void ipg::CollageViewer::Private::show_collage ()
+{
+    selected = ipa::RectangleTree::INVALID_NODE;
+
+    layout_changed ();
+
+    if (collage == ipa::RectangleTree::INVALID_NODE)
+        parent.set_size_request (0, 0);
+
+    else
+        parent.set_size_request (tree->width (collage) * zoom_factor,
+                                 tree->height (collage) * zoom_factor);
 
-    parent.set_size_request (collage->width () * zoom_factor,
-                             collage->height () * zoom_factor);
     parent.queue_draw ();
 }
 
+bool ipg::CollageViewer::Private::update_incrementally
+(const ImageList &new_images)
+{
+    if (!tree || (packer && packer->is_running ()))
+        return false;
+
+    // Match the current leaves to the new images, so that only the
+    // difference has to be applied
+    std::map<ipg::SourceImage *, ipa::RectangleTree::NodeList> current;
+
+    for (Node node = 0; node < leaves.size (); node++)
+        if (leaves[node].image ())
+            current[leaves[node].image ().get ()].push_back (node);
+
+    ImageList added;
+    ipa::RectangleTree::NodeList removed;
+
+    for (const auto &image : new_images) {
+        auto i = current.find (image.get ());
+
+        if (i == current.end () || i->second.empty ())
+            added.push_back (image);
+
+        else
+            i->second.pop_back ();
+    }
+
+    for (const auto &i : current)
+        removed.insert (removed.end (), i.second.begin (), i.second.end ());
+
+    double nchanges = added.size () + removed.size ();
+
+    if (nchanges > MAX_INCREMENTAL_CHANGE *
+        std::max (images.size (), new_images.size ()))
+        return false;
+
+    LOG(info) << "Updating collage in place: " << added.size ()
+              << " images added, " << removed.size () << " removed";
+
+    ipa::IncrementalPacker repacker (*tree, collage, TARGET_ASPECT);
+
+    // Removed leaves give up their ids to the added ones, so that the tree
+    // and everything indexed by node stay the size of the collage however
+    // often it is edited
+    for (Node node : removed) {
+        repacker.remove (node);
+        tree->release (node);
+        leaves[node] = LeafImage ();
+    }
+
+    for (const auto &image : added) {
+        Node leaf = tree->add_leaf (image->width (), image->height ());
+
+        leaves.resize (std::max<std::size_t> (leaves.size (), leaf + 1));
+        leaves[leaf] = LeafImage (image);
+
+        repacker.insert (leaf);
+    }
+
+    collage = repacker.root ();
+
+    if (collage != ipa::RectangleTree::INVALID_NODE)
+        tree->layout (collage);
+
+    show_collage ();
+
+    return true;
+}
+
 void ipg::CollageViewer::Private::update_drag_status ()
 {
-    if (selected) {
+    if (selected != ipa::RectangleTree::INVALID_NODE) {
         std::vector<Gtk::TargetEntry> targets =
             {
                 Gtk::TargetEntry ("application/x-imgpacker-rect",
@@ -180,37 +454,416 @@ void ipg::CollageViewer::Private::update_drag_status ()
     }
 }
 
+void ipg::CollageViewer::Private::layout_changed ()
+{
+    if (collage == ipa::RectangleTree::INVALID_NODE) {
+        index.clear ();
+        laid_out.clear ();
+        clear_tiles ();
+        drop_queued_scaling ();
+
+        return;
+    }
+
+    index.rebuild (*tree, collage);
+
+    const LeafBounds NOWHERE = {0, 0, 0, 0, nullptr};
+    std::vector<LeafBounds> bounds (leaves.size (), NOWHERE);
+    std::vector<Node> stack = {collage};
+
+    while (!stack.empty ()) {
+        Node node = stack.back ();
+        stack.pop_back ();
+
+        if (tree->is_leaf (node)) {
+            double left = tree->offset_x (node);
+            double top = tree->offset_y (node);
+
+            bounds.resize (std::max<std::size_t> (bounds.size (), node + 1),
+                           NOWHERE);
+            bounds[node] = {left, top,
+                            left + tree->width (node),
+                            top + tree->height (node),
+                            node < leaves.size () ?
+                            leaves[node].image ().get () : nullptr};
+
+        } else {
+            stack.push_back (tree->child2 (node));
+            stack.push_back (tree->child1 (node));
+        }
+    }
+
+    // Only tiles under leaves that moved or changed image need rendering
+    // again, both where the leaves were and where they are now
+    std::vector<LeafBounds> damaged;
+    std::vector<Node> moved;
+
+    for (std::size_t i = 0; i < std::max (bounds.size (), laid_out.size ());
+         i++) {
+        const LeafBounds &before = i < laid_out.size () ? laid_out[i] : NOWHERE;
+        const LeafBounds &after = i < bounds.size () ? bounds[i] : NOWHERE;
+
+        if (before != after) {
+            if (before.image)
+                damaged.push_back (before);
+
+            if (after.image) {
+                damaged.push_back (after);
+                moved.push_back (i);
+            }
+        }
+    }
+
+    laid_out = std::move (bounds);
+
+    if (damaged.empty ())
+        return;
+
+    // Whatever is still queued for a layout that has been replaced outright
+    // is not worth waiting for
+    if (moved.size () > MAX_DAMAGED_LEAVES)
+        drop_queued_scaling ();
+
+    // Have the leaves scaled for their new size in the background, instead
+    // of one after another on the first draw
+    for (Node node : moved)
+        scale_leaf (node, false);
+
+    if (damaged.size () > MAX_DAMAGED_LEAVES) {
+        clear_tiles ();
+        return;
+    }
+
+    // Tiles at other zoom factors are not worth sorting out, so they all go
+    for (auto i = tiles.begin (); i != tiles.end ();)
+        if (std::get<0> (i->key) != zoom_factor) {
+            tile_index.erase (i->key);
+            i = tiles.erase (i);
+
+        } else
+            ++i;
+
+    for (const LeafBounds &i : damaged)
+        damage (i);
+}
+
+void ipg::CollageViewer::Private::damage (const LeafBounds &bounds)
+{
+    // Leaf edges are rounded to the nearest pixel, so look one further out
+    int first_column = std::floor ((bounds.left * zoom_factor - 1) / TILE_SIZE);
+    int last_column = std::floor ((bounds.right * zoom_factor + 1) / TILE_SIZE);
+    int first_row = std::floor ((bounds.top * zoom_factor - 1) / TILE_SIZE);
+    int last_row = std::floor ((bounds.bottom * zoom_factor + 1) / TILE_SIZE);
+
+    for (int row = first_row; row <= last_row; row++)
+        for (int column = first_column; column <= last_column; column++) {
+            auto i = tile_index.find (Tile::Key (zoom_factor, column, row));
+
+            if (i != tile_index.end ()) {
+                tiles.erase (i->second);
+                tile_index.erase (i);
+            }
+        }
+}
+
+void ipg::CollageViewer::Private::scale_leaf (Node node, bool urgent)
+{
+    const LeafBounds &bounds = laid_out[node];
+    const LeafImage &leaf = leaves[node];
+
+    int level = leaf.level ((bounds.right - bounds.left) * zoom_factor,
+                            (bounds.bottom - bounds.top) * zoom_factor);
+
+    if (!scaling.insert (std::make_pair (bounds.image, level)).second)
+        return;
+
+    std::shared_ptr<ScaleJobs> jobs = scale_jobs;
+    Glib::Mutex::Lock l (jobs->mutex);
+
+    ScaleJobs::Request request = {node, leaf.image (), level};
+
+    if (urgent)
+        jobs->queue.push_front (request);
+    else
+        jobs->queue.push_back (request);
+
+    // Scaling takes no more than half of the pool, which packing,
+    // thumbnails and exports share
+    if (jobs->nworkers >=
+        std::max (ip::Util::ThreadPool::instance ().get_max_threads () / 2, 1))
+        return;
+
+    jobs->nworkers++;
+
+    ip::Util::ThreadPool::instance ().push ([jobs] () {
+            Glib::Mutex::Lock l (jobs->mutex);
+            ScaleWorker worker = {*jobs};
+
+            while (!jobs->queue.empty ()) {
+                ScaleJobs::Request request = jobs->queue.front ();
+                jobs->queue.pop_front ();
+
+                l.release ();
+
+                bool scaled = true;
+
+                try {
+                    request.image->mipmap (request.level);
+
+                } catch (Glib::Exception &e) {
+                    LOG(warning) << "Could not scale "
+                                 << request.image->file ()->get_uri ()
+                                 << ": " << e.what ();
+
+                    // Left marked as scaling, so that it is not retried on
+                    // every draw
+                    scaled = false;
+
+                } catch (std::exception &e) {
+                    LOG(warning) << "Could not scale "
+                                 << request.image->file ()->get_uri ()
+                                 << ": " << e.what ();
+
+                    scaled = false;
+                }
+
+                l.acquire ();
+
+                if (!jobs->ready)
+                    break;
+
+                if (scaled) {
+                    jobs->finished.push_back (request);
+                    (*jobs->ready) ();
+                }
+            }
+        });
+}
+
+void ipg::CollageViewer::Private::drop_queued_scaling ()
+{
+    Glib::Mutex::Lock l (scale_jobs->mutex);
+
+    for (const ScaleJobs::Request &i : scale_jobs->queue)
+        scaling.erase (std::make_pair (i.image.get (), i.level));
+
+    scale_jobs->queue.clear ();
+}
+
+void ipg::CollageViewer::Private::on_leaves_scaled ()
+{
+    std::list<ScaleJobs::Request> finished;
+
+    {
+        Glib::Mutex::Lock l (scale_jobs->mutex);
+        finished.swap (scale_jobs->finished);
+    }
+
+    for (const ScaleJobs::Request &i : finished) {
+        scaling.erase (std::make_pair (i.image.get (), i.level));
+
+        // Leaves may have moved again or gone since
+        if (i.node >= laid_out.size () ||
+            laid_out[i.node].image != i.image.get ())
+            continue;
+
+        const LeafBounds &bounds = laid_out[i.node];
+
+        damage (bounds);
+
+        double left = std::floor (bounds.left * zoom_factor) - 1;
+        double top = std::floor (bounds.top * zoom_factor) - 1;
+        double right = std::ceil (bounds.right * zoom_factor) + 1;
+        double bottom = std::ceil (bounds.bottom * zoom_factor) + 1;
+
+        parent.queue_draw_area (left, top, right - left, bottom - top);
+    }
+}
+
+void ipg::CollageViewer::Private::clear_tiles ()
+{
+    tiles.clear ();
+    tile_index.clear ();
+}
+
+void ipg::CollageViewer::Private::begin_interaction ()
+{
+    interacting = true;
+
+    // Restarted on every event, so that the proper redraw only comes once
+    // the user pauses
+    settle_connection.disconnect ();
+    settle_connection = Glib::signal_timeout ().connect
+        (sigc::mem_fun (*this, &Private::end_interaction),
+         INTERACTION_SETTLE_TIME);
+}
+
+bool ipg::CollageViewer::Private::end_interaction ()
+{
+    interacting = false;
+
+    bool dropped = false;
+
+    for (auto i = tiles.begin (); i != tiles.end ();)
+        if (i->rough) {
+            tile_index.erase (i->key);
+            i = tiles.erase (i);
+            dropped = true;
+        } else
+            ++i;
+
+    if (dropped)
+        parent.queue_draw ();
+
+    return false;
+}
+
+Cairo::RefPtr<Cairo::ImageSurface>
+ipg::CollageViewer::Private::tile (int column, int row)
+{
+    Tile::Key key (zoom_factor, column, row);
+    auto i = tile_index.find (key);
+
+    if (i != tile_index.end ()) {
+        tiles.splice (tiles.begin (), tiles, i->second);
+        return i->second->surface;
+    }
+
+    auto surface = Cairo::ImageSurface::create (Cairo::FORMAT_ARGB32,
+                                                TILE_SIZE, TILE_SIZE);
+    auto cr = Cairo::Context::create (surface);
+
+    double tile_x = column * TILE_SIZE;
+    double tile_y = row * TILE_SIZE;
+
+    ipa::RectangleTree::NodeList nodes;
+    index.find_rects (tile_x / zoom_factor, tile_y / zoom_factor,
+                      (tile_x + TILE_SIZE) / zoom_factor,
+                      (tile_y + TILE_SIZE) / zoom_factor,
+                      nodes);
+
+    for (Node node : nodes) {
+        // Edges are rounded the same way in every tile, so that leaves
+        // spanning several tiles line up without seams
+        double left = std::floor (tree->offset_x (node) * zoom_factor + 0.5);
+        double top = std::floor (tree->offset_y (node) * zoom_factor + 0.5);
+        double right = std::floor ((tree->offset_x (node) +
+                                    tree->width (node)) * zoom_factor + 0.5);
+        double bottom = std::floor ((tree->offset_y (node) +
+                                     tree->height (node)) * zoom_factor + 0.5);
+
+        if (right <= left || bottom <= top)
+            continue;
+
+        // While the user is zooming there is no point making levels for
+        // zoom factors that are only passed through
+        if (interacting)
+            leaves[node].paint_cached (cr, left - tile_x, top - tile_y,
+                                       right - left, bottom - top,
+                                       Cairo::FILTER_FAST);
+
+        // Missing levels are drawn from whatever is at hand for now, and
+        // the tile rendered again once they are ready
+        else if (!leaves[node].paint_cached (cr, left - tile_x, top - tile_y,
+                                             right - left, bottom - top))
+            scale_leaf (node, true);
+    }
+
+    tiles.push_front ({key, surface, interacting});
+    tile_index[key] = tiles.begin ();
+
+    while (tiles.size () > MAX_TILES) {
+        tile_index.erase (tiles.back ().key);
+        tiles.pop_back ();
+    }
+
+    return surface;
+}
+
+void ipg::CollageViewer::Private::draw_tiles
+(const Cairo::RefPtr<Cairo::Context> &cr,
+ double x1, double y1, double x2, double y2)
+{
+    double width = tree->width (collage) * zoom_factor;
+    double height = tree->height (collage) * zoom_factor;
+
+    int first_column = std::max (0.0, std::floor (x1 / TILE_SIZE));
+    int first_row = std::max (0.0, std::floor (y1 / TILE_SIZE));
+    int last_column = std::floor (std::min (x2, width) / TILE_SIZE);
+    int last_row = std::floor (std::min (y2, height) / TILE_SIZE);
+
+    for (int row = first_row; row <= last_row; row++)
+        for (int column = first_column; column <= last_column; column++) {
+            cr->set_source (tile (column, row),
+                            column * TILE_SIZE, row * TILE_SIZE);
+            cr->rectangle (column * TILE_SIZE, row * TILE_SIZE,
+                           TILE_SIZE, TILE_SIZE);
+            cr->fill ();
+        }
+}
+
+void ipg::CollageViewer::Private::draw_rect (
+    const Cairo::RefPtr<Cairo::Context> &cr,
+    RectangleCoord rect)
+{
+    // Leaves are drawn relative to where rect.node sits in the laid out tree
+    double origin_x = rect.x - tree->offset_x (rect.node);
+    double origin_y = rect.y - tree->offset_y (rect.node);
+
+    std::vector<Node> drawq = {rect.node};
+
+    while (!drawq.empty ()) {
+        Node node = drawq.back ();
+        drawq.pop_back ();
+
+        if (tree->is_leaf (node)) {
+            double width = tree->width (node);
+            double height = tree->height (node);
+            double x = origin_x + tree->offset_x (node);
+            double y = origin_y + tree->offset_y (node);
+
+            leaves[node].paint_cached (cr, x, y, width, height);
+
+        } else {
+            Node children[] = {tree->child2 (node), tree->child1 (node)};
+
+            for (Node i : children)
+                if (i != ipa::RectangleTree::INVALID_NODE)
+                    drawq.push_back (i);
+        }
+    }
+}
+
 void ipg::CollageViewer::Private::update_pointer_location (double x, double y)
 {
     pointer_x = x;
     pointer_y = y;
 }
 
-ipa::Rectangle::Ptr ipg::CollageViewer::Private::get_dnd_target ()
+Node ipg::CollageViewer::Private::get_dnd_target ()
 {
-    if (collage)
-        return collage->find_rect (pointer_x / zoom_factor,
-                                   pointer_y / zoom_factor);
-
-    else
-        return ipa::Rectangle::Ptr ();
+    return index.find_rect (pointer_x / zoom_factor,
+                            pointer_y / zoom_factor);
 }
 
 ipg::CollageViewer::Private::Side
 ipg::CollageViewer::Private::get_dnd_target_side ()
 {
-    auto target = get_dnd_target ();
+    Node target = get_dnd_target ();
 
-    if (!target)
+    if (target == ipa::RectangleTree::INVALID_NODE)
         return INVALID;
 
     double real_x = pointer_x / zoom_factor;
     double real_y = pointer_y / zoom_factor;
 
-    double left_dist = real_x - target->offset_x ();
-    double right_dist = target->offset_x () + target->width () - real_x;
-    double top_dist = real_y - target->offset_y ();
-    double bottom_dist = target->offset_y () + target->height () - real_y;
+    double offset_x = tree->offset_x (target);
+    double offset_y = tree->offset_y (target);
+
+    double left_dist = real_x - offset_x;
+    double right_dist = offset_x + tree->width (target) - real_x;
+    double top_dist = real_y - offset_y;
+    double bottom_dist = offset_y + tree->height (target) - real_y;
 
     g_assert (left_dist * right_dist * top_dist * bottom_dist >= 0);
 
@@ -233,6 +886,57 @@ ipg::CollageViewer::Private::get_dnd_target_side ()
         g_assert_not_reached ();
 }
 
+bool ipg::CollageViewer::Private::get_dnd_hilight (double &x, double &y,
+                                                   double &width,
+                                                   double &height)
+{
+    Node target = get_dnd_target ();
+    Side side = get_dnd_target_side ();
+
+    if (target == ipa::RectangleTree::INVALID_NODE)
+        return false;
+
+    double target_width = tree->width (target);
+    double target_height = tree->height (target);
+
+    width = target_width * ((side == TOP || side == BOTTOM) ? 1 : 0.25);
+    height = target_height * ((side == LEFT || side == RIGHT) ? 1 : 0.25);
+
+    x = tree->offset_x (target) + target_width * (side == RIGHT ? 0.75 : 0);
+    y = tree->offset_y (target) + target_height * (side == BOTTOM ? 0.75 : 0);
+
+    return true;
+}
+
+void ipg::CollageViewer::Private::damage_dnd_hilight ()
+{
+    double x, y, width, height;
+
+    if (!get_dnd_hilight (x, y, width, height))
+        return;
+
+    double left = std::floor (x * zoom_factor) - 1;
+    double top = std::floor (y * zoom_factor) - 1;
+    double right = std::ceil ((x + width) * zoom_factor) + 1;
+    double bottom = std::ceil ((y + height) * zoom_factor) + 1;
+
+    parent.queue_draw_area (left, top, right - left, bottom - top);
+}
+
+bool ipg::CollageViewer::Private::rect_contains (Node rect,
+                                                 double x, double y)
+{
+    if (rect == ipa::RectangleTree::INVALID_NODE)
+        return false;
+
+    double top = tree->offset_y (rect);
+    double left = tree->offset_x (rect);
+    double bottom = top + tree->height (rect);
+    double right = left + tree->width (rect);
+
+    return top <= y && y <= bottom && left <= x && x <= right;
+}
+
 
 ipg::CollageViewer::CollageViewer () :
     _priv (new Private (*this))
@@ -244,24 +948,44 @@ ipg::CollageViewer::CollageViewer () :
 
 ipg::CollageViewer::~CollageViewer () {} // Needed for unique_ptr deleter
 
-void ipg::CollageViewer::set_source_pixbufs (PixbufList pixbufs)
+void ipg::CollageViewer::set_source_images (ImageList images)
 {
-    _priv->pixbufs = std::move (pixbufs);
+    bool updated = _priv->update_incrementally (images);
+    _priv->images = std::move (images);
 
-    refresh ();
+    if (!updated)
+        refresh ();
 }
 
 void ipg::CollageViewer::refresh ()
 {
-    std::list<ipa::Rectangle::Ptr> rectangles;
+    auto tree = ipa::RectangleTree::create ();
+    ipa::RectangleTree::NodeList rectangles;
+    std::vector<LeafImage> leaves;
+
+    tree->reserve (_priv->images.size ());
+    rectangles.reserve (_priv->images.size ());
+    leaves.reserve (_priv->images.size ());
+
+    for (auto image : _priv->images) {
+        Node leaf = tree->add_leaf (image->width (), image->height ());
+        g_assert (leaf == leaves.size ());
+
+        rectangles.push_back (leaf);
+        leaves.push_back (LeafImage (image));
+    }
 
-    for (auto pixbuf : _priv->pixbufs)
-        rectangles.push_back (PixbufRectangle::create (pixbuf));
+    _priv->packing_tree = tree;
+    _priv->packing_leaves = std::move (leaves);
 
-    _priv->packer = ipa::BinPacker::create ();
+    _priv->packer = ipa::BinPacker::create_for_budget (PACKING_BUDGET,
+                                                       rectangles.size ());
+    _priv->packer->target_aspect (TARGET_ASPECT);
+    _priv->packer->connect_signal_progress
+        (sigc::mem_fun (*_priv.get (), &Private::on_binpack_progress));
     _priv->packer->connect_signal_finish
         (sigc::mem_fun (*_priv.get (), &Private::on_binpack_finish));
-    _priv->packer->source_rectangles (std::move (rectangles));
+    _priv->packer->source_rectangles (tree, std::move (rectangles));
 
     _priv->packer->start ();
 }
@@ -269,115 +993,71 @@ void ipg::CollageViewer::refresh ()
 void ipg::CollageViewer::reset ()
 {
     _priv->packer.reset ();
-    _priv->pixbufs.clear ();
+    _priv->images.clear ();
 }
 
-namespace {
-    struct RectangleCoord
-    {
-        ipa::Rectangle::Ptr rect;
-        double x, y;
-
-        RectangleCoord (ipa::Rectangle::Ptr rect, double x, double y) :
-            rect (rect), x (x), y (y) {}
-    };
-
-    void draw_rect (const Cairo::RefPtr<Cairo::Context> &cr,
-                    RectangleCoord rect)
-    {
-        std::queue<RectangleCoord> drawq;
-        drawq.push (rect);
-
-        while (!drawq.empty ()) {
-            RectangleCoord rect = drawq.front ();
-            drawq.pop ();
-
-            double x = rect.x;
-            double y = rect.y;
-
-            if (rect.rect->orientation () == ipa::Rectangle::NONE) { // leaf
-                PixbufRectangle::Ptr pixbufrect =
-                    std::static_pointer_cast<PixbufRectangle> (rect.rect);
-
-                cr->save ();
-                Gdk::Cairo::set_source_pixbuf (cr, pixbufrect->pixbuf (),
-                                               x, y);
-                LOG(info) << "Drawing pixbuf " << pixbufrect->width ()
-                          << ", " << pixbufrect->height ()
-                          << " at " << x << ", " << y;
-
-                cr->paint ();
-                cr->restore ();
-
-            } else {
-                std::vector<ipa::Rectangle::Ptr> children =
-                    {rect.rect->child1 (), rect.rect->child2 ()};
-
-                for (auto i : children) {
-                    if (!i)
-                        continue;
-
-                    drawq.push ({i, x, y});
-
-                    switch (rect.rect->orientation ()) {
-                    case ipa::Rectangle::HORIZONTAL:
-                        x += i->width ();
-                        break;
-
-                    case ipa::Rectangle::VERTICAL:
-                        y += i->height ();
-                        break;
-
-                    case ipa::Rectangle::NONE:
-                        break;
-
-                    default:
-                        g_assert_not_reached ();
-                    }
-                }
-            }
-        }
-    }
-}
-
-void ipg::CollageViewer::export_to_file (const Glib::RefPtr<Gio::File> &file,
-                                         const Gdk::PixbufFormat &format)
+ipg::CollageExporter::Ptr
+ipg::CollageViewer::exporter (const Glib::RefPtr<Gio::File> &file,
+                              const Gdk::PixbufFormat &format) const
 {
-    int width = _priv->collage->width () + 1;
-    int height = _priv->collage->height () + 1;
-
-    auto surface = Cairo::ImageSurface::create (Cairo::FORMAT_RGB24,
-                                                width, height);
-    auto context = Cairo::Context::create (surface);
-
-    draw_rect (context, {_priv->collage, 0, 0});
-
-    auto pixbuf = Gdk::Pixbuf::create (surface, 0, 0, width, height);
-
-    gchar *buffer;
-    gsize size;
-    pixbuf->save_to_buffer (buffer, size, format.get_name ());
+    const ipa::RectangleTree &tree = *_priv->tree;
+    int width = tree.width (_priv->collage) + 1;
+    int height = tree.height (_priv->collage) + 1;
+
+    ipa::RectangleTree::NodeList nodes;
+    _priv->index.find_rects (-1, -1, width + 1, height + 1, nodes);
+
+    // Leaf edges are rounded to the nearest pixel, so that neighbours meet
+    // without gaps or overlaps
+    std::vector<CollageExporter::Leaf> leaves;
+    leaves.reserve (nodes.size ());
+
+    for (Node node : nodes) {
+        int left = std::floor (tree.offset_x (node) + 0.5);
+        int top = std::floor (tree.offset_y (node) + 0.5);
+        int right = std::floor (tree.offset_x (node) + tree.width (node) + 0.5);
+        int bottom = std::floor (tree.offset_y (node) + tree.height (node) +
+                                 0.5);
+
+        right = std::min (right, width);
+        bottom = std::min (bottom, height);
+
+        // Leaves under half a pixel across round away to nothing, and any
+        // pixel given to them would belong to a neighbour
+        if (right <= left || bottom <= top)
+            continue;
+
+        leaves.push_back ({_priv->leaves[node].image (), left, top,
+                           right - left, bottom - top});
+    }
 
-    auto stream = file->replace ();
-    gsize bytes_written;
-    stream->write_all (buffer, size, bytes_written);
+    return CollageExporter::create (file, format, width, height,
+                                    std::move (leaves));
 }
 
 bool ipg::CollageViewer::on_draw (const Cairo::RefPtr<Cairo::Context> &cr)
 {
-    if (!_priv->collage)
+    if (_priv->collage == ipa::RectangleTree::INVALID_NODE)
         return true;
 
-    cr->scale (_priv->zoom_factor, _priv->zoom_factor);
+    const ipa::RectangleTree &tree = *_priv->tree;
 
-    draw_rect (cr, {_priv->collage, 0, 0});
+    // Only the tiles under the area being redrawn are composited
+    double x1, y1, x2, y2;
+    cr->get_clip_extents (x1, y1, x2, y2);
+    _priv->draw_tiles (cr, x1, y1, x2, y2);
 
-    if (!_priv->selected)
+    if (_priv->selected == ipa::RectangleTree::INVALID_NODE)
         return true;
 
+    cr->scale (_priv->zoom_factor, _priv->zoom_factor);
+
     // Begin drawing selection background + frame
-    RectangleCoord selected = {_priv->selected, _priv->selected->offset_x (),
-                               _priv->selected->offset_y ()};
+    RectangleCoord selected = {_priv->selected,
+                               tree.offset_x (_priv->selected),
+                               tree.offset_y (_priv->selected)};
+    double selected_width = tree.width (selected.node);
+    double selected_height = tree.height (selected.node);
 
     Glib::RefPtr<Gtk::StyleContext> context = get_style_context ();
     context->context_save ();
@@ -388,24 +1068,30 @@ bool ipg::CollageViewer::on_draw (const Cairo::RefPtr<Cairo::Context> &cr)
     state |= Gtk::STATE_FLAG_SELECTED;
     context->set_state (state);
     context->render_background (cr, selected.x - 4, selected.y - 4,
-                                selected.rect->width () + 8,
-                                selected.rect->height () + 8);
+                                selected_width + 8,
+                                selected_height + 8);
     context->render_frame (cr, selected.x - 4, selected.y - 4,
-                           selected.rect->width () + 8,
-                           selected.rect->height () + 8);
+                           selected_width + 8,
+                           selected_height + 8);
     cr->restore ();
 
-    // Draw selection on top of background
-    draw_rect (cr, selected);
+    // Draw selection on top of background, from the same tiles
+    cr->save ();
+    cr->rectangle (selected.x, selected.y, selected_width, selected_height);
+    cr->clip ();
+    cr->scale (1 / _priv->zoom_factor, 1 / _priv->zoom_factor);
+    cr->get_clip_extents (x1, y1, x2, y2);
+    _priv->draw_tiles (cr, x1, y1, x2, y2);
+    cr->restore ();
 
     // Lightly draw background over selection again for better visibility
     auto bg_surface = Cairo::ImageSurface::create (Cairo::FORMAT_ARGB32,
-                                                   selected.rect->width (),
-                                                   selected.rect->height ());
+                                                   selected_width,
+                                                   selected_height);
     context->render_background (Cairo::Context::create (bg_surface),
                                 0, 0,
-                                selected.rect->width (),
-                                selected.rect->height ());
+                                selected_width,
+                                selected_height);
     cr->save ();
     cr->set_source (bg_surface, selected.x, selected.y);
     cr->paint_with_alpha (0.2);
@@ -414,26 +1100,12 @@ bool ipg::CollageViewer::on_draw (const Cairo::RefPtr<Cairo::Context> &cr)
     if (!_priv->dragging)
         return true;
 
-    auto target = _priv->get_dnd_target ();
-    auto side = _priv->get_dnd_target_side ();
+    double hilight_x, hilight_y, hilight_width, hilight_height;
 
-    if (!target)
+    if (!_priv->get_dnd_hilight (hilight_x, hilight_y,
+                                 hilight_width, hilight_height))
         return true;
 
-    double hilight_width =
-        target->width () * ((side == Private::TOP ||
-                             side == Private::BOTTOM) ? 1 : 0.25);
-    double hilight_height =
-        target->height () * ((side == Private::LEFT ||
-                              side == Private::RIGHT) ? 1 : 0.25);
-
-    double hilight_x =
-        target->offset_x () +
-        target->width () * (side == Private::RIGHT ? 0.75 : 0);
-    double hilight_y =
-        target->offset_y () +
-        target->height () * (side == Private::BOTTOM ? 0.75 : 0);
-
     auto target_hilight_surface =
         Cairo::ImageSurface::create (Cairo::FORMAT_ARGB32,
                                      hilight_width,
@@ -451,22 +1123,6 @@ bool ipg::CollageViewer::on_draw (const Cairo::RefPtr<Cairo::Context> &cr)
     return true;
 }
 
-namespace {
-    bool rect_contains (const ipa::Rectangle::Ptr &rect,
-                        double x, double y)
-    {
-        if (!rect)
-            return false;
-
-        double top = rect->offset_y ();
-        double left = rect->offset_x ();
-        double bottom = top + rect->height ();
-        double right = left + rect->width ();
-
-        return top <= y && y <= bottom && left <= x && x <= right;
-    }
-}
-
 bool ipg::CollageViewer::on_button_press_event (GdkEventButton *ev)
 {
     if (ev->type != GDK_BUTTON_PRESS)
@@ -477,7 +1133,7 @@ bool ipg::CollageViewer::on_button_press_event (GdkEventButton *ev)
 
     LOG(info) << "Button press at " << real_x << ", " << real_y;
 
-    if (!_priv->collage)
+    if (_priv->collage == ipa::RectangleTree::INVALID_NODE)
         return true;
 
     g_assert (!_priv->dragging);
@@ -486,8 +1142,8 @@ bool ipg::CollageViewer::on_button_press_event (GdkEventButton *ev)
     // Set new selection during button_press stage if outside of current
     // selection. This is to support dragging an item that is not currently
     // selected.
-    if (!rect_contains (_priv->selected, real_x, real_y)) {
-        _priv->selected = _priv->collage->find_rect (real_x, real_y);
+    if (!_priv->rect_contains (_priv->selected, real_x, real_y)) {
+        _priv->selected = _priv->index.find_rect (real_x, real_y);
         _priv->click_handled = true;
 
         _priv->update_drag_status ();
@@ -504,7 +1160,7 @@ bool ipg::CollageViewer::on_button_release_event (GdkEventButton *ev)
 
     LOG(info) << "Button release at " << real_x << ", " << real_y;
 
-    if (!_priv->collage || _priv->dragging)
+    if (_priv->collage == ipa::RectangleTree::INVALID_NODE || _priv->dragging)
         return true;
 
     // Click handled by button_press, so ignore to avoid duplicate actions
@@ -514,8 +1170,8 @@ bool ipg::CollageViewer::on_button_release_event (GdkEventButton *ev)
     }
 
     // Only handle cycling of rectangles up the tree here
-    if (rect_contains (_priv->selected, real_x, real_y))
-        _priv->selected = _priv->selected->parent ();
+    if (_priv->rect_contains (_priv->selected, real_x, real_y))
+        _priv->selected = _priv->tree->parent (_priv->selected);
 
     _priv->update_drag_status ();
     queue_draw ();
@@ -533,9 +1189,16 @@ bool ipg::CollageViewer::on_scroll_event (GdkEventScroll *ev)
           !(ev->state & GDK_SHIFT_MASK) && !(ev->state & GDK_META_MASK)))
         return false;
 
+    if (_priv->collage == ipa::RectangleTree::INVALID_NODE)
+        return false;
+
+    // Tiles are drawn roughly until the zoom settles
+    _priv->begin_interaction ();
+
     _priv->zoom_factor *= std::pow (1.2, -ev->delta_y);
-    set_size_request (_priv->collage->width () * _priv->zoom_factor + 1,
-                      _priv->collage->height () * _priv->zoom_factor + 1);
+    set_size_request
+        (_priv->tree->width (_priv->collage) * _priv->zoom_factor + 1,
+         _priv->tree->height (_priv->collage) * _priv->zoom_factor + 1);
 
     queue_draw ();
 
@@ -545,34 +1208,41 @@ bool ipg::CollageViewer::on_scroll_event (GdkEventScroll *ev)
 void ipg::CollageViewer::on_drag_begin (const Glib::RefPtr<Gdk::DragContext> &)
 {
     _priv->dragging = true;
-    g_assert (_priv->selected);
+    g_assert (_priv->selected != ipa::RectangleTree::INVALID_NODE);
 
-    double width = _priv->selected->width ();
-    double height = _priv->selected->height ();
+    double width = _priv->tree->width (_priv->selected);
+    double height = _priv->tree->height (_priv->selected);
+    double factor = std::min (DRAG_ICON_SIZE / std::max (width, height), 1.0);
+    int icon_width = std::max<int> (width * factor + 0.5, 1);
+    int icon_height = std::max<int> (height * factor + 0.5, 1);
 
     auto icon_surface = Cairo::ImageSurface::create (Cairo::FORMAT_ARGB32,
-                                                     width,
-                                                     height);
+                                                     icon_width,
+                                                     icon_height);
     auto cr = Cairo::Context::create (icon_surface);
-    double factor = std::min (width / 120, height / 120);
     cr->scale (factor, factor);
-    draw_rect (cr, {_priv->selected, 0, 0});
+    _priv->draw_rect (cr, {_priv->selected, 0, 0});
 
-    auto icon_pixbuf = Gdk::Pixbuf::create (icon_surface, 0, 0, width, height);
+    auto icon_pixbuf = Gdk::Pixbuf::create (icon_surface, 0, 0,
+                                            icon_width, icon_height);
     drag_source_set_icon (icon_pixbuf);
 }
 
 bool ipg::CollageViewer::on_drag_motion (const Glib::RefPtr<Gdk::DragContext> &,
                                          int x, int y, guint)
 {
+    // Only the hilight moves, and the tiles under it are already drawn
+    _priv->begin_interaction ();
+    _priv->damage_dnd_hilight ();
     _priv->update_pointer_location (x, y);
-    queue_draw ();
+    _priv->damage_dnd_hilight ();
 
-    return bool (_priv->get_dnd_target ());
+    return _priv->get_dnd_target () != ipa::RectangleTree::INVALID_NODE;
 }
 
 void ipg::CollageViewer::on_drag_end (const Glib::RefPtr<Gdk::DragContext>&)
 {
+    _priv->damage_dnd_hilight ();
     _priv->dragging = false;
     _priv->click_handled = false;
 }
@@ -582,14 +1252,18 @@ bool ipg::CollageViewer::on_drag_drop (
     int x, int y,
     guint time)
 {
+    const Node INVALID_NODE = ipa::RectangleTree::INVALID_NODE;
+    ipa::RectangleTree &tree = *_priv->tree;
+    Node selected = _priv->selected;
+
     _priv->update_pointer_location (x, y);
-    auto target = _priv->get_dnd_target ();
+    Node target = _priv->get_dnd_target ();
 
-    if (!target || !_priv->selected)
+    if (target == INVALID_NODE || selected == INVALID_NODE)
         return false;
 
-    for (auto i = target; i; i = i->parent ())
-        if (i == _priv->selected)
+    for (Node i = target; i != INVALID_NODE; i = tree.parent (i))
+        if (i == selected)
             return false;
 
     Private::Side target_side = _priv->get_dnd_target_side ();
@@ -598,105 +1272,105 @@ bool ipg::CollageViewer::on_drag_drop (
     // to the target directly
     {
         // First remove selected from its original location
-        auto parent = _priv->selected->parent ();
-        if (!parent)
+        Node parent = tree.parent (selected);
+        if (parent == INVALID_NODE)
             return false;
 
-        auto grandparent = parent->parent ();
-        auto sibling = parent->child1 () == _priv->selected ?
-            parent->child2 () : parent->child1 ();
+        Node grandparent = tree.parent (parent);
+        Node sibling = tree.child1 (parent) == selected ?
+            tree.child2 (parent) : tree.child1 (parent);
 
-        g_assert (sibling->parent () == parent && sibling != _priv->selected);
-        g_assert ((parent->child1 () == sibling &&
-                   parent->child2 () == _priv->selected) ||
-                  (parent->child2 () == sibling &&
-                   parent->child1 () == _priv->selected));
+        g_assert (tree.parent (sibling) == parent && sibling != selected);
+        g_assert ((tree.child1 (parent) == sibling &&
+                   tree.child2 (parent) == selected) ||
+                  (tree.child2 (parent) == sibling &&
+                   tree.child1 (parent) == selected));
 
         // Unparent the current selection, as we're dropping that node
-        _priv->selected->parent (nullptr);
+        tree.orphan (selected);
+        tree.orphan (sibling);
 
-        if (!grandparent) {
+        if (grandparent == INVALID_NODE)
             _priv->collage = sibling;
-            sibling->parent (nullptr);
-        }
 
-        else if (grandparent->child1 () == parent)
-            grandparent->child1 (sibling);
+        else if (tree.child1 (grandparent) == parent)
+            tree.child1 (grandparent, sibling);
 
         else
-            grandparent->child2 (sibling);
+            tree.child2 (grandparent, sibling);
 
-        g_assert (sibling->parent () == grandparent);
-        g_assert (!_priv->selected->parent ());
+        // The old parent is now empty, so its slot can be reused
+        tree.release (parent);
+
+        g_assert (tree.parent (sibling) == grandparent);
+        g_assert (tree.parent (selected) == INVALID_NODE);
     }
 
     {
         // Now make selected and target siblings
-        auto parent = target->parent ();
-        g_assert (!parent ||
-                  parent->child1 () == target ||
-                  parent->child2 () == target);
+        Node parent = tree.parent (target);
+        g_assert (parent == INVALID_NODE ||
+                  tree.child1 (parent) == target ||
+                  tree.child2 (parent) == target);
 
-        int position = !parent ? 0 : (parent->child1 () == target ? 1 : 2);
+        int position = parent == INVALID_NODE ?
+            0 : (tree.child1 (parent) == target ? 1 : 2);
 
-        target->parent (nullptr);
+        tree.orphan (target);
 
-        ipa::CompositeRectangle::Ptr new_parent;
+        Node new_parent = INVALID_NODE;
 
         switch (target_side) {
         case Private::LEFT:
-            new_parent = ipa::HCompositeRectangle::create (_priv->selected,
-                                                           target);
+            new_parent = tree.combine (ipa::RectangleTree::HORIZONTAL,
+                                       selected, target);
             break;
 
         case Private::RIGHT:
-            new_parent = ipa::HCompositeRectangle::create (target,
-                                                           _priv->selected);
+            new_parent = tree.combine (ipa::RectangleTree::HORIZONTAL,
+                                       target, selected);
             break;
 
         case Private::TOP:
-            new_parent = ipa::VCompositeRectangle::create (_priv->selected,
-                                                           target);
+            new_parent = tree.combine (ipa::RectangleTree::VERTICAL,
+                                       selected, target);
             break;
 
         case Private::BOTTOM:
-            new_parent = ipa::VCompositeRectangle::create (target,
-                                                           _priv->selected);
+            new_parent = tree.combine (ipa::RectangleTree::VERTICAL,
+                                       target, selected);
             break;
 
         default:
             g_assert_not_reached ();
         }
 
-        g_assert (target->parent () == new_parent);
-        g_assert (_priv->selected->parent () == new_parent);
+        g_assert (tree.parent (target) == new_parent);
+        g_assert (tree.parent (selected) == new_parent);
 
-        if (!parent) {
+        if (parent == INVALID_NODE)
             _priv->collage = new_parent;
-            new_parent->parent (nullptr);
 
-        } else if (position == 1)
-            parent->child1 (new_parent);
+        else if (position == 1)
+            tree.child1 (parent, new_parent);
 
         else
-            parent->child2 (new_parent);
-
-        g_assert (new_parent->parent () == parent);
-        g_assert (!parent ||
-                  (position == 1 && parent->child1 () == new_parent) ||
-                  (position == 2 && parent->child2 () == new_parent));
+            tree.child2 (parent, new_parent);
 
-        ipa::CompositeRectangle::Ptr root;
-        for (auto i = new_parent; i; i = i->parent ())
-            root = i;
+        g_assert (tree.parent (new_parent) == parent);
+        g_assert (parent == INVALID_NODE ||
+                  (position == 1 && tree.child1 (parent) == new_parent) ||
+                  (position == 2 && tree.child2 (parent) == new_parent));
 
-        g_assert (root == _priv->collage);
-        root->recalculate_size ();
+        g_assert (tree.root (new_parent) == _priv->collage);
+        tree.recalculate_size (_priv->collage);
+        tree.layout (_priv->collage);
+        _priv->layout_changed ();
     }
 
     ctx->drag_finish (true, true, time);
-    set_size_request (_priv->collage->width () * _priv->zoom_factor,
-                      _priv->collage->height () * _priv->zoom_factor);
+    set_size_request (tree.width (_priv->collage) * _priv->zoom_factor,
+                      tree.height (_priv->collage) * _priv->zoom_factor);
     queue_draw ();
 
     return true;
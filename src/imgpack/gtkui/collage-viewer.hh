@@ -4,6 +4,9 @@
 #include <memory>
 #include <gtkmm.h>
 
+#include <imgpack/gtkui/collage-exporter.hh>
+#include <imgpack/gtkui/source-image.hh>
+
 namespace ImgPack
 {
     namespace GtkUI
@@ -11,18 +14,22 @@ namespace ImgPack
         class CollageViewer : public Gtk::DrawingArea
         {
         public:
-            typedef std::vector<Glib::RefPtr<Gdk::Pixbuf> > PixbufList;
+            typedef std::vector<SourceImage::Ptr> ImageList;
 
             CollageViewer ();
             ~CollageViewer ();
 
-            void set_source_pixbufs (PixbufList pixbufs);
+            void set_source_images (ImageList images);
 
             void refresh ();
             void reset ();
 
-            void export_to_file (const Glib::RefPtr<Gio::File> &file,
-                                 const Gdk::PixbufFormat &format);
+            // Makes an exporter of the collage as it is laid out now, for
+            // the caller to start. Throws Util::ImageWriter::Error if format
+            // cannot hold an image of its size.
+            CollageExporter::Ptr
+            exporter (const Glib::RefPtr<Gio::File> &file,
+                      const Gdk::PixbufFormat &format) const;
 
         protected:
             virtual bool on_draw (const Cairo::RefPtr<Cairo::Context> &cr);
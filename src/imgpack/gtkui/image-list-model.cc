@@ -0,0 +1,461 @@
+#include <algorithm>
+#include <set>
+#include <nihpp/sigc++/fixfunctors.hh>
+
+#include <imgpack/gtkui/image-list-model.hh>
+#include <imgpack/util/logger.hh>
+#include <imgpack/util/thread-pool.hh>
+
+namespace ip = ImgPack;
+namespace ipg = ip::GtkUI;
+
+using ipg::ImageListModel;
+
+// Thumbnails made on the thread pool, waiting to be swapped in
+struct ImageListModel::ThumbnailJobs
+{
+    struct Result
+    {
+        SourceImage::Ptr image;
+
+        // Tells the result apart from that of a later job for the same image
+        Glib::RefPtr<Gio::Cancellable> cancellable;
+
+        Glib::RefPtr<Gdk::Pixbuf> thumbnail;
+    };
+
+    Glib::Mutex mutex;
+    std::list<Result> finished;
+
+    // Cleared once the model goes away, after which nothing is posted back
+    Glib::Dispatcher *ready;
+};
+
+Glib::RefPtr<ImageListModel> ImageListModel::create (int thumbnail_size)
+{
+    return Glib::RefPtr<ImageListModel> (new ImageListModel (thumbnail_size));
+}
+
+ImageListModel::ImageListModel (int thumbnail_size) :
+    Glib::ObjectBase (typeid (ImageListModel)),
+    Glib::Object (),
+    thumbnail_size (thumbnail_size),
+    stamp (1),
+    jobs (new ThumbnailJobs)
+{
+    try {
+        placeholder = Gtk::IconTheme::get_default ()->load_icon
+            ("image-loading", thumbnail_size / 2, Gtk::ICON_LOOKUP_USE_BUILTIN);
+
+    } catch (Glib::Error &e) {
+        LOG(warning) << "Could not load placeholder icon: " << e.what ();
+    }
+
+    jobs->ready = &thumbnails_ready;
+    thumbnails_ready.connect (sigc::mem_fun (*this,
+                                             &ImageListModel::on_thumbnails_ready));
+}
+
+ImageListModel::~ImageListModel ()
+{
+    Glib::Mutex::Lock l (jobs->mutex);
+    jobs->ready = nullptr;
+
+    for (auto &i : pending)
+        i.second->cancel ();
+}
+
+void ImageListModel::append (const SourceImage::Ptr &image)
+{
+    insert (_images.size (), image);
+}
+
+void ImageListModel::remove (const std::vector<Gtk::TreeModel::Path> &paths)
+{
+    std::vector<int> rows;
+
+    rows.reserve (paths.size ());
+
+    for (const Path &i : paths)
+        if (i.size () == 1 && i[0] >= 0 && std::size_t (i[0]) < _images.size ())
+            rows.push_back (i[0]);
+
+    // Erase from the back, so that the rows still to go keep their numbers
+    std::sort (rows.begin (), rows.end ());
+    rows.erase (std::unique (rows.begin (), rows.end ()), rows.end ());
+
+    for (auto i = rows.rbegin (); i != rows.rend (); ++i) {
+        const SourceImage *image = _images[*i].get ();
+        auto job = pending.find (image);
+
+        // Stop making a thumbnail nobody will see
+        if (job != pending.end ()) {
+            job->second->cancel ();
+            pending.erase (job);
+        }
+
+        thumbnails.erase (image);
+        erase (*i);
+    }
+}
+
+void ImageListModel::set_visible_rows (int first, int last)
+{
+    first = std::max (first, 0);
+    last = std::min (last, int (_images.size ()) - 1);
+
+    std::set<const SourceImage *> visible;
+
+    for (int i = first; i <= last; i++)
+        visible.insert (_images[i].get ());
+
+    for (auto i = thumbnails.begin (); i != thumbnails.end ();)
+        if (visible.count (i->first))
+            ++i;
+        else
+            thumbnails.erase (i++);
+
+    for (auto i = pending.begin (); i != pending.end ();)
+        if (visible.count (i->first))
+            ++i;
+        else {
+            i->second->cancel ();
+            pending.erase (i++);
+        }
+
+    for (int i = first; i <= last; i++) {
+        const SourceImage::Ptr &image = _images[i];
+
+        if (!thumbnails.count (image.get ()) && !pending.count (image.get ()))
+            queue_thumbnail (image);
+    }
+}
+
+void ImageListModel::insert (int row, const SourceImage::Ptr &image)
+{
+    _images.insert (_images.begin () + row, image);
+
+    if (++stamp == 0)
+        stamp = 1;
+
+    iterator iter;
+    make_iter (row, iter);
+    row_inserted (path_of (row), iter);
+}
+
+void ImageListModel::erase (int row)
+{
+    _images.erase (_images.begin () + row);
+
+    if (++stamp == 0)
+        stamp = 1;
+
+    row_deleted (path_of (row));
+}
+
+void ImageListModel::queue_thumbnail (const SourceImage::Ptr &image)
+{
+    Glib::RefPtr<Gio::Cancellable> cancellable = Gio::Cancellable::create ();
+    pending[image.get ()] = cancellable;
+
+    int width = std::min (thumbnail_size, image->width ());
+    int height = std::max (1, width * image->height () / image->width ());
+
+    if (height > thumbnail_size) {
+        height = thumbnail_size;
+        width = std::max (1, height * image->width () / image->height ());
+    }
+
+    std::shared_ptr<ThumbnailJobs> shared_jobs = jobs;
+
+    ip::Util::ThreadPool::instance ().push ([=] () {
+            ThumbnailJobs::Result result = {image, cancellable,
+                                            Glib::RefPtr<Gdk::Pixbuf> ()};
+
+            try {
+                if (!cancellable->is_cancelled ())
+                    result.thumbnail = image->load (width, height,
+                                                    cancellable);
+
+            } catch (Glib::Exception &e) {
+                if (!cancellable->is_cancelled ())
+                    LOG(warning) << "Could not make thumbnail of "
+                                 << image->file ()->get_uri () << ": "
+                                 << e.what ();
+            }
+
+            Glib::Mutex::Lock l (shared_jobs->mutex);
+
+            if (!shared_jobs->ready)
+                return;
+
+            shared_jobs->finished.push_back (result);
+            (*shared_jobs->ready) ();
+        });
+}
+
+void ImageListModel::on_thumbnails_ready ()
+{
+    std::list<ThumbnailJobs::Result> finished;
+
+    {
+        Glib::Mutex::Lock l (jobs->mutex);
+        finished.swap (jobs->finished);
+    }
+
+    bool changed = false;
+
+    for (const auto &result : finished) {
+        auto i = pending.find (result.image.get ());
+
+        // Rows that were removed or scrolled away are no longer pending
+        if (i == pending.end () || i->second != result.cancellable)
+            continue;
+
+        pending.erase (i);
+
+        if (result.thumbnail) {
+            thumbnails[result.image.get ()] = result.thumbnail;
+            changed = true;
+        }
+    }
+
+    if (changed)
+        thumbnails_changed ();
+}
+
+int ImageListModel::row_of (const iterator &iter) const
+{
+    if (iter.get_stamp () != stamp)
+        return -1;
+
+    int row = GPOINTER_TO_INT (iter.gobj ()->user_data);
+
+    if (row < 0 || std::size_t (row) >= _images.size ())
+        return -1;
+
+    return row;
+}
+
+bool ImageListModel::make_iter (int row, iterator &iter) const
+{
+    if (row < 0 || std::size_t (row) >= _images.size ()) {
+        iter = iterator ();
+        return false;
+    }
+
+    iter.set_stamp (stamp);
+    iter.gobj ()->user_data = GINT_TO_POINTER (row);
+
+    return true;
+}
+
+Gtk::TreeModel::Path ImageListModel::path_of (int row) const
+{
+    Path path;
+    path.push_back (row);
+
+    return path;
+}
+
+Gtk::TreeModelFlags ImageListModel::get_flags_vfunc () const
+{
+    return Gtk::TREE_MODEL_LIST_ONLY;
+}
+
+int ImageListModel::get_n_columns_vfunc () const
+{
+    return N_COLUMNS;
+}
+
+GType ImageListModel::get_column_type_vfunc (int index) const
+{
+    switch (index) {
+    case FILENAME_COLUMN:
+        return Glib::Value<Glib::ustring>::value_type ();
+
+    case THUMBNAIL_COLUMN:
+        return Glib::Value<Glib::RefPtr<Gdk::Pixbuf>>::value_type ();
+
+    default:
+        return G_TYPE_INVALID;
+    }
+}
+
+void ImageListModel::get_value_vfunc (const iterator &iter, int column,
+                                      Glib::ValueBase &value) const
+{
+    int row = row_of (iter);
+
+    if (row < 0)
+        return;
+
+    const SourceImage::Ptr &image = _images[row];
+
+    switch (column) {
+    case FILENAME_COLUMN: {
+        Glib::Value<Glib::ustring> filename;
+        filename.init (filename.value_type ());
+        filename.set (image->file ()->get_basename ());
+
+        value.init (filename.value_type ());
+        value = filename;
+        break;
+    }
+
+    case THUMBNAIL_COLUMN: {
+        auto i = thumbnails.find (image.get ());
+
+        Glib::Value<Glib::RefPtr<Gdk::Pixbuf>> thumbnail;
+        thumbnail.init (thumbnail.value_type ());
+        thumbnail.set (i != thumbnails.end () ? i->second : placeholder);
+
+        value.init (thumbnail.value_type ());
+        value = thumbnail;
+        break;
+    }
+    }
+}
+
+bool ImageListModel::iter_next_vfunc (const iterator &iter,
+                                      iterator &iter_next) const
+{
+    int row = row_of (iter);
+
+    if (row < 0) {
+        iter_next = iterator ();
+        return false;
+    }
+
+    return make_iter (row + 1, iter_next);
+}
+
+bool ImageListModel::iter_children_vfunc (const iterator &, iterator &iter) const
+{
+    iter = iterator ();
+    return false;
+}
+
+bool ImageListModel::iter_has_child_vfunc (const iterator &) const
+{
+    return false;
+}
+
+int ImageListModel::iter_n_children_vfunc (const iterator &) const
+{
+    return 0;
+}
+
+int ImageListModel::iter_n_root_children_vfunc () const
+{
+    return _images.size ();
+}
+
+bool ImageListModel::iter_nth_child_vfunc (const iterator &, int,
+                                           iterator &iter) const
+{
+    iter = iterator ();
+    return false;
+}
+
+bool ImageListModel::iter_nth_root_child_vfunc (int n, iterator &iter) const
+{
+    return make_iter (n, iter);
+}
+
+bool ImageListModel::iter_parent_vfunc (const iterator &, iterator &iter) const
+{
+    iter = iterator ();
+    return false;
+}
+
+Gtk::TreeModel::Path ImageListModel::get_path_vfunc (const iterator &iter) const
+{
+    int row = row_of (iter);
+
+    return row < 0 ? Path () : path_of (row);
+}
+
+bool ImageListModel::get_iter_vfunc (const Path &path, iterator &iter) const
+{
+    if (path.size () != 1) {
+        iter = iterator ();
+        return false;
+    }
+
+    return make_iter (path[0], iter);
+}
+
+bool ImageListModel::iter_is_valid (const iterator &iter) const
+{
+    return row_of (iter) >= 0;
+}
+
+bool ImageListModel::row_draggable_vfunc (const Path &) const
+{
+    return true;
+}
+
+bool ImageListModel::drag_data_get_vfunc (const Path &path,
+                                          Gtk::SelectionData &
+                                          selection_data) const
+{
+    // RefPtr takes over a reference of its own
+    reference ();
+    Glib::RefPtr<const Gtk::TreeModel> self (this);
+
+    return path.set_row_drag_data (selection_data, self);
+}
+
+bool ImageListModel::drag_data_delete_vfunc (const Path &path)
+{
+    if (path.size () != 1 || path[0] < 0 ||
+        std::size_t (path[0]) >= _images.size ())
+        return false;
+
+    // The image lives on in the row it was dropped at, so its thumbnail is
+    // kept until the view says otherwise
+    erase (path[0]);
+
+    return true;
+}
+
+bool ImageListModel::drag_data_received_vfunc (const Path &dest,
+                                               const Gtk::SelectionData &
+                                               selection_data)
+{
+    if (!row_drop_possible_vfunc (dest, selection_data))
+        return false;
+
+    Glib::RefPtr<Gtk::TreeModel> source_model;
+    Path source;
+
+    Path::get_from_selection_data (selection_data, source_model, source);
+
+    // Copied, since inserting may move the source row out from under it
+    SourceImage::Ptr image = _images[source[0]];
+    insert (dest[0], image);
+
+    return true;
+}
+
+bool ImageListModel::row_drop_possible_vfunc (const Path &dest,
+                                              const Gtk::SelectionData &
+                                              selection_data) const
+{
+    if (dest.size () != 1 || dest[0] < 0 ||
+        std::size_t (dest[0]) > _images.size ())
+        return false;
+
+    Glib::RefPtr<Gtk::TreeModel> source_model;
+    Path source;
+
+    if (!Path::get_from_selection_data (selection_data, source_model, source))
+        return false;
+
+    // Only rows of this model can be dropped in it
+    return source_model &&
+        source_model->Gtk::TreeModel::gobj () == Gtk::TreeModel::gobj () &&
+        source.size () == 1 && source[0] >= 0 &&
+        std::size_t (source[0]) < _images.size ();
+}
@@ -0,0 +1,137 @@
+#ifndef IMGPACK_IMAGE_LIST_MODEL_HH
+#define IMGPACK_IMAGE_LIST_MODEL_HH
+
+#include <list>
+#include <map>
+#include <memory>
+#include <vector>
+#include <gtkmm.h>
+
+#include <imgpack/gtkui/source-image.hh>
+
+namespace ImgPack
+{
+    namespace GtkUI
+    {
+        // Flat TreeModel over a list of SourceImages, holding nothing per row
+        // but the image itself. Thumbnails are only made for the rows the
+        // view says are visible, on the thread pool, and dropped again once
+        // those rows scroll away, so the model stays small however many
+        // images it holds.
+        //
+        // Until its thumbnail is ready a row shows a placeholder. Thumbnails
+        // are swapped in without emitting row-changed, since that makes
+        // Gtk::IconView lay out every row again; views must be drawn with
+        // fixed size cells, and redraw on signal_thumbnails_changed ().
+        class ImageListModel : public Glib::Object,
+                               public Gtk::TreeModel,
+                               public Gtk::TreeDragSource,
+                               public Gtk::TreeDragDest
+        {
+        public:
+            enum Column {
+                FILENAME_COLUMN,
+                THUMBNAIL_COLUMN,
+                N_COLUMNS
+            };
+
+            static Glib::RefPtr<ImageListModel> create (int thumbnail_size);
+            ~ImageListModel ();
+
+            void append (const SourceImage::Ptr &image);
+
+            // Removes the rows at paths and stops making their thumbnails
+            void remove (const std::vector<Gtk::TreeModel::Path> &paths);
+
+            const std::vector<SourceImage::Ptr> &images () const
+            {return _images;}
+
+            // Makes thumbnails for rows first to last inclusive, and forgets
+            // those of every other row
+            void set_visible_rows (int first, int last);
+
+            // Emitted when thumbnails of visible rows have been swapped in
+            sigc::signal<void> &signal_thumbnails_changed ()
+            {return thumbnails_changed;}
+
+        protected:
+            explicit ImageListModel (int thumbnail_size);
+
+            // Gtk::TreeModel
+            virtual Gtk::TreeModelFlags get_flags_vfunc () const;
+            virtual int get_n_columns_vfunc () const;
+            virtual GType get_column_type_vfunc (int index) const;
+            virtual void get_value_vfunc (const iterator &iter, int column,
+                                          Glib::ValueBase &value) const;
+            virtual bool iter_next_vfunc (const iterator &iter,
+                                          iterator &iter_next) const;
+            virtual bool iter_children_vfunc (const iterator &parent,
+                                              iterator &iter) const;
+            virtual bool iter_has_child_vfunc (const iterator &iter) const;
+            virtual int iter_n_children_vfunc (const iterator &iter) const;
+            virtual int iter_n_root_children_vfunc () const;
+            virtual bool iter_nth_child_vfunc (const iterator &parent, int n,
+                                               iterator &iter) const;
+            virtual bool iter_nth_root_child_vfunc (int n,
+                                                    iterator &iter) const;
+            virtual bool iter_parent_vfunc (const iterator &child,
+                                            iterator &iter) const;
+            virtual Path get_path_vfunc (const iterator &iter) const;
+            virtual bool get_iter_vfunc (const Path &path,
+                                         iterator &iter) const;
+            virtual bool iter_is_valid (const iterator &iter) const;
+
+            // Gtk::TreeDragSource
+            virtual bool row_draggable_vfunc (const Path &path) const;
+            virtual bool drag_data_get_vfunc (const Path &path,
+                                              Gtk::SelectionData &
+                                              selection_data) const;
+            virtual bool drag_data_delete_vfunc (const Path &path);
+
+            // Gtk::TreeDragDest
+            virtual bool drag_data_received_vfunc (const Path &dest,
+                                                   const Gtk::SelectionData &
+                                                   selection_data);
+            virtual bool row_drop_possible_vfunc (const Path &dest,
+                                                  const Gtk::SelectionData &
+                                                  selection_data) const;
+
+        private:
+            struct ThumbnailJobs;
+
+            // Row of iter, or -1 if iter is not a valid iterator of this
+            int row_of (const iterator &iter) const;
+            bool make_iter (int row, iterator &iter) const;
+            Path path_of (int row) const;
+
+            void insert (int row, const SourceImage::Ptr &image);
+            void erase (int row);
+
+            void queue_thumbnail (const SourceImage::Ptr &image);
+            void on_thumbnails_ready ();
+
+            const int thumbnail_size;
+
+            // Bumped whenever rows move, invalidating outstanding iterators
+            int stamp;
+
+            std::vector<SourceImage::Ptr> _images;
+
+            Glib::RefPtr<Gdk::Pixbuf> placeholder;
+
+            // Thumbnails of the visible rows, and the thumbnail jobs still
+            // running for them
+            std::map<const SourceImage *, Glib::RefPtr<Gdk::Pixbuf>> thumbnails;
+            std::map<const SourceImage *,
+                     Glib::RefPtr<Gio::Cancellable>> pending;
+
+            // Shared with the thumbnail jobs, which may outlive the model
+            std::shared_ptr<ThumbnailJobs> jobs;
+            Glib::Dispatcher thumbnails_ready;
+
+            sigc::signal<void> thumbnails_changed;
+        };
+    }
+}
+
+#endif  // IMGPACK_IMAGE_LIST_MODEL_HH
@@ -4,6 +4,8 @@
 #include <vector>
 #include <gtkmm.h>
 
+#include <imgpack/gtkui/image-list-model.hh>
+
 namespace ImgPack
 {
     namespace GtkUI
@@ -11,19 +13,33 @@ namespace ImgPack
         class ImageList : public Gtk::IconView
         {
         public:
+            // Size of the box the thumbnails shown in the list are fitted in
+            static const int THUMBNAIL_SIZE = 150;
+
+            // Rows either side of the visible ones that get thumbnails too,
+            // so that they are mostly ready by the time they scroll in
+            static const int THUMBNAIL_MARGIN = 32;
+
             ImageList ();
             ImageList (const ImageList &) = delete;
-            ~ImageList () {}
 
-            void add_image (const Glib::RefPtr<Gio::File> &file,
-                            const Glib::RefPtr<Gdk::Pixbuf> &pixbuf);
+            // Adds image with a placeholder icon, which is replaced once it
+            // is scrolled into view and its thumbnail has been made
+            void add_image (const SourceImage::Ptr &image);
 
             void remove_selected ();
 
-            std::vector<Glib::RefPtr<Gdk::Pixbuf> > pixbufs ();
+            const std::vector<SourceImage::Ptr> &images () const
+            {return model->images ();}
+
+        protected:
+            virtual bool on_draw (const Cairo::RefPtr<Cairo::Context> &cr);
 
         private:
-            Glib::RefPtr<Gtk::ListStore> model;
+            Glib::RefPtr<ImageListModel> model;
+
+            Gtk::CellRendererPixbuf thumbnail_renderer;
+            Gtk::CellRendererText filename_renderer;
         };
     }
 }
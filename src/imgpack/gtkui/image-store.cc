@@ -0,0 +1,142 @@
+#include <unistd.h>
+
+#include <list>
+#include <map>
+#include <tuple>
+
+#include <imgpack/gtkui/image-store.hh>
+#include <imgpack/gtkui/source-image.hh>
+#include <imgpack/util/logger.hh>
+
+namespace ip = ImgPack;
+namespace ipg = ip::GtkUI;
+
+using ipg::ImageStore;
+
+struct ImageStore::Private
+{
+    Private ();
+
+    typedef std::tuple<const SourceImage *, int, int> Key;
+
+    struct Entry
+    {
+        Key key;
+        SharedSurface surface;
+        std::size_t size;
+    };
+
+    // Everything below is guarded by mutex
+    mutable Glib::Mutex mutex;
+
+    // Most recently used first
+    std::list<Entry> entries;
+
+    // Ordered so that all entries of an image are next to each other
+    std::map<Key, std::list<Entry>::iterator> index;
+
+    std::size_t total_size;
+    std::size_t budget;
+
+    void erase (std::map<Key, std::list<Entry>::iterator>::iterator i);
+    void evict ();
+};
+
+ImageStore::Private::Private () :
+    total_size (0),
+    budget (std::size_t (sysconf (_SC_PHYS_PAGES)) *
+            sysconf (_SC_PAGE_SIZE) / 4)
+{}
+
+void ImageStore::Private::erase
+(std::map<Key, std::list<Entry>::iterator>::iterator i)
+{
+    total_size -= i->second->size;
+    entries.erase (i->second);
+    index.erase (i);
+}
+
+void ImageStore::Private::evict ()
+{
+    while (total_size > budget && !entries.empty ())
+        erase (index.find (entries.back ().key));
+}
+
+
+// ImageStore definitions
+ImageStore::ImageStore () :
+    _priv (new Private)
+{
+    LOG(info) << "Image store budget is " << _priv->budget << " bytes";
+}
+
+ImageStore::~ImageStore () {}
+
+ipg::SharedSurface ImageStore::lookup (const SourceImage &image,
+                                      int width, int height)
+{
+    Glib::Mutex::Lock l (_priv->mutex);
+
+    auto i = _priv->index.find (Private::Key (&image, width, height));
+
+    if (i == _priv->index.end ())
+        return SharedSurface ();
+
+    // Move to the front of the list
+    _priv->entries.splice (_priv->entries.begin (), _priv->entries,
+                           i->second);
+
+    return i->second->surface;
+}
+
+void ImageStore::store (const SourceImage &image, int width, int height,
+                        const SharedSurface &surface)
+{
+    Private::Key key (&image, width, height);
+    Private::Entry entry = {key, surface, surface.size ()};
+
+    Glib::Mutex::Lock l (_priv->mutex);
+
+    auto i = _priv->index.find (key);
+
+    if (i != _priv->index.end ())
+        _priv->erase (i);
+
+    _priv->entries.push_front (entry);
+    _priv->index[key] = _priv->entries.begin ();
+    _priv->total_size += entry.size;
+
+    _priv->evict ();
+}
+
+void ImageStore::forget (const SourceImage &image)
+{
+    Glib::Mutex::Lock l (_priv->mutex);
+
+    auto i = _priv->index.lower_bound (Private::Key (&image, 0, 0));
+
+    while (i != _priv->index.end () && std::get<0> (i->first) == &image)
+        _priv->erase (i++);
+}
+
+std::size_t ImageStore::budget () const
+{
+    Glib::Mutex::Lock l (_priv->mutex);
+
+    return _priv->budget;
+}
+
+void ImageStore::budget (std::size_t bytes)
+{
+    Glib::Mutex::Lock l (_priv->mutex);
+
+    _priv->budget = bytes;
+    _priv->evict ();
+}
+
+std::size_t ImageStore::size () const
+{
+    Glib::Mutex::Lock l (_priv->mutex);
+
+    return _priv->total_size;
+}
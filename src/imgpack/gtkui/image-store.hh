@@ -0,0 +1,63 @@
+#ifndef IMGPACK_IMAGE_STORE_HH
+#define IMGPACK_IMAGE_STORE_HH
+
+#include <memory>
+
+#include <gtkmm.h>
+#include <nihpp/singleton.hh>
+
+#include <imgpack/gtkui/shared-surface.hh>
+
+namespace ImgPack
+{
+    namespace GtkUI
+    {
+        class SourceImage;
+
+        // Decoded pixels of SourceImages at the mipmap levels they are drawn
+        // from, shared by everything that draws them. Levels are kept as
+        // Cairo image surfaces, already in the premultiplied format Cairo
+        // draws from, so painting them never converts pixels. The total size
+        // of the stored surfaces is kept within budget () by dropping the
+        // least recently used ones, which are made again from their
+        // SourceImage when they are next needed.
+        //
+        // All methods may be called from any thread.
+        class ImageStore : public nihpp::Singleton<ImageStore>
+        {
+        private:
+            friend class nihpp::Singleton<ImageStore>;
+
+            ImageStore ();
+            ~ImageStore ();
+
+        public:
+            // Returns the surface stored for image at width x height, or a
+            // null SharedSurface if there is none
+            SharedSurface lookup (const SourceImage &image,
+                                  int width, int height);
+
+            // Stores surface as image at width x height, evicting others if
+            // that takes the store over budget
+            void store (const SourceImage &image, int width, int height,
+                        const SharedSurface &surface);
+
+            // Drops every surface stored for image
+            void forget (const SourceImage &image);
+
+            // Bytes of pixel data the store may hold. Defaults to a quarter
+            // of physical memory.
+            std::size_t budget () const;
+            void budget (std::size_t bytes);
+
+            // Bytes of pixel data currently held
+            std::size_t size () const;
+
+        private:
+            struct Private;
+            const std::unique_ptr<Private> _priv;
+        };
+    }
+}
+
+#endif  // IMGPACK_IMAGE_STORE_HH
@@ -1,3 +1,4 @@
+#include <chrono>
 #include <memory>
 #include <glibmm/i18n.h>
 #include <nihpp/singleton.hh>
@@ -5,12 +6,21 @@
 #include <imgpack/application.hh>
 #include <imgpack/gtkui/image-list.hh>
 #include <imgpack/gtkui/pixbuf-loader.hh>
+#include <imgpack/util/image-writer.hh>
 #include <imgpack/util/logger.hh>
 #include <imgpack/gtkui/collage-viewer.hh>
 
 namespace ip = ImgPack;
 namespace ipg = ip::GtkUI;
 
+namespace {
+    // Time the main loop may spend adding loaded images to the list at once
+    const std::chrono::milliseconds REAP_TIME_BUDGET (8);
+
+    // Images added to the list between checks of REAP_TIME_BUDGET
+    const std::size_t REAP_BATCH_SIZE = 16;
+}
+
 class ipg::StatusController
 {
 public:
@@ -235,6 +245,7 @@ struct ipg::MainWindow::Private : sigc::trackable
     Application                  &app;
     MainWindow                   &self;
     Glib::RefPtr<Gtk::UIManager>  uimgr;
+    Glib::RefPtr<Gtk::Action>     export_action;
 
     void                          init_uimgr ();
 
@@ -249,14 +260,26 @@ struct ipg::MainWindow::Private : sigc::trackable
     Gtk::ProgressBar &progressbar ()    {return status.progressbar;}
 
     PixbufLoader::Ptr             pixbuf_loader;
+    sigc::connection              reap_connection;
+    std::vector<PixbufLoader::Result::Ptr> import_errors;
 
     void                          on_add_clicked ();
+    CollageExporter::Ptr          exporter;
+    StatusClient::Ptr             export_status;
+
     void                          on_export ();
+    void                          start_export (const CollageExporter::Ptr &e);
+    void                          on_export_progress ();
+    void                          on_export_finish ();
+    void                          on_export_abort ();
+    void                          show_export_error (const Glib::ustring &msg);
     void                          on_exec ();
     void                          on_new_window ();
 
     void                          prepare_pixbuf_loader ();
-    void                          reap_pixbufs ();
+    void                          on_pixbufs_loaded ();
+    bool                          reap_pixbufs ();
+    void                          finish_import ();
     void                          on_pixbuf_abort ();
 };
 
@@ -367,8 +390,8 @@ void ipg::MainWindow::Private::init_uimgr ()
                   sigc::mem_fun (image_list,
                                  &ImageList::remove_selected));
 
-    actions->add (Action::create ("ExportAction", Gtk::Stock::SAVE),
-                  sigc::mem_fun (*this, &Private::on_export));
+    export_action = Action::create ("ExportAction", Gtk::Stock::SAVE);
+    actions->add (export_action, sigc::mem_fun (*this, &Private::on_export));
 
     actions->add (Action::create ("ExecAction", Gtk::Stock::EXECUTE),
                   sigc::mem_fun (*this, &Private::on_exec));
@@ -416,7 +439,13 @@ void ipg::MainWindow::Private::on_export ()
 
         for (const auto &i : formats) {
             if (i.get_name () == extension) {
-                viewer.export_to_file (file, i);
+                try {
+                    start_export (viewer.exporter (file, i));
+
+                } catch (ip::Util::ImageWriter::Error &e) {
+                    show_export_error (e.what ());
+                }
+
                 return;
             }
         }
@@ -425,9 +454,74 @@ void ipg::MainWindow::Private::on_export ()
     }
 }
 
+void ipg::MainWindow::Private::start_export (const CollageExporter::Ptr &e)
+{
+    exporter = e;
+    exporter->connect_signal_progress
+        (sigc::mem_fun (*this, &Private::on_export_progress));
+    exporter->connect_signal_finish
+        (sigc::mem_fun (*this, &Private::on_export_finish));
+    exporter->connect_signal_abort
+        (sigc::mem_fun (*this, &Private::on_export_abort));
+
+    // Only one export runs at a time
+    export_action->set_sensitive (false);
+
+    // The statusbar may be showing an import already
+    try {
+        export_status = self.request_status ();
+        export_status->statusbar ().push
+            (_("Exporting collage"),
+             export_status->statusbar ().get_context_id ("CollageExporter"));
+        export_status->progressbar ().set_fraction (0);
+
+    } catch (StatusBusy &) {}
+
+    exporter->start ();
+}
+
+void ipg::MainWindow::Private::on_export_progress ()
+{
+    if (export_status)
+        export_status->progressbar ().set_fraction (exporter->fraction ());
+}
+
+void ipg::MainWindow::Private::on_export_finish ()
+{
+    Glib::ustring error = exporter->error ();
+
+    on_export_abort ();
+
+    if (!error.empty ())
+        show_export_error (error);
+}
+
+void ipg::MainWindow::Private::on_export_abort ()
+{
+    if (export_status)
+        export_status->statusbar ().pop
+            (export_status->statusbar ().get_context_id ("CollageExporter"));
+
+    export_status.reset ();
+    exporter.reset ();
+
+    export_action->set_sensitive (true);
+}
+
+void ipg::MainWindow::Private::show_export_error (const Glib::ustring &msg)
+{
+    LOG(warning) << "Could not export collage: " << msg;
+
+    Gtk::MessageDialog dialog (self, _("Could not export collage"), false,
+                               Gtk::MESSAGE_ERROR);
+    dialog.set_title (_("Export Error"));
+    dialog.set_secondary_text (msg);
+    dialog.run ();
+}
+
 void ipg::MainWindow::Private::on_exec ()
 {
-    viewer.set_source_pixbufs (image_list.pixbufs ());
+    viewer.set_source_images (image_list.images ());
 }
 
 void ipg::MainWindow::Private::on_new_window ()
@@ -441,33 +535,68 @@ void ipg::MainWindow::Private::prepare_pixbuf_loader ()
         return;
 
     pixbuf_loader = PixbufLoader::create (self.request_status ());
+    pixbuf_loader->connect_signal_results
+        (sigc::mem_fun (*this, &Private::on_pixbufs_loaded));
     pixbuf_loader->connect_signal_finish
-        (sigc::mem_fun (*this, &Private::reap_pixbufs));
+        (sigc::mem_fun (*this, &Private::on_pixbufs_loaded));
     pixbuf_loader->connect_signal_abort
         (sigc::mem_fun (*this, &Private::on_pixbuf_abort));
 }
 
+void ipg::MainWindow::Private::on_pixbufs_loaded ()
+{
+    if (!reap_connection.connected ())
+        reap_connection = Glib::signal_idle ().connect
+            (sigc::mem_fun (*this, &Private::reap_pixbufs));
+}
 
-void ipg::MainWindow::Private::reap_pixbufs ()
+bool ipg::MainWindow::Private::reap_pixbufs ()
 {
-    auto results = pixbuf_loader->results ();
+    // Images are added in batches until the time for a frame is used up, so
+    // that the list fills in gradually while the window stays responsive
+    auto deadline = std::chrono::steady_clock::now () + REAP_TIME_BUDGET;
 
-    ImportErrorDialog errors (self);
+    do {
+        auto results = pixbuf_loader->take_results (REAP_BATCH_SIZE);
 
-    for (auto i : results)
-        if (*i)
-            image_list.add_image (i->file (), i->pixbuf ());
+        if (results.empty ()) {
+            if (!pixbuf_loader->is_running ())
+                finish_import ();
+
+            return false;
+        }
 
-        else
-            errors.add_error (i->file (), i->message ());
+        for (auto i : results)
+            if (*i)
+                image_list.add_image (i->image ());
 
+            else
+                import_errors.push_back (i);
+
+    } while (std::chrono::steady_clock::now () < deadline);
+
+    return true;
+}
+
+void ipg::MainWindow::Private::finish_import ()
+{
     pixbuf_loader.reset ();
 
-    if (errors.has_errors ())
-        errors.run ();
+    if (import_errors.empty ())
+        return;
+
+    ImportErrorDialog errors (self);
+
+    for (auto i : import_errors)
+        errors.add_error (i->file (), i->message ());
+
+    import_errors.clear ();
+    errors.run ();
 }
 
 void ipg::MainWindow::Private::on_pixbuf_abort ()
 {
+    reap_connection.disconnect ();
+    import_errors.clear ();
     pixbuf_loader.reset ();
 }
@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <unordered_set>
 #include <queue>
 
@@ -6,13 +7,20 @@
 #include <glibmm/i18n.h>
 #include <imgpack/gtkui/pixbuf-loader.hh>
 #include <imgpack/gtkui/main-window.hh>
+#include <imgpack/gtkui/thumbnail-cache.hh>
 #include <imgpack/util/logger.hh>
+#include <imgpack/util/thread-pool.hh>
 
 namespace ip = ImgPack;
 namespace ipg = ip::GtkUI;
 
 using ipg::PixbufLoader;
 
+namespace {
+    // How often run () checks for cancellation while files are in flight
+    const int CANCEL_POLL_INTERVAL = 100; // ms
+}
+
 struct PixbufLoader::Private
 {
     Private (PixbufLoader &self, const ipg::StatusClient::Ptr &status);
@@ -21,18 +29,47 @@ struct PixbufLoader::Private
     StatusClient::Ptr status;
 
     Glib::Dispatcher progress;
+    sigc::signal<void> results_available;
 
     guint status_context;
 
+    // Everything below is shared with the pool tasks, and guarded by mutex
     Glib::Mutex mutex;
+
+    // Signalled whenever files are queued or a task finishes
+    Glib::Cond changed;
+
     std::queue<Glib::RefPtr<Gio::File> > unprocessed;
     std::list<std::shared_ptr<Result> > results;
+    std::size_t nresults; // including those taken already
 
     std::unordered_set<std::string> visited;
 
-    Glib::RefPtr<Gio::File> get_next_unprocessed ();
+    // Number of files being processed, which may yet enqueue more files
+    std::size_t nbusy;
+
+    // What the first task to fail threw, which stops the rest of the load
+    std::exception_ptr error;
+
+    void push_unprocessed (const Glib::RefPtr<Gio::File> &file);
+
+    // Pushes a task onto the pool for each unprocessed file, keeping no more
+    // than max_tasks in flight. Called with mutex held.
+    void start_tasks (std::size_t max_tasks);
+
+    // Blocks until every task in flight has finished. Called with mutex
+    // held.
+    void wait_for_tasks ();
+
+    // Returns false if fileid was already visited
+    bool visit (const std::string &fileid);
+
+    // Body of the pool task for file
+    void work (const Glib::RefPtr<Gio::File> &file);
+    void process_file (const Glib::RefPtr<Gio::File> &file);
     void recurse_file (const Glib::RefPtr<Gio::File> &file);
-    void load_pixbuf (const Glib::RefPtr<Gio::File> &file);
+    void load_image (const Glib::RefPtr<Gio::File> &file,
+                     const Glib::RefPtr<Gio::FileInfo> &fileinfo);
 
     void on_progress ();
 
@@ -44,19 +81,106 @@ PixbufLoader::Private::Private (PixbufLoader &self,
                                 const ipg::StatusClient::Ptr &status) :
     self (self),
     status (status),
-    status_context (status->statusbar ().get_context_id ("PixbufLoader")) {}
+    status_context (status->statusbar ().get_context_id ("PixbufLoader")),
+    nresults (0),
+    nbusy (0) {}
 
-Glib::RefPtr<Gio::File> PixbufLoader::Private::get_next_unprocessed ()
+void PixbufLoader::Private::push_unprocessed
+(const Glib::RefPtr<Gio::File> &file)
 {
     Glib::Mutex::Lock l (mutex);
 
-    if (unprocessed.empty ())
-        return Glib::RefPtr<Gio::File> ();
+    unprocessed.push (file);
+    changed.signal ();
+}
 
-    auto retval = unprocessed.front ();
-    unprocessed.pop ();
+void PixbufLoader::Private::start_tasks (std::size_t max_tasks)
+{
+    ip::Util::ThreadPool &pool = ip::Util::ThreadPool::instance ();
 
-    return retval;
+    while (!unprocessed.empty () && nbusy < max_tasks && !error) {
+        Glib::RefPtr<Gio::File> file = unprocessed.front ();
+        unprocessed.pop ();
+        nbusy++;
+
+        pool.push ([this, file] () {work (file);});
+    }
+}
+
+void PixbufLoader::Private::wait_for_tasks ()
+{
+    while (nbusy > 0)
+        changed.wait (mutex);
+}
+
+bool PixbufLoader::Private::visit (const std::string &fileid)
+{
+    Glib::Mutex::Lock l (mutex);
+
+    return visited.insert (fileid).second;
+}
+
+void PixbufLoader::Private::work (const Glib::RefPtr<Gio::File> &file)
+{
+    bool cancelled = false;
+    std::exception_ptr failure;
+
+    try {
+        // Tasks still queued when the load is aborted would otherwise fail
+        // on the cancellable, and skip their files
+        testcancelled ();
+        process_file (file);
+
+    } catch (Cancelled &e) {
+        cancelled = true;
+
+    } catch (...) {
+        failure = std::current_exception ();
+    }
+
+    Glib::Mutex::Lock l (mutex);
+
+    // We were cancelled, so put the file back
+    if (cancelled)
+        unprocessed.push (file);
+
+    if (failure && !error)
+        error = failure;
+
+    nbusy--;
+    changed.signal ();
+}
+
+void PixbufLoader::Private::process_file (const Glib::RefPtr<Gio::File> &file)
+{
+    try {
+        auto fileinfo = file->query_info (cancellable ());
+        testcancelled ();
+
+        // Check if visited to avoid recursive loop
+        if (!visit (fileinfo->get_attribute_string (G_FILE_ATTRIBUTE_ID_FILE)))
+            return;
+
+        switch (fileinfo->get_file_type ()) {
+        case Gio::FILE_TYPE_DIRECTORY:
+            recurse_file (file);
+            break;
+
+        case Gio::FILE_TYPE_REGULAR:
+            load_image (file, fileinfo);
+            break;
+
+        default:
+            LOG(warning) << "Ignoring file " << file->get_uri ()
+                         << " because it has unknown file type "
+                         << fileinfo->get_file_type ();
+        }
+
+    } catch (Gio::Error &e) {
+        LOG(warning) << "Skipping file " << file->get_uri ()
+                     << "because Gio::Error was thrown: "
+                     << e.what ();
+    }
 }
 
 void PixbufLoader::Private::recurse_file (const Glib::RefPtr<Gio::File> &file)
@@ -73,31 +197,37 @@ void PixbufLoader::Private::recurse_file (const Glib::RefPtr<Gio::File> &file)
         Glib::RefPtr<Gio::File> child =
             file->resolve_relative_path (i->get_name ());
 
-        self.enqueue (child);
+        push_unprocessed (child);
     }
 }
 
-void PixbufLoader::Private::load_pixbuf (const Glib::RefPtr<Gio::File> &file)
+void PixbufLoader::Private::load_image
+(const Glib::RefPtr<Gio::File> &file,
+ const Glib::RefPtr<Gio::FileInfo> &fileinfo)
 {
     try {
-        auto pixbuf =
-            Gdk::Pixbuf::create_from_stream (file->read (),
-                                             cancellable ());
+        auto image = SourceImage::probe (file, ThumbnailCache::key (fileinfo),
+                                         cancellable ());
 
         testcancelled ();
 
         Glib::Mutex::Lock l (mutex);
 
-        results.push_back (Result::create (file, pixbuf));
+        results.push_back (Result::create (image));
+        nresults++;
 
-        LOG(info) << "Successfully loaded pixbuf from " << file->get_uri ();
+        LOG(info) << "Successfully loaded image from " << file->get_uri ()
+                  << " (" << image->width () << "x" << image->height () << ")";
 
     } catch (Glib::Exception &e) {
         testcancelled ();
 
+        Glib::Mutex::Lock l (mutex);
+
         results.push_back (Result::create (file, e));
+        nresults++;
 
-        LOG(info) << "Could not load pixbuf from " << file->get_uri () << ": "
+        LOG(info) << "Could not load image from " << file->get_uri () << ": "
                   << e.what ();
     }
 
@@ -106,8 +236,12 @@ void PixbufLoader::Private::load_pixbuf (const Glib::RefPtr<Gio::File> &file)
 
 void PixbufLoader::Private::on_progress ()
 {
-    int unprocessed_size = unprocessed.size ();
-    int results_size = results.size ();
+    Glib::Mutex::Lock l (mutex);
+
+    int unprocessed_size = unprocessed.size () + nbusy;
+    int results_size = nresults;
+
+    l.release ();
 
     int total = unprocessed_size + results_size;
     double fraction;
@@ -126,6 +260,8 @@ void PixbufLoader::Private::on_progress ()
 
     LOG(info) << "Progress fraction is " << fraction;
     status->progressbar ().set_fraction (fraction);
+
+    results_available ();
 }
 
 
@@ -141,59 +277,72 @@ PixbufLoader::~PixbufLoader () {}
 
 void PixbufLoader::enqueue (const Glib::RefPtr<Gio::File> &file)
 {
-    _priv->unprocessed.push (file);
+    _priv->push_unprocessed (file);
 }
 
-const std::list<PixbufLoader::Result::Ptr> &PixbufLoader::results () const
+std::list<PixbufLoader::Result::Ptr>
+PixbufLoader::take_results (std::size_t max_results)
 {
-    return _priv->results;
+    Glib::Mutex::Lock l (_priv->mutex);
+
+    std::list<Result::Ptr> retval;
+    auto end = _priv->results.begin ();
+
+    for (std::size_t i = 0; i < max_results && end != _priv->results.end ();
+         i++)
+        ++end;
+
+    retval.splice (retval.end (), _priv->results,
+                   _priv->results.begin (), end);
+
+    return retval;
 }
 
-void PixbufLoader::run ()
+sigc::connection
+PixbufLoader::connect_signal_results (sigc::slot<void> results_slot)
 {
-    while (Glib::RefPtr<Gio::File> file = _priv->get_next_unprocessed ()) {
-        try {
-            auto fileinfo = file->query_info (cancellable ());
-            testcancelled ();
+    return _priv->results_available.connect (results_slot);
+}
 
-            std::string fileid =
-                fileinfo->get_attribute_string (G_FILE_ATTRIBUTE_ID_FILE);
+void PixbufLoader::run ()
+{
+    // Each file is a task of its own, so that thumbnail and scaling jobs
+    // pushed onto the pool meanwhile take turns with them instead of waiting
+    // for the whole load. Directories are walked by the same tasks that load
+    // the images in them, so that images start loading while the rest are
+    // being found.
+    std::size_t max_tasks =
+        std::max (ip::Util::ThreadPool::instance ().get_max_threads (), 1);
 
-            // Check if visited to avoid recursive loop
-            if (_priv->visited.find (fileid) != _priv->visited.end ())
-                    continue;
+    Glib::Mutex::Lock l (_priv->mutex);
 
-            switch (fileinfo->get_file_type ()) {
-            case Gio::FILE_TYPE_DIRECTORY:
-                _priv->recurse_file (file);
-                break;
+    try {
+        for (;;) {
+            _priv->start_tasks (max_tasks);
 
-            case Gio::FILE_TYPE_REGULAR:
-                _priv->load_pixbuf (file);
+            if (_priv->error || (_priv->nbusy == 0 &&
+                                 _priv->unprocessed.empty ()))
                 break;
 
-            default:
-                LOG(warning) << "Ignoring file " << file->get_uri ()
-                             << " because it has unknown file type "
-                             << fileinfo->get_file_type ();
-            }
+            Glib::TimeVal timeout;
+            timeout.assign_current_time ();
+            timeout.add_milliseconds (CANCEL_POLL_INTERVAL);
 
-            _priv->visited.insert
-                (fileinfo->get_attribute_string (G_FILE_ATTRIBUTE_ID_FILE));
+            _priv->changed.timed_wait (_priv->mutex, timeout);
+            testcancelled ();
+        }
 
-        } catch (Gio::Error &e) {
-            LOG(warning) << "Skipping file " << file->get_uri ()
-                         << "because Gio::Error was thrown: "
-                         << e.what ();
+    } catch (...) {
+        // Tasks in flight use _priv, and find out about the abort soon
+        // enough through the cancellable
+        _priv->wait_for_tasks ();
+        throw;
+    }
 
-        } catch (Cancelled &e) {
-            // We were cancelled, so put the file back
-            Glib::Mutex::Lock l (_priv->mutex);
-            _priv->unprocessed.push (file);
+    _priv->wait_for_tasks ();
 
-            throw;
-        }
+    if (_priv->error)
+        std::rethrow_exception (_priv->error);
 
-        testcancelled ();
-    }
+    testcancelled ();
 }
@@ -4,6 +4,7 @@
 #include <nihpp/sharedptrcreator.hh>
 #include <gtkmm.h>
 
+#include <imgpack/gtkui/source-image.hh>
 #include <imgpack/util/async-operation.hh>
 
 namespace ImgPack
@@ -13,6 +14,13 @@ namespace ImgPack
         class MainWindow;
         class StatusClient;
 
+        // Finds the images under the enqueued files. Each image is only probed
+        // for its dimensions, and is left to be decoded at whatever size it
+        // is shown at later.
+        //
+        // Each file is walked or probed as a task of its own on the
+        // Util::ThreadPool, with as many in flight as the pool has threads.
+        // enqueue () may be called from any thread.
         class PixbufLoader : public Util::AsyncOperation,
                              public nihpp::SharedPtrCreator<PixbufLoader>
         {
@@ -25,7 +33,14 @@ namespace ImgPack
 
             void enqueue (const Glib::RefPtr<Gio::File> &file);
 
-            const std::list<std::shared_ptr<Result> > & results () const;
+            // Removes and returns up to max_results of the results so far,
+            // oldest first. This may be called while the loader is running.
+            std::list<std::shared_ptr<Result> >
+            take_results (std::size_t max_results);
+
+            // Emitted on the main loop after new results become available
+            sigc::connection
+            connect_signal_results (sigc::slot<void> results_slot);
 
         private:
             class Private;
@@ -40,10 +55,9 @@ namespace ImgPack
             public nihpp::SharedPtrCreator<Result>
         {
         public:
-            Result (Glib::RefPtr<Gio::File> file,
-                    Glib::RefPtr<Gdk::Pixbuf> pixbuf) :
-                _file (file),
-                _pixbuf (pixbuf),
+            Result (std::shared_ptr<SourceImage> image) :
+                _file (image->file ()),
+                _image (image),
                 error (false)
             {}
 
@@ -54,16 +68,16 @@ namespace ImgPack
                 error (true)
             {}
 
-            Glib::RefPtr<Gio::File>     file ()     {return _file;}
-            Glib::RefPtr<Gdk::Pixbuf>   pixbuf ()   {return _pixbuf;}
-            Glib::ustring               message ()  {return _message;}
+            Glib::RefPtr<Gio::File>       file ()      {return _file;}
+            std::shared_ptr<SourceImage>  image ()     {return _image;}
+            Glib::ustring                 message ()   {return _message;}
 
             explicit operator bool () {return !error;}
 
         private:
-            Glib::RefPtr<Gio::File>     _file;
-            Glib::RefPtr<Gdk::Pixbuf>   _pixbuf;
-            Glib::ustring               _message;
+            Glib::RefPtr<Gio::File>       _file;
+            std::shared_ptr<SourceImage>  _image;
+            Glib::ustring                 _message;
 
             bool error;
         };
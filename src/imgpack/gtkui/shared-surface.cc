@@ -0,0 +1,83 @@
+#include <new>
+#include <stdexcept>
+
+#include <imgpack/gtkui/shared-surface.hh>
+
+namespace ip = ImgPack;
+namespace ipg = ip::GtkUI;
+
+using ipg::SharedSurface;
+
+SharedSurface::SharedSurface (cairo_surface_t *surface) :
+    // Cairo counts references atomically, and so does shared_ptr
+    surface (surface, &cairo_surface_destroy)
+{}
+
+SharedSurface SharedSurface::create (Cairo::Format format,
+                                     int width, int height)
+{
+    cairo_surface_t *surface =
+        cairo_image_surface_create (static_cast<cairo_format_t> (format),
+                                    width, height);
+    cairo_status_t status = cairo_surface_status (surface);
+
+    // Cairo hands back an inert surface without pixels instead of failing
+    if (status != CAIRO_STATUS_SUCCESS) {
+        cairo_surface_destroy (surface);
+
+        if (status == CAIRO_STATUS_NO_MEMORY)
+            throw std::bad_alloc ();
+
+        throw std::length_error (cairo_status_to_string (status));
+    }
+
+    return SharedSurface (surface);
+}
+
+int SharedSurface::width () const
+{
+    return cairo_image_surface_get_width (surface.get ());
+}
+
+int SharedSurface::height () const
+{
+    return cairo_image_surface_get_height (surface.get ());
+}
+
+int SharedSurface::stride () const
+{
+    return cairo_image_surface_get_stride (surface.get ());
+}
+
+Cairo::Format SharedSurface::format () const
+{
+    return static_cast<Cairo::Format>
+        (cairo_image_surface_get_format (surface.get ()));
+}
+
+unsigned char *SharedSurface::data () const
+{
+    return cairo_image_surface_get_data (surface.get ());
+}
+
+std::size_t SharedSurface::size () const
+{
+    return std::size_t (stride ()) * height ();
+}
+
+void SharedSurface::flush () const
+{
+    cairo_surface_flush (surface.get ());
+}
+
+void SharedSurface::mark_dirty () const
+{
+    cairo_surface_mark_dirty (surface.get ());
+}
+
+Cairo::RefPtr<Cairo::ImageSurface> SharedSurface::wrap () const
+{
+    return Cairo::RefPtr<Cairo::ImageSurface>
+        (new Cairo::ImageSurface (cairo_surface_reference (surface.get ()),
+                                  true));
+}
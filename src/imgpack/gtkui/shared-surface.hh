@@ -0,0 +1,59 @@
+#ifndef IMGPACK_SHARED_SURFACE_HH
+#define IMGPACK_SHARED_SURFACE_HH
+
+#include <memory>
+#include <gtkmm.h>
+
+namespace ImgPack
+{
+    namespace GtkUI
+    {
+        // Cairo image surface which may be handed between threads.
+        // Cairo::RefPtr keeps a reference count of its own that is not
+        // atomic, so it must never be copied or dropped on two threads at
+        // once. SharedSurface holds the plain cairo_surface_t instead, and
+        // only the thread about to draw with it wraps it in a Cairo::RefPtr.
+        //
+        // Pixels may be written by one thread while nobody else holds the
+        // surface, and only read once it is shared.
+        class SharedSurface
+        {
+        public:
+            SharedSurface () {}
+
+            // Takes over the reference held on surface
+            explicit SharedSurface (cairo_surface_t *surface);
+
+            // Throws std::length_error if Cairo cannot make surfaces of width
+            // x height, which is the case beyond 32767 pixels either way,
+            // and std::bad_alloc if there is no memory for the pixels
+            static SharedSurface create (Cairo::Format format,
+                                         int width, int height);
+
+            explicit operator bool () const {return bool (surface);}
+
+            cairo_surface_t *cobj () const {return surface.get ();}
+
+            int width () const;
+            int height () const;
+            int stride () const;
+            Cairo::Format format () const;
+            unsigned char *data () const;
+
+            // Bytes of pixel data held
+            std::size_t size () const;
+
+            void flush () const;
+            void mark_dirty () const;
+
+            // Cairo::RefPtr to the surface, to be used and dropped on the
+            // calling thread
+            Cairo::RefPtr<Cairo::ImageSurface> wrap () const;
+
+        private:
+            std::shared_ptr<cairo_surface_t> surface;
+        };
+    }
+}
+
+#endif  // IMGPACK_SHARED_SURFACE_HH
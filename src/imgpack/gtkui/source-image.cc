@@ -0,0 +1,290 @@
+#include <algorithm>
+
+#include <nihpp/sigc++/fixfunctors.hh>
+#include <imgpack/gtkui/image-store.hh>
+#include <imgpack/gtkui/source-image.hh>
+#include <imgpack/gtkui/thumbnail-cache.hh>
+#include <imgpack/util/resampler.hh>
+
+namespace ip = ImgPack;
+namespace ipg = ip::GtkUI;
+
+using ipg::SourceImage;
+
+namespace {
+    // Headers are read in chunks of this many bytes until the size is known
+    const gsize PROBE_CHUNK_SIZE = 4096;
+
+    // Finer mipmap levels looked at before decoding a level from the file
+    const int MAX_MIPMAP_SOURCE_DISTANCE = 3;
+
+    // Size of the image at the given mipmap level
+    int halve (int size, int level)
+    {
+        return std::max (((size - 1) >> level) + 1, 1);
+    }
+
+    // Scales pixbuf down to fit within width x height, keeping its aspect
+    // ratio
+    Glib::RefPtr<Gdk::Pixbuf> fit (const Glib::RefPtr<Gdk::Pixbuf> &pixbuf,
+                                   int width, int height)
+    {
+        double scale = std::min (double (width) / pixbuf->get_width (),
+                                 double (height) / pixbuf->get_height ());
+
+        if (scale >= 1)
+            return pixbuf;
+
+        return ip::Util::Resampler::scale
+            (pixbuf,
+             std::max<int> (pixbuf->get_width () * scale + 0.5, 1),
+             std::max<int> (pixbuf->get_height () * scale + 0.5, 1));
+    }
+
+    // Copies pixbuf into a surface of the format Cairo draws from, which
+    // has its colour channels premultiplied by alpha
+    ipg::SharedSurface to_surface (const Glib::RefPtr<Gdk::Pixbuf> &pixbuf)
+    {
+        bool has_alpha = pixbuf->get_has_alpha ();
+        int width = pixbuf->get_width ();
+        int height = pixbuf->get_height ();
+        int channels = pixbuf->get_n_channels ();
+
+        ipg::SharedSurface surface =
+            ipg::SharedSurface::create (has_alpha ? Cairo::FORMAT_ARGB32 :
+                                        Cairo::FORMAT_RGB24,
+                                        width, height);
+        surface.flush ();
+
+        for (int y = 0; y < height; y++) {
+            const guint8 *src = pixbuf->get_pixels () +
+                std::size_t (y) * pixbuf->get_rowstride ();
+            guint32 *dest = reinterpret_cast<guint32 *>
+                (surface.data () + std::size_t (y) * surface.stride ());
+
+            for (int x = 0; x < width; x++, src += channels) {
+                guint32 alpha = has_alpha ? src[3] : 0xff;
+                guint32 red = src[0], green = src[1], blue = src[2];
+
+                if (alpha != 0xff) {
+                    red = (red * alpha + 127) / 255;
+                    green = (green * alpha + 127) / 255;
+                    blue = (blue * alpha + 127) / 255;
+                }
+
+                dest[x] = alpha << 24 | red << 16 | green << 8 | blue;
+            }
+        }
+
+        surface.mark_dirty ();
+
+        return surface;
+    }
+}
+
+
+// SourceImage definitions
+SourceImage::SourceImage (const Glib::RefPtr<Gio::File> &file,
+                          int width, int height,
+                          const std::string &cache_key) :
+    _file (file),
+    _width (width),
+    _height (height),
+    _cache_key (cache_key)
+{}
+
+SourceImage::~SourceImage ()
+{
+    ImageStore::instance ().forget (*this);
+}
+
+SourceImage::Ptr
+SourceImage::probe (const Glib::RefPtr<Gio::File> &file,
+                    const std::string &cache_key,
+                    const Glib::RefPtr<Gio::Cancellable> &cancellable)
+{
+    int width = 0;
+    int height = 0;
+
+    if (!cache_key.empty () &&
+        ThumbnailCache::instance ().dimensions (cache_key, width, height))
+        return create (file, width, height, cache_key);
+
+    Glib::RefPtr<Gio::FileInputStream> stream = file->read (cancellable);
+    Glib::RefPtr<Gdk::PixbufLoader> loader = Gdk::PixbufLoader::create ();
+
+    // Emitted as soon as the loader has parsed the header
+    loader->signal_size_prepared ().connect ([&width, &height] (int w, int h) {
+            width = w;
+            height = h;
+        });
+
+    guint8 buffer[PROBE_CHUNK_SIZE];
+
+    while (width == 0) {
+        gssize nread = stream->read (buffer, sizeof buffer, cancellable);
+
+        if (nread <= 0)
+            break;
+
+        loader->write (buffer, nread);
+    }
+
+    stream->close ();
+
+    try {
+        loader->close ();
+
+    } catch (Gdk::PixbufError &e) {
+        // The rest of the image was never written, which the loader is bound
+        // to complain about if it got as far as the header
+        if (width == 0)
+            throw;
+    }
+
+    if (width <= 0 || height <= 0)
+        throw Gdk::PixbufError (Gdk::PixbufError::CORRUPT_IMAGE,
+                                "Image has no size");
+
+    return create (file, width, height, cache_key);
+}
+
+Glib::RefPtr<Gdk::Pixbuf>
+SourceImage::load (int width, int height,
+                   const Glib::RefPtr<Gio::Cancellable> &cancellable) const
+{
+    if (width >= _width && height >= _height)
+        return load (cancellable);
+
+    int level = _cache_key.empty () ? 0 :
+        ThumbnailCache::level_for (std::max (width, height));
+
+    if (level == 0)
+        return decode (width, height, cancellable);
+
+    ThumbnailCache &cache = ThumbnailCache::instance ();
+    Glib::RefPtr<Gdk::Pixbuf> pixbuf = cache.lookup (_cache_key, level);
+
+    if (!pixbuf) {
+        pixbuf = decode (level, level, cancellable);
+        cache.store (_cache_key, level, _width, _height, pixbuf);
+    }
+
+    return fit (pixbuf, width, height);
+}
+
+Glib::RefPtr<Gdk::Pixbuf>
+SourceImage::load (const Glib::RefPtr<Gio::Cancellable> &cancellable) const
+{
+    return Gdk::Pixbuf::create_from_stream (_file->read (cancellable),
+                                            cancellable);
+}
+
+Glib::RefPtr<Gdk::Pixbuf>
+SourceImage::decode (int width, int height,
+                     const Glib::RefPtr<Gio::Cancellable> &cancellable) const
+{
+    if (width >= _width && height >= _height)
+        return load (cancellable);
+
+    return Gdk::Pixbuf::create_from_stream_at_scale (_file->read (cancellable),
+                                                     std::max (width, 1),
+                                                     std::max (height, 1),
+                                                     true, cancellable);
+}
+
+int SourceImage::level_for (int width, int height) const
+{
+    int level = 0;
+
+    while (halve (_width, level) > 1 || halve (_height, level) > 1) {
+        if (halve (_width, level + 1) < width ||
+            halve (_height, level + 1) < height)
+            break;
+
+        level++;
+    }
+
+    return level;
+}
+
+int SourceImage::level_width (int level) const
+{
+    return halve (_width, level);
+}
+
+int SourceImage::level_height (int level) const
+{
+    return halve (_height, level);
+}
+
+ipg::SharedSurface
+SourceImage::mipmap (int level,
+                     const Glib::RefPtr<Gio::Cancellable> &cancellable) const
+{
+    int width = level_width (level);
+    int height = level_height (level);
+
+    ImageStore &store = ImageStore::instance ();
+    SharedSurface surface = store.lookup (*this, width, height);
+
+    if (surface)
+        return surface;
+
+    // Scaling down a level that is already decoded touches far less memory
+    // than going back to the file
+    for (int finer = level - 1;
+         finer >= std::max (0, level - MAX_MIPMAP_SOURCE_DISTANCE) && !surface;
+         finer--) {
+        SharedSurface source =
+            store.lookup (*this, level_width (finer), level_height (finer));
+
+        if (!source)
+            continue;
+
+        surface = SharedSurface::create (source.format (), width, height);
+        ip::Util::Resampler::scale (source.data (), source.width (),
+                                    source.height (), source.stride (),
+                                    surface.data (), width, height,
+                                    surface.stride (), 4,
+                                    ip::Util::Resampler::BOX);
+        surface.mark_dirty ();
+    }
+
+    if (!surface) {
+        Glib::RefPtr<Gdk::Pixbuf> pixbuf = level == 0 ? load (cancellable) :
+            load (width, height, cancellable);
+
+        // Decoders only get within rounding of the asked size
+        surface = to_surface (ip::Util::Resampler::scale (pixbuf,
+                                                          width, height));
+    }
+
+    store.store (*this, width, height, surface);
+
+    return surface;
+}
+
+ipg::SharedSurface SourceImage::cached_mipmap (int level) const
+{
+    ImageStore &store = ImageStore::instance ();
+    int coarsest = level_for (1, 1);
+
+    for (int i = level; i >= 0; i--) {
+        SharedSurface surface =
+            store.lookup (*this, level_width (i), level_height (i));
+
+        if (surface)
+            return surface;
+    }
+
+    for (int i = level + 1; i <= coarsest; i++) {
+        SharedSurface surface =
+            store.lookup (*this, level_width (i), level_height (i));
+
+        if (surface)
+            return surface;
+    }
+
+    return SharedSurface ();
+}
@@ -0,0 +1,95 @@
+#ifndef IMGPACK_SOURCE_IMAGE_HH
+#define IMGPACK_SOURCE_IMAGE_HH
+
+#include <string>
+
+#include <nihpp/sharedptrcreator.hh>
+#include <gtkmm.h>
+
+#include <imgpack/gtkui/shared-surface.hh>
+
+namespace ImgPack
+{
+    namespace GtkUI
+    {
+        // An image file whose dimensions are known, but whose pixels are only
+        // decoded on request, and then only at the size they are needed at.
+        // Packing needs nothing but the dimensions, and collages are nearly
+        // always much smaller than their sources, so decoding every image
+        // in full up front is mostly wasted.
+        //
+        // Images with a cache key are loaded through the ThumbnailCache when
+        // they are wanted small. SourceImages are immutable, so they can be
+        // loaded from any thread.
+        class SourceImage : public nihpp::SharedPtrCreator<SourceImage>
+        {
+        public:
+            SourceImage (const Glib::RefPtr<Gio::File> &file,
+                         int width, int height,
+                         const std::string &cache_key = std::string ());
+            SourceImage (const SourceImage &) = delete;
+            ~SourceImage ();
+
+            // Reads only as much of file as is needed to find the dimensions
+            // of the image, or nothing at all if cache_key is cached. Throws
+            // Glib::Error if it cannot be read or is not an image.
+            static Ptr probe (const Glib::RefPtr<Gio::File> &file,
+                              const std::string &cache_key,
+                              const Glib::RefPtr<Gio::Cancellable> &
+                              cancellable = Glib::RefPtr<Gio::Cancellable> ());
+
+            Glib::RefPtr<Gio::File> file () const {return _file;}
+            int width () const {return _width;}
+            int height () const {return _height;}
+
+            // Decodes the image at width x height, letting the decoder skip
+            // detail that would be lost anyway. Never scales up, so the
+            // result is smaller than asked for if the image itself is.
+            Glib::RefPtr<Gdk::Pixbuf>
+            load (int width, int height,
+                  const Glib::RefPtr<Gio::Cancellable> &cancellable =
+                  Glib::RefPtr<Gio::Cancellable> ()) const;
+
+            // Decodes the image at full resolution
+            Glib::RefPtr<Gdk::Pixbuf>
+            load (const Glib::RefPtr<Gio::Cancellable> &cancellable =
+                  Glib::RefPtr<Gio::Cancellable> ()) const;
+
+            // Mipmap levels are the image halved level times over, rounding
+            // up. Returns the smallest level at least width x height, which
+            // is 0 if the image is smaller than that.
+            int level_for (int width, int height) const;
+            int level_width (int level) const;
+            int level_height (int level) const;
+
+            // Returns the image at the given mipmap level, ready for Cairo to
+            // paint and shared through the ImageStore. Missing levels are
+            // scaled down from a finer level if one is stored, and only
+            // decoded otherwise.
+            SharedSurface
+            mipmap (int level,
+                    const Glib::RefPtr<Gio::Cancellable> &cancellable =
+                    Glib::RefPtr<Gio::Cancellable> ()) const;
+
+            // Returns the given mipmap level if the ImageStore has it, or else
+            // the nearest level it has, finer ones first. Never decodes, so
+            // it returns a null SharedSurface if no level is stored at all.
+            SharedSurface cached_mipmap (int level) const;
+
+        private:
+            // Decodes the file without going through the cache
+            Glib::RefPtr<Gdk::Pixbuf>
+            decode (int width, int height,
+                    const Glib::RefPtr<Gio::Cancellable> &cancellable) const;
+
+            Glib::RefPtr<Gio::File> _file;
+            int _width;
+            int _height;
+
+            // Key of the file in the ThumbnailCache, empty if it has none
+            std::string _cache_key;
+        };
+    }
+}
+
+#endif  // IMGPACK_SOURCE_IMAGE_HH
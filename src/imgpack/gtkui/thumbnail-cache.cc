@@ -0,0 +1,405 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <sstream>
+#include <unordered_map>
+#include <vector>
+
+#include <nihpp/sigc++/fixfunctors.hh>
+#include <imgpack/gtkui/thumbnail-cache.hh>
+#include <imgpack/util/logger.hh>
+
+namespace ip = ImgPack;
+namespace ipg = ip::GtkUI;
+
+using ipg::ThumbnailCache;
+
+namespace {
+    // Longest side of the cached images, in pixels
+    const int LEVELS[] = {256, 512, 1024};
+
+    const std::size_t DEFAULT_MAX_SIZE = std::size_t (1) << 30;
+
+    // Fraction of max_size () that a full cache is trimmed down to, so that
+    // not every store has to evict something
+    const double EVICTION_TARGET = 0.9;
+
+    const char MAGIC[8] = {'I', 'M', 'G', 'P', 'K', 'T', 'H', '1'};
+
+    // Cache files hold a Header followed by the pixels, laid out exactly as
+    // in the Gdk::Pixbuf they were stored from
+    struct Header
+    {
+        char magic[8];
+        guint32 full_width;
+        guint32 full_height;
+        guint32 width;
+        guint32 height;
+        guint32 rowstride;
+        guint32 has_alpha;
+    };
+
+    // Maps a whole file read-only, returning nullptr on failure
+    const guint8 *map_file (const std::string &filename, std::size_t &length)
+    {
+        int fd = open (filename.c_str (), O_RDONLY);
+
+        if (fd < 0)
+            return nullptr;
+
+        struct stat st;
+        void *data = MAP_FAILED;
+
+        if (fstat (fd, &st) == 0 && st.st_size > 0) {
+            length = st.st_size;
+            data = mmap (nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        }
+
+        close (fd);
+
+        return data == MAP_FAILED ? nullptr : static_cast<guint8 *> (data);
+    }
+
+    void unmap_file (const guint8 *data, std::size_t length)
+    {
+        munmap (const_cast<guint8 *> (data), length);
+    }
+
+    // Returns the header of a mapped cache file, or nullptr if it is not one
+    const Header *get_header (const guint8 *data, std::size_t length)
+    {
+        if (!data || length < sizeof (Header))
+            return nullptr;
+
+        const Header *header = reinterpret_cast<const Header *> (data);
+        std::size_t row_length = header->width * (header->has_alpha ? 4 : 3);
+
+        if (std::memcmp (header->magic, MAGIC, sizeof MAGIC) != 0 ||
+            header->width == 0 || header->height == 0 ||
+            header->rowstride < row_length ||
+            length < sizeof (Header) +
+            std::size_t (header->rowstride) * (header->height - 1) +
+            row_length)
+            return nullptr;
+
+        return header;
+    }
+
+    std::string entry_name (const std::string &key, int level)
+    {
+        std::ostringstream name;
+        name << key << '-' << level;
+
+        return name.str ();
+    }
+}
+
+struct ThumbnailCache::Private
+{
+    Private ();
+
+    struct Entry
+    {
+        std::size_t size;
+        std::time_t last_used;
+    };
+
+    const std::string directory;
+
+    Glib::Mutex mutex;
+    std::unordered_map<std::string, Entry> entries; // by file name
+    std::size_t total_size;
+    std::size_t max_size;
+
+    std::string path (const std::string &name) const
+    {
+        return Glib::build_filename (directory, name);
+    }
+
+    void scan ();
+
+    // These need mutex to be held
+    bool contains (const std::string &name) const;
+    void add (const std::string &name, std::size_t size);
+    void remove (const std::string &name);
+    void evict ();
+
+    // Marks an entry as used, returning false if it is not cached
+    bool touch (const std::string &name);
+};
+
+ThumbnailCache::Private::Private () :
+    directory (Glib::build_filename (Glib::get_user_cache_dir (),
+                                     "imgpacker", "thumbnails")),
+    total_size (0),
+    max_size (DEFAULT_MAX_SIZE)
+{}
+
+void ThumbnailCache::Private::scan ()
+{
+    if (g_mkdir_with_parents (directory.c_str (), 0700) != 0) {
+        LOG(warning) << "Could not create thumbnail cache directory "
+                     << directory << ": " << std::strerror (errno);
+        return;
+    }
+
+    DIR *dir = opendir (directory.c_str ());
+
+    if (!dir)
+        return;
+
+    while (struct dirent *i = readdir (dir)) {
+        struct stat st;
+
+        if (i->d_name[0] != '.' &&
+            stat (path (i->d_name).c_str (), &st) == 0 &&
+            S_ISREG (st.st_mode)) {
+            // Last use is recorded as the modification time, see touch ()
+            Entry entry = {std::size_t (st.st_size), st.st_mtime};
+
+            entries[i->d_name] = entry;
+            total_size += entry.size;
+        }
+    }
+
+    closedir (dir);
+
+    LOG(info) << "Thumbnail cache has " << entries.size () << " entries, "
+              << total_size << " bytes";
+}
+
+bool ThumbnailCache::Private::contains (const std::string &name) const
+{
+    return entries.find (name) != entries.end ();
+}
+
+void ThumbnailCache::Private::add (const std::string &name, std::size_t size)
+{
+    remove (name);
+
+    Entry entry = {size, std::time (nullptr)};
+    entries[name] = entry;
+    total_size += size;
+}
+
+void ThumbnailCache::Private::remove (const std::string &name)
+{
+    auto i = entries.find (name);
+
+    if (i == entries.end ())
+        return;
+
+    total_size -= i->second.size;
+    entries.erase (i);
+}
+
+void ThumbnailCache::Private::evict ()
+{
+    if (total_size <= max_size)
+        return;
+
+    std::vector<std::pair<std::time_t, std::string> > by_age;
+    by_age.reserve (entries.size ());
+
+    for (const auto &i : entries)
+        by_age.push_back (std::make_pair (i.second.last_used, i.first));
+
+    std::sort (by_age.begin (), by_age.end ());
+
+    std::size_t target = max_size * EVICTION_TARGET;
+    std::size_t nevicted = 0;
+
+    for (const auto &i : by_age) {
+        if (total_size <= target)
+            break;
+
+        // Mappings of the file stay valid after it is unlinked
+        unlink (path (i.second).c_str ());
+        remove (i.second);
+        nevicted++;
+    }
+
+    LOG(info) << "Evicted " << nevicted << " thumbnail cache entries";
+}
+
+bool ThumbnailCache::Private::touch (const std::string &name)
+{
+    {
+        Glib::Mutex::Lock l (mutex);
+
+        auto i = entries.find (name);
+
+        if (i == entries.end ())
+            return false;
+
+        i->second.last_used = std::time (nullptr);
+    }
+
+    // Keep the order of use across sessions too
+    utimes (path (name).c_str (), nullptr);
+
+    return true;
+}
+
+
+// ThumbnailCache definitions
+ThumbnailCache::ThumbnailCache () :
+    _priv (new Private)
+{
+    _priv->scan ();
+}
+
+ThumbnailCache::~ThumbnailCache () {}
+
+// static
+std::string ThumbnailCache::key (const Glib::RefPtr<Gio::FileInfo> &info)
+{
+    if (!info ||
+        !info->has_attribute (G_FILE_ATTRIBUTE_ID_FILE) ||
+        !info->has_attribute (G_FILE_ATTRIBUTE_TIME_MODIFIED) ||
+        !info->has_attribute (G_FILE_ATTRIBUTE_STANDARD_SIZE))
+        return std::string ();
+
+    std::ostringstream key;
+    key << info->get_attribute_string (G_FILE_ATTRIBUTE_ID_FILE) << '\n'
+        << info->get_attribute_uint64 (G_FILE_ATTRIBUTE_TIME_MODIFIED) << '\n'
+        << info->get_size ();
+
+    return Glib::Checksum::compute_checksum (Glib::Checksum::CHECKSUM_MD5,
+                                             key.str ());
+}
+
+// static
+int ThumbnailCache::level_for (int size)
+{
+    for (int level : LEVELS)
+        if (level >= size)
+            return level;
+
+    return 0;
+}
+
+Glib::RefPtr<Gdk::Pixbuf> ThumbnailCache::lookup (const std::string &key,
+                                                  int level)
+{
+    std::string name = entry_name (key, level);
+
+    if (!_priv->touch (name))
+        return Glib::RefPtr<Gdk::Pixbuf> ();
+
+    std::size_t length = 0;
+    const guint8 *data = map_file (_priv->path (name), length);
+    const Header *header = get_header (data, length);
+
+    if (!header) {
+        LOG(warning) << "Dropping unreadable thumbnail cache entry " << name;
+
+        if (data)
+            unmap_file (data, length);
+
+        Glib::Mutex::Lock l (_priv->mutex);
+        unlink (_priv->path (name).c_str ());
+        _priv->remove (name);
+
+        return Glib::RefPtr<Gdk::Pixbuf> ();
+    }
+
+    // The pixbuf uses the mapping directly, and unmaps it once it goes away
+    return Gdk::Pixbuf::create_from_data
+        (data + sizeof (Header), Gdk::COLORSPACE_RGB, header->has_alpha, 8,
+         header->width, header->height, header->rowstride,
+         [length] (const guint8 *pixels) {
+            unmap_file (pixels - sizeof (Header), length);
+        });
+}
+
+bool ThumbnailCache::dimensions (const std::string &key,
+                                 int &width, int &height)
+{
+    for (int level : LEVELS) {
+        std::string name = entry_name (key, level);
+
+        {
+            Glib::Mutex::Lock l (_priv->mutex);
+
+            if (!_priv->contains (name))
+                continue;
+        }
+
+        std::size_t length = 0;
+        const guint8 *data = map_file (_priv->path (name), length);
+
+        if (const Header *header = get_header (data, length)) {
+            width = header->full_width;
+            height = header->full_height;
+            unmap_file (data, length);
+
+            return true;
+        }
+
+        if (data)
+            unmap_file (data, length);
+    }
+
+    return false;
+}
+
+void ThumbnailCache::store (const std::string &key, int level,
+                            int width, int height,
+                            const Glib::RefPtr<Gdk::Pixbuf> &pixbuf)
+{
+    Header header;
+    std::memcpy (header.magic, MAGIC, sizeof MAGIC);
+    header.full_width = width;
+    header.full_height = height;
+    header.width = pixbuf->get_width ();
+    header.height = pixbuf->get_height ();
+    header.rowstride = pixbuf->get_rowstride ();
+    header.has_alpha = pixbuf->get_has_alpha ();
+
+    std::string contents (reinterpret_cast<const char *> (&header),
+                          sizeof header);
+    contents.append (reinterpret_cast<const char *> (pixbuf->get_pixels ()),
+                     pixbuf->get_byte_length ());
+
+    std::string name = entry_name (key, level);
+
+    try {
+        // Written to a temporary file and renamed over the old one, so
+        // existing mappings of it are left alone
+        Glib::file_set_contents (_priv->path (name), contents);
+
+    } catch (Glib::FileError &e) {
+        LOG(warning) << "Could not write thumbnail cache entry " << name
+                     << ": " << e.what ();
+        return;
+    }
+
+    Glib::Mutex::Lock l (_priv->mutex);
+
+    _priv->add (name, contents.size ());
+    _priv->evict ();
+}
+
+std::size_t ThumbnailCache::max_size () const
+{
+    Glib::Mutex::Lock l (_priv->mutex);
+
+    return _priv->max_size;
+}
+
+void ThumbnailCache::max_size (std::size_t bytes)
+{
+    Glib::Mutex::Lock l (_priv->mutex);
+
+    _priv->max_size = bytes;
+    _priv->evict ();
+}
@@ -0,0 +1,67 @@
+#ifndef IMGPACK_THUMBNAIL_CACHE_HH
+#define IMGPACK_THUMBNAIL_CACHE_HH
+
+#include <memory>
+#include <string>
+
+#include <gtkmm.h>
+#include <nihpp/singleton.hh>
+
+namespace ImgPack
+{
+    namespace GtkUI
+    {
+        // Persistent cache of images decoded at a few standard sizes, kept
+        // under the user cache directory so that repeat imports of the same
+        // images skip the decoder for thumbnails and small leaves.
+        //
+        // Entries are keyed by file ID, modification time and size, so edited
+        // files simply miss. The least recently used entries are deleted once
+        // the cache grows past max_size (). Entries are memory mapped rather
+        // than read. All methods may be called from any thread, and failures
+        // are logged and treated as misses.
+        class ThumbnailCache : public nihpp::Singleton<ThumbnailCache>
+        {
+        private:
+            friend class nihpp::Singleton<ThumbnailCache>;
+
+            ThumbnailCache ();
+            ~ThumbnailCache ();
+
+        public:
+            // Returns the key of the file described by info, or an empty
+            // string if info is missing any of the attributes it needs
+            static std::string key (const Glib::RefPtr<Gio::FileInfo> &info);
+
+            // Returns the smallest standard size whose images are at least
+            // size pixels along their longest side, or 0 if size is larger
+            // than every standard size
+            static int level_for (int size);
+
+            // Returns the cached image for key at the given standard size, or
+            // a null RefPtr on a miss
+            Glib::RefPtr<Gdk::Pixbuf> lookup (const std::string &key,
+                                              int level);
+
+            // Finds the full size of the image for key, from whichever of its
+            // entries is cached. Returns false on a miss.
+            bool dimensions (const std::string &key, int &width, int &height);
+
+            // Caches pixbuf as the image for key at the given standard size.
+            // width and height are the full size of the image.
+            void store (const std::string &key, int level,
+                        int width, int height,
+                        const Glib::RefPtr<Gdk::Pixbuf> &pixbuf);
+
+            // Bytes the cache may take on disk
+            std::size_t max_size () const;
+            void max_size (std::size_t bytes);
+
+        private:
+            struct Private;
+            const std::unique_ptr<Private> _priv;
+        };
+    }
+}
+
+#endif  // IMGPACK_THUMBNAIL_CACHE_HH
@@ -1,3 +1,6 @@
+#include <atomic>
+#include <chrono>
+
 #include <imgpack/util/async-operation.hh>
 #include <imgpack/util/logger.hh>
 
@@ -6,6 +9,11 @@ namespace ipu = ImgPack::Util;
 
 using ipu::AsyncOperation;
 
+namespace {
+    // Shortest time between progress signals
+    const std::chrono::milliseconds PROGRESS_INTERVAL (50);
+}
+
 struct AsyncOperation::Private : sigc::trackable
 {
     explicit Private (std::string &&description);
@@ -19,8 +27,21 @@ struct AsyncOperation::Private : sigc::trackable
     sigc::signal<void> finished;
     sigc::signal<void> aborted;
 
+    // Only touched by the thread running run ()
+    std::chrono::steady_clock::time_point last_progress;
+
+    // Set by the thread when it drops a call to publish_progress (), and
+    // cleared by the main loop once it has sent the signal for it
+    std::atomic<bool> progress_pending;
+    sigc::connection trailing_progress;
+
+    Glib::Dispatcher thread_progress;
+    sigc::signal<void> progressed;
+
     void cleanup_thread ();
     void on_thread_finish ();
+    void on_thread_progress ();
+    bool on_trailing_progress ();
 };
 
 
@@ -60,6 +81,9 @@ void AsyncOperation::start ()
 
     LOG(info) << "Starting async process: " << _priv->description;
 
+    _priv->last_progress = std::chrono::steady_clock::time_point ();
+    _priv->progress_pending = false;
+
     _priv->thread = Glib::Thread::create (
         [=] ()
         {
@@ -105,6 +129,26 @@ AsyncOperation::connect_signal_abort (sigc::slot<void> abort_slot)
     return _priv->aborted.connect (abort_slot);
 }
 
+sigc::connection
+AsyncOperation::connect_signal_progress (sigc::slot<void> progress_slot)
+{
+    return _priv->progressed.connect (progress_slot);
+}
+
+void AsyncOperation::publish_progress ()
+{
+    auto now = std::chrono::steady_clock::now ();
+
+    if (now - _priv->last_progress < PROGRESS_INTERVAL) {
+        _priv->progress_pending = true;
+        return;
+    }
+
+    _priv->last_progress = now;
+    _priv->progress_pending = false;
+    _priv->thread_progress ();
+}
+
 Glib::RefPtr<Gio::Cancellable> AsyncOperation::cancellable ()
 {
     return _priv->cancellable;
@@ -128,9 +172,12 @@ const char *AsyncOperation::Cancelled::what () const throw ()
 AsyncOperation::Private::Private (std::string &&description) :
     description (description),
     thread (nullptr),
-    cancellable (Gio::Cancellable::create ())
+    cancellable (Gio::Cancellable::create ()),
+    progress_pending (false)
 {
     thread_finish.connect (sigc::mem_fun (*this, &Private::on_thread_finish));
+    thread_progress.connect (sigc::mem_fun (*this,
+                                            &Private::on_thread_progress));
 }
 
 void AsyncOperation::Private::cleanup_thread ()
@@ -146,3 +193,27 @@ void AsyncOperation::Private::on_thread_finish ()
     cleanup_thread ();
     Glib::signal_idle ().connect_once (finished);
 }
+
+void AsyncOperation::Private::on_thread_progress ()
+{
+    // Progress may still be queued up after an abort
+    if (!thread)
+        return;
+
+    progressed ();
+
+    // Calls dropped until the thread may publish again are caught up with
+    // once the interval is over, in case the thread makes none after them
+    trailing_progress.disconnect ();
+    trailing_progress = Glib::signal_timeout ().connect
+        (sigc::mem_fun (*this, &Private::on_trailing_progress),
+         PROGRESS_INTERVAL.count ());
+}
+
+bool AsyncOperation::Private::on_trailing_progress ()
+{
+    if (thread && progress_pending.exchange (false))
+        progressed ();
+
+    return false;
+}
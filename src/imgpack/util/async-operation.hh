@@ -30,6 +30,12 @@ namespace ImgPack
 
             sigc::connection connect_signal_abort (sigc::slot<void> abort_slot);
 
+            // Emitted on the main loop after run () publishes an intermediate
+            // result. Whatever the result is, it is up to the subclass to hand
+            // it over.
+            sigc::connection
+            connect_signal_progress (sigc::slot<void> progress_slot);
+
         protected:
             // This is called on a separate thread
             Glib::RefPtr<Gio::Cancellable> cancellable ();
@@ -39,6 +45,12 @@ namespace ImgPack
             virtual void on_finish () {}
             virtual void on_abort () {}
 
+            // Called from run () when a new intermediate result is available.
+            // Throttled, so that the main loop is woken up no more often than
+            // every 50ms. Calls in between are merged into one more signal at
+            // the end of the interval, so the latest result is always seen.
+            void publish_progress ();
+
             class Cancelled;
             // Throws Cancelled if abort() was called
             void testcancelled ();
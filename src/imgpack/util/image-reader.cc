@@ -0,0 +1,569 @@
+#include <algorithm>
+#include <csetjmp>
+#include <cstdio>
+#include <exception>
+#include <vector>
+#include <png.h>
+#include <jpeglib.h>
+#include <jerror.h>
+
+#include <imgpack/util/image-reader.hh>
+#include <imgpack/util/logger.hh>
+
+namespace ip = ImgPack;
+namespace ipu = ip::Util;
+
+using ipu::ImageReader;
+
+namespace {
+    // Bytes read to tell formats apart, which is all of a PNG signature
+    const std::size_t SIGNATURE_SIZE = 8;
+
+    // Most times libjpeg halves an image while decoding it, as scaling by
+    // 1/8 is as far as it goes
+    const int MAX_JPEG_SHRINK = 3;
+
+    // Encoded JPEG data read from the stream at once
+    const std::size_t JPEG_BUFFER_SIZE = 64 * 1024;
+
+    // Packs a row of 8-bit grey, RGB or RGBA pixels into
+    // Cairo::FORMAT_ARGB32 pixels
+    void pack (const unsigned char *src, int width, int channels,
+               unsigned char *dest)
+    {
+        guint32 *pixels = reinterpret_cast<guint32 *> (dest);
+
+        for (int x = 0; x < width; x++, src += channels) {
+            guint32 red = src[0];
+            guint32 green = channels >= 3 ? src[1] : red;
+            guint32 blue = channels >= 3 ? src[2] : red;
+            guint32 alpha = channels == 4 ? src[3] : 0xff;
+
+            if (alpha != 0xff) {
+                red = (red * alpha + 127) / 255;
+                green = (green * alpha + 127) / 255;
+                blue = (blue * alpha + 127) / 255;
+            }
+
+            pixels[x] = alpha << 24 | red << 16 | green << 8 | blue;
+        }
+    }
+
+    // Both libraries report errors by calling back into us, and expect to
+    // be longjmp'd out of rather than returned to, as in ImageWriter. Every
+    // function which calls into them sets the jump target up first and
+    // throws from there, so that no C++ exception crosses their frames.
+    class PngReader : public ImageReader
+    {
+    public:
+        // Reads the image from stream, whose signature has been read
+        // already
+        explicit PngReader (const Glib::RefPtr<Gio::InputStream> &stream);
+        virtual ~PngReader ();
+
+        // Interlaced images have no row complete until every one of them
+        // has been decoded
+        bool interlaced () const {return _interlaced;}
+
+        virtual int width () const {return _width;}
+        virtual int height () const {return _height;}
+        virtual void read_rows (unsigned char *data, int stride, int nrows);
+
+    private:
+        void read_header ();
+
+        // Throws whatever broke off the last call into libpng
+        void fail ();
+
+        static void on_read (png_structp png, png_bytep data,
+                             png_size_t length);
+        static void on_error (png_structp png, png_const_charp message);
+        static void on_warning (png_structp png, png_const_charp message);
+
+        Glib::RefPtr<Gio::InputStream> stream;
+
+        png_structp png;
+        png_infop info;
+        int _width;
+        int _height;
+        bool _interlaced;
+        std::vector<png_byte> row;
+
+        std::string error;
+        std::exception_ptr stream_error;
+    };
+
+    class JpegReader : public ImageReader
+    {
+    public:
+        // Reads the image from stream, whose first bytes have been read
+        // into head already, scaled down by 2 to the power of shrink
+        JpegReader (const Glib::RefPtr<Gio::InputStream> &stream,
+                    const std::vector<unsigned char> &head, int shrink);
+        virtual ~JpegReader ();
+
+        // False for CMYK images, which libjpeg leaves to us to convert.
+        // gdk-pixbuf knows the quirks of the files that have them.
+        bool supported () const {return _supported;}
+
+        virtual int width () const {return cinfo.output_width;}
+        virtual int height () const {return cinfo.output_height;}
+        virtual void read_rows (unsigned char *data, int stride, int nrows);
+
+    private:
+        void read_header (int shrink);
+
+        // Throws whatever broke off the last call into libjpeg
+        void fail ();
+
+        // Reads the next part of the stream into the buffer, jumping out of
+        // libjpeg if that fails
+        void fill_buffer ();
+
+        static void on_init_source (j_decompress_ptr) {}
+        static boolean on_fill_input_buffer (j_decompress_ptr cinfo);
+        static void on_skip_input_data (j_decompress_ptr cinfo,
+                                        long nbytes);
+        static void on_term_source (j_decompress_ptr) {}
+        static void on_error_exit (j_common_ptr cinfo);
+        static void on_output_message (j_common_ptr cinfo);
+
+        Glib::RefPtr<Gio::InputStream> stream;
+
+        jpeg_decompress_struct cinfo;
+        jpeg_error_mgr error_mgr;
+        jpeg_source_mgr source;
+        std::jmp_buf jump;
+
+        std::vector<JOCTET> buffer;
+        std::vector<JSAMPLE> row;
+        bool _supported;
+
+        std::string error;
+        std::exception_ptr stream_error;
+    };
+
+    class PixbufReader : public ImageReader
+    {
+    public:
+        explicit PixbufReader (const Glib::RefPtr<Gdk::Pixbuf> &pixbuf) :
+            pixbuf (pixbuf), next_row (0) {}
+
+        virtual int width () const {return pixbuf->get_width ();}
+        virtual int height () const {return pixbuf->get_height ();}
+        virtual void read_rows (unsigned char *data, int stride, int nrows);
+
+    private:
+        Glib::RefPtr<Gdk::Pixbuf> pixbuf;
+        int next_row;
+    };
+
+    // Box filters the rows of another reader down by a power of two, so
+    // that every pixel is the average of those it covers
+    class HalvingReader : public ImageReader
+    {
+    public:
+        HalvingReader (const ImageReader::Ptr &source, int shrink);
+
+        virtual int width () const {return _width;}
+        virtual int height () const {return _height;}
+        virtual void read_rows (unsigned char *data, int stride, int nrows);
+
+    private:
+        ImageReader::Ptr source;
+        const int shrink;
+        const int _width;
+        const int _height;
+
+        int rows_read;
+        std::vector<unsigned char> row;
+
+        // Sums of each channel of the pixels under each destination pixel
+        std::vector<guint64> sums;
+    };
+}
+
+
+// ImageReader definitions
+ImageReader::Ptr
+ImageReader::create (const Glib::RefPtr<Gio::InputStream> &stream,
+                     int shrink)
+{
+    std::vector<unsigned char> head (SIGNATURE_SIZE);
+    gsize nread;
+
+    stream->read_all (head.data (), head.size (), nread);
+
+    if (nread < head.size ())
+        return Ptr ();
+
+    Ptr reader;
+
+    if (png_sig_cmp (head.data (), 0, head.size ()) == 0) {
+        PngReader *png = new PngReader (stream);
+        reader.reset (png);
+
+        if (png->interlaced ())
+            return Ptr ();
+
+    } else if (head[0] == 0xff && head[1] == 0xd8) {
+        int decoder_shrink = std::min (shrink, MAX_JPEG_SHRINK);
+        JpegReader *jpeg = new JpegReader (stream, head, decoder_shrink);
+        reader.reset (jpeg);
+
+        if (!jpeg->supported ())
+            return Ptr ();
+
+        shrink -= decoder_shrink;
+
+    } else
+        return Ptr ();
+
+    if (shrink > 0)
+        reader.reset (new HalvingReader (reader, shrink));
+
+    return reader;
+}
+
+ImageReader::Ptr ImageReader::create (const Glib::RefPtr<Gdk::Pixbuf> &pixbuf)
+{
+    return Ptr (new PixbufReader (pixbuf));
+}
+
+
+// PngReader definitions
+PngReader::PngReader (const Glib::RefPtr<Gio::InputStream> &stream) :
+    stream (stream),
+    png (png_create_read_struct (PNG_LIBPNG_VER_STRING, this,
+                                 &PngReader::on_error,
+                                 &PngReader::on_warning)),
+    info (png ? png_create_info_struct (png) : nullptr),
+    _width (0),
+    _height (0),
+    _interlaced (false)
+{
+    if (!info) {
+        png_destroy_read_struct (&png, nullptr, nullptr);
+        throw Error ("Could not allocate PNG decoder");
+    }
+
+    png_set_read_fn (png, this, &PngReader::on_read);
+
+    try {
+        read_header ();
+
+    } catch (...) {
+        png_destroy_read_struct (&png, &info, nullptr);
+        throw;
+    }
+
+    row.resize (std::size_t (_width) * 4);
+}
+
+PngReader::~PngReader ()
+{
+    png_destroy_read_struct (&png, &info, nullptr);
+}
+
+void PngReader::read_rows (unsigned char *data, int stride, int nrows)
+{
+    if (setjmp (png_jmpbuf (png)))
+        fail ();
+
+    for (int y = 0; y < nrows; y++) {
+        png_read_row (png, row.data (), nullptr);
+        pack (row.data (), _width, 4, data + std::size_t (y) * stride);
+    }
+}
+
+void PngReader::read_header ()
+{
+    if (setjmp (png_jmpbuf (png)))
+        fail ();
+
+    // libpng refuses more than a million pixels either way unless told
+    // otherwise, although the format allows far more
+    png_set_user_limits (png, PNG_UINT_31_MAX, PNG_UINT_31_MAX);
+    png_set_sig_bytes (png, SIGNATURE_SIZE);
+    png_read_info (png, info);
+
+    _width = png_get_image_width (png, info);
+    _height = png_get_image_height (png, info);
+    _interlaced = png_get_interlace_type (png, info) != PNG_INTERLACE_NONE;
+
+    // Every image comes out as 8-bit RGBA
+    png_set_expand (png);
+    png_set_strip_16 (png);
+    png_set_gray_to_rgb (png);
+    png_set_add_alpha (png, 0xff, PNG_FILLER_AFTER);
+    png_read_update_info (png, info);
+}
+
+void PngReader::fail ()
+{
+    if (stream_error)
+        std::rethrow_exception (stream_error);
+
+    throw Error ("Could not decode PNG: " + error);
+}
+
+void PngReader::on_read (png_structp png, png_bytep data, png_size_t length)
+{
+    PngReader *self = static_cast<PngReader *> (png_get_io_ptr (png));
+    gsize nread = 0;
+    bool failed = false;
+
+    try {
+        self->stream->read_all (data, length, nread);
+
+    } catch (...) {
+        self->stream_error = std::current_exception ();
+        failed = true;
+    }
+
+    // Outside the handler, which must be left normally
+    if (failed)
+        png_error (png, "Could not read from stream");
+
+    if (nread < length)
+        png_error (png, "Unexpected end of file");
+}
+
+void PngReader::on_error (png_structp png, png_const_charp message)
+{
+    static_cast<PngReader *> (png_get_error_ptr (png))->error = message;
+    std::longjmp (png_jmpbuf (png), 1);
+}
+
+void PngReader::on_warning (png_structp, png_const_charp message)
+{
+    LOG(warning) << "PNG decoder: " << message;
+}
+
+
+// JpegReader definitions
+JpegReader::JpegReader (const Glib::RefPtr<Gio::InputStream> &stream,
+                        const std::vector<unsigned char> &head, int shrink) :
+    stream (stream),
+    buffer (std::max (JPEG_BUFFER_SIZE, head.size ())),
+    _supported (false)
+{
+    cinfo.err = jpeg_std_error (&error_mgr);
+    error_mgr.error_exit = &JpegReader::on_error_exit;
+    error_mgr.output_message = &JpegReader::on_output_message;
+
+    jpeg_create_decompress (&cinfo);
+    cinfo.client_data = this;
+
+    // What was read to recognise the format is decoded first
+    std::copy (head.begin (), head.end (), buffer.begin ());
+
+    source.next_input_byte = buffer.data ();
+    source.bytes_in_buffer = head.size ();
+    source.init_source = &JpegReader::on_init_source;
+    source.fill_input_buffer = &JpegReader::on_fill_input_buffer;
+    source.skip_input_data = &JpegReader::on_skip_input_data;
+    source.resync_to_restart = &jpeg_resync_to_restart;
+    source.term_source = &JpegReader::on_term_source;
+    cinfo.src = &source;
+
+    try {
+        read_header (shrink);
+
+    } catch (...) {
+        jpeg_destroy_decompress (&cinfo);
+        throw;
+    }
+
+    row.resize (std::size_t (cinfo.output_width) * cinfo.output_components);
+}
+
+JpegReader::~JpegReader ()
+{
+    jpeg_destroy_decompress (&cinfo);
+}
+
+void JpegReader::read_rows (unsigned char *data, int stride, int nrows)
+{
+    if (setjmp (jump))
+        fail ();
+
+    for (int y = 0; y < nrows; y++) {
+        JSAMPROW rows[] = {row.data ()};
+
+        jpeg_read_scanlines (&cinfo, rows, 1);
+        pack (row.data (), cinfo.output_width, cinfo.output_components,
+              data + std::size_t (y) * stride);
+    }
+}
+
+void JpegReader::read_header (int shrink)
+{
+    if (setjmp (jump))
+        fail ();
+
+    jpeg_read_header (&cinfo, TRUE);
+
+    if (cinfo.jpeg_color_space == JCS_CMYK ||
+        cinfo.jpeg_color_space == JCS_YCCK)
+        return;
+
+    cinfo.out_color_space = cinfo.num_components == 1 ? JCS_GRAYSCALE :
+        JCS_RGB;
+    cinfo.scale_num = 1;
+    cinfo.scale_denom = 1 << shrink;
+
+    jpeg_start_decompress (&cinfo);
+    _supported = true;
+}
+
+void JpegReader::fail ()
+{
+    if (stream_error)
+        std::rethrow_exception (stream_error);
+
+    throw Error ("Could not decode JPEG: " + error);
+}
+
+void JpegReader::fill_buffer ()
+{
+    gssize nread = 0;
+    bool failed = false;
+
+    try {
+        nread = stream->read (buffer.data (), buffer.size ());
+
+    } catch (...) {
+        stream_error = std::current_exception ();
+        failed = true;
+    }
+
+    // Outside the handler, which must be left normally
+    if (failed)
+        std::longjmp (jump, 1);
+
+    // Truncated files are decoded as far as they go, as libjpeg's own
+    // sources do, by pretending that the image ends there
+    if (nread <= 0) {
+        WARNMS (&cinfo, JWRN_JPEG_EOF);
+        buffer[0] = 0xff;
+        buffer[1] = JPEG_EOI;
+        nread = 2;
+    }
+
+    source.next_input_byte = buffer.data ();
+    source.bytes_in_buffer = nread;
+}
+
+boolean JpegReader::on_fill_input_buffer (j_decompress_ptr cinfo)
+{
+    static_cast<JpegReader *> (cinfo->client_data)->fill_buffer ();
+
+    return TRUE;
+}
+
+void JpegReader::on_skip_input_data (j_decompress_ptr cinfo, long nbytes)
+{
+    JpegReader *self = static_cast<JpegReader *> (cinfo->client_data);
+
+    if (nbytes <= 0)
+        return;
+
+    while (std::size_t (nbytes) > self->source.bytes_in_buffer) {
+        nbytes -= self->source.bytes_in_buffer;
+        self->fill_buffer ();
+    }
+
+    self->source.next_input_byte += nbytes;
+    self->source.bytes_in_buffer -= nbytes;
+}
+
+void JpegReader::on_error_exit (j_common_ptr cinfo)
+{
+    JpegReader *self = static_cast<JpegReader *> (cinfo->client_data);
+    char message[JMSG_LENGTH_MAX];
+
+    (*cinfo->err->format_message) (cinfo, message);
+    self->error = message;
+
+    std::longjmp (self->jump, 1);
+}
+
+void JpegReader::on_output_message (j_common_ptr cinfo)
+{
+    char message[JMSG_LENGTH_MAX];
+
+    (*cinfo->err->format_message) (cinfo, message);
+    LOG(warning) << "JPEG decoder: " << message;
+}
+
+
+// PixbufReader definitions
+void PixbufReader::read_rows (unsigned char *data, int stride, int nrows)
+{
+    nrows = std::min (nrows, height () - next_row);
+
+    for (int y = 0; y < nrows; y++, next_row++)
+        pack (pixbuf->get_pixels () +
+              std::size_t (next_row) * pixbuf->get_rowstride (),
+              width (), pixbuf->get_n_channels (),
+              data + std::size_t (y) * stride);
+}
+
+
+// HalvingReader definitions
+HalvingReader::HalvingReader (const ImageReader::Ptr &source, int shrink) :
+    source (source),
+    shrink (shrink),
+    _width (((source->width () - 1) >> shrink) + 1),
+    _height (((source->height () - 1) >> shrink) + 1),
+    rows_read (0),
+    row (std::size_t (source->width ()) * 4),
+    sums (std::size_t (_width) * 4)
+{}
+
+void HalvingReader::read_rows (unsigned char *data, int stride, int nrows)
+{
+    int factor = 1 << shrink;
+    int source_width = source->width ();
+
+    for (int y = 0; y < nrows && rows_read < source->height (); y++) {
+        int count = std::min (factor, source->height () - rows_read);
+
+        std::fill (sums.begin (), sums.end (), 0);
+
+        for (int i = 0; i < count; i++) {
+            const guint32 *pixels = reinterpret_cast<const guint32 *>
+                (row.data ());
+
+            source->read_rows (row.data (), row.size (), 1);
+
+            for (int x = 0; x < source_width; x++) {
+                guint64 *sum = &sums[std::size_t (x >> shrink) * 4];
+                guint32 pixel = pixels[x];
+
+                sum[0] += pixel >> 24;
+                sum[1] += pixel >> 16 & 0xff;
+                sum[2] += pixel >> 8 & 0xff;
+                sum[3] += pixel & 0xff;
+            }
+        }
+
+        rows_read += count;
+
+        guint32 *dest = reinterpret_cast<guint32 *>
+            (data + std::size_t (y) * stride);
+
+        for (int x = 0; x < _width; x++) {
+            const guint64 *sum = &sums[std::size_t (x) * 4];
+            guint64 n = guint64 (count) *
+                std::min (factor, source_width - (x << shrink));
+            guint32 pixel = 0;
+
+            for (int c = 0; c < 4; c++)
+                pixel = pixel << 8 | guint32 ((sum[c] + n / 2) / n);
+
+            dest[x] = pixel;
+        }
+    }
+}
@@ -0,0 +1,68 @@
+#ifndef IMGPACK_IMAGE_READER_HH
+#define IMGPACK_IMAGE_READER_HH
+
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <giomm.h>
+#include <gdkmm/pixbuf.h>
+
+namespace ImgPack
+{
+    namespace Util
+    {
+        // Decodes an image a few rows at a time, top to bottom, so that
+        // images of any size can be read without holding all of their pixels
+        // in memory at once. Images may be shrunk as they are read, by
+        // halving them a number of times over. JPEG images are shrunk by the
+        // decoder itself, which then skips most of the work.
+        //
+        // Rows are in the layout of Cairo::FORMAT_ARGB32: one native endian
+        // 32-bit word per pixel, with alpha in the highest byte and the
+        // colours premultiplied by it.
+        class ImageReader
+        {
+        public:
+            typedef std::shared_ptr<ImageReader> Ptr;
+            class Error;
+
+            // Reads the header of the image in stream, which is to be halved
+            // shrink times over. Returns a null Ptr if the image is not in a
+            // format that can be read a few rows at a time. Throws Error if
+            // the header is corrupt, or Glib::Error if the stream cannot be
+            // read.
+            static Ptr create (const Glib::RefPtr<Gio::InputStream> &stream,
+                               int shrink = 0);
+
+            // Reads the rows of an image which is already decoded, for
+            // formats that cannot be read a few rows at a time
+            static Ptr create (const Glib::RefPtr<Gdk::Pixbuf> &pixbuf);
+
+            virtual ~ImageReader () {}
+
+            // Size of the image once shrunk, which is its size halved the
+            // given number of times, rounding up
+            virtual int width () const = 0;
+            virtual int height () const = 0;
+
+            // Decodes the next nrows rows of the image into data, stride bytes
+            // apart. Throws Error if they cannot be decoded, or Glib::Error if
+            // the stream cannot be read.
+            virtual void read_rows (unsigned char *data, int stride,
+                                    int nrows) = 0;
+
+        protected:
+            ImageReader () {}
+        };
+
+
+        class ImageReader::Error : public std::runtime_error
+        {
+        public:
+            explicit Error (const std::string &message) :
+                std::runtime_error (message) {}
+        };
+    }
+}
+
+#endif  // IMGPACK_IMAGE_READER_HH
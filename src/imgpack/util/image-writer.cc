@@ -0,0 +1,387 @@
+#include <csetjmp>
+#include <cstdio>
+#include <exception>
+#include <vector>
+#include <png.h>
+#include <jpeglib.h>
+
+#include <imgpack/util/image-writer.hh>
+#include <imgpack/util/logger.hh>
+
+namespace ip = ImgPack;
+namespace ipu = ip::Util;
+
+using ipu::ImageWriter;
+
+namespace {
+    // Same as gdk-pixbuf uses when not told otherwise
+    const int JPEG_QUALITY = 75;
+
+    // Encoded JPEG data gathered before each write to the stream
+    const std::size_t JPEG_BUFFER_SIZE = 64 * 1024;
+
+    // Unpacks a row of Cairo::FORMAT_RGB24 pixels into bytes of red, green
+    // and blue
+    void unpack_rgb (const unsigned char *src, int width, unsigned char *dest)
+    {
+        const guint32 *pixels = reinterpret_cast<const guint32 *> (src);
+
+        for (int x = 0; x < width; x++) {
+            guint32 pixel = pixels[x];
+
+            *dest++ = pixel >> 16;
+            *dest++ = pixel >> 8;
+            *dest++ = pixel;
+        }
+    }
+
+    // Both libraries report errors by calling back into us, and expect to
+    // be longjmp'd out of rather than returned to. Every function which
+    // calls into them sets the jump target up first and throws from there,
+    // so that no C++ exception crosses their frames.
+    class PngWriter : public ImageWriter
+    {
+    public:
+        PngWriter (const Glib::RefPtr<Gio::OutputStream> &stream,
+                   int width, int height);
+        virtual ~PngWriter ();
+
+        virtual void write_rows (const unsigned char *data, int stride,
+                                 int nrows);
+        virtual void finish ();
+
+    private:
+        void write_header (int height);
+
+        // Throws whatever broke off the last call into libpng
+        void fail ();
+
+        static void on_write (png_structp png, png_bytep data,
+                              png_size_t length);
+        static void on_flush (png_structp) {}
+        static void on_error (png_structp png, png_const_charp message);
+        static void on_warning (png_structp png, png_const_charp message);
+
+        Glib::RefPtr<Gio::OutputStream> stream;
+        const int width;
+
+        png_structp png;
+        png_infop info;
+        std::vector<png_byte> row;
+
+        std::string error;
+        std::exception_ptr stream_error;
+    };
+
+    class JpegWriter : public ImageWriter
+    {
+    public:
+        JpegWriter (const Glib::RefPtr<Gio::OutputStream> &stream,
+                    int width, int height);
+        virtual ~JpegWriter ();
+
+        virtual void write_rows (const unsigned char *data, int stride,
+                                 int nrows);
+        virtual void finish ();
+
+    private:
+        void start ();
+
+        // Throws whatever broke off the last call into libjpeg
+        void fail ();
+
+        // Writes the first length bytes of the buffer to the stream,
+        // jumping out of libjpeg if that fails
+        void flush_buffer (std::size_t length);
+
+        static void on_init_destination (j_compress_ptr) {}
+        static boolean on_empty_output_buffer (j_compress_ptr cinfo);
+        static void on_term_destination (j_compress_ptr cinfo);
+        static void on_error_exit (j_common_ptr cinfo);
+        static void on_output_message (j_common_ptr cinfo);
+
+        Glib::RefPtr<Gio::OutputStream> stream;
+
+        jpeg_compress_struct cinfo;
+        jpeg_error_mgr error_mgr;
+        jpeg_destination_mgr destination;
+        std::jmp_buf jump;
+
+        std::vector<JOCTET> buffer;
+        std::vector<JSAMPLE> row;
+
+        std::string error;
+        std::exception_ptr stream_error;
+    };
+}
+
+
+// ImageWriter definitions
+ImageWriter::Ptr
+ImageWriter::create (const std::string &format,
+                     const Glib::RefPtr<Gio::OutputStream> &stream,
+                     int width, int height)
+{
+    if (format == "png")
+        return Ptr (new PngWriter (stream, width, height));
+
+    if (format == "jpeg")
+        return Ptr (new JpegWriter (stream, width, height));
+
+    return Ptr ();
+}
+
+int ImageWriter::max_size (const std::string &format)
+{
+    if (format == "png")
+        return PNG_UINT_31_MAX;
+
+    // Sizes are stored in 16 bits, and libjpeg leaves some room below that
+    if (format == "jpeg")
+        return JPEG_MAX_DIMENSION;
+
+    return 0;
+}
+
+
+// PngWriter definitions
+PngWriter::PngWriter (const Glib::RefPtr<Gio::OutputStream> &stream,
+                      int width, int height) :
+    stream (stream),
+    width (width),
+    png (png_create_write_struct (PNG_LIBPNG_VER_STRING, this,
+                                  &PngWriter::on_error,
+                                  &PngWriter::on_warning)),
+    info (png ? png_create_info_struct (png) : nullptr),
+    row (std::size_t (width) * 3)
+{
+    if (!info) {
+        png_destroy_write_struct (&png, nullptr);
+        throw Error ("Could not allocate PNG encoder");
+    }
+
+    png_set_write_fn (png, this, &PngWriter::on_write, &PngWriter::on_flush);
+
+    try {
+        write_header (height);
+
+    } catch (...) {
+        png_destroy_write_struct (&png, &info);
+        throw;
+    }
+}
+
+PngWriter::~PngWriter ()
+{
+    png_destroy_write_struct (&png, &info);
+}
+
+void PngWriter::write_rows (const unsigned char *data, int stride, int nrows)
+{
+    if (setjmp (png_jmpbuf (png)))
+        fail ();
+
+    for (int y = 0; y < nrows; y++) {
+        unpack_rgb (data + std::size_t (y) * stride, width, row.data ());
+        png_write_row (png, row.data ());
+    }
+}
+
+void PngWriter::finish ()
+{
+    if (setjmp (png_jmpbuf (png)))
+        fail ();
+
+    png_write_end (png, info);
+}
+
+void PngWriter::write_header (int height)
+{
+    if (setjmp (png_jmpbuf (png)))
+        fail ();
+
+    // libpng refuses more than a million pixels either way unless told
+    // otherwise, although the format allows far more
+    png_set_user_limits (png, PNG_UINT_31_MAX, PNG_UINT_31_MAX);
+    png_set_IHDR (png, info, width, height, 8, PNG_COLOR_TYPE_RGB,
+                  PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
+                  PNG_FILTER_TYPE_DEFAULT);
+    png_write_info (png, info);
+}
+
+void PngWriter::fail ()
+{
+    if (stream_error)
+        std::rethrow_exception (stream_error);
+
+    throw Error ("Could not encode PNG: " + error);
+}
+
+void PngWriter::on_write (png_structp png, png_bytep data, png_size_t length)
+{
+    PngWriter *self = static_cast<PngWriter *> (png_get_io_ptr (png));
+    bool failed = false;
+
+    try {
+        gsize bytes_written;
+        self->stream->write_all (data, length, bytes_written);
+
+    } catch (...) {
+        self->stream_error = std::current_exception ();
+        failed = true;
+    }
+
+    // Outside the handler, which must be left normally
+    if (failed)
+        png_error (png, "Could not write to stream");
+}
+
+void PngWriter::on_error (png_structp png, png_const_charp message)
+{
+    static_cast<PngWriter *> (png_get_error_ptr (png))->error = message;
+    std::longjmp (png_jmpbuf (png), 1);
+}
+
+void PngWriter::on_warning (png_structp, png_const_charp message)
+{
+    LOG(warning) << "PNG encoder: " << message;
+}
+
+
+// JpegWriter definitions
+JpegWriter::JpegWriter (const Glib::RefPtr<Gio::OutputStream> &stream,
+                        int width, int height) :
+    stream (stream),
+    buffer (JPEG_BUFFER_SIZE),
+    row (std::size_t (width) * 3)
+{
+    cinfo.err = jpeg_std_error (&error_mgr);
+    error_mgr.error_exit = &JpegWriter::on_error_exit;
+    error_mgr.output_message = &JpegWriter::on_output_message;
+
+    jpeg_create_compress (&cinfo);
+    cinfo.client_data = this;
+
+    destination.next_output_byte = buffer.data ();
+    destination.free_in_buffer = buffer.size ();
+    destination.init_destination = &JpegWriter::on_init_destination;
+    destination.empty_output_buffer = &JpegWriter::on_empty_output_buffer;
+    destination.term_destination = &JpegWriter::on_term_destination;
+    cinfo.dest = &destination;
+
+    cinfo.image_width = width;
+    cinfo.image_height = height;
+    cinfo.input_components = 3;
+    cinfo.in_color_space = JCS_RGB;
+
+    try {
+        start ();
+
+    } catch (...) {
+        jpeg_destroy_compress (&cinfo);
+        throw;
+    }
+}
+
+JpegWriter::~JpegWriter ()
+{
+    jpeg_destroy_compress (&cinfo);
+}
+
+void JpegWriter::write_rows (const unsigned char *data, int stride, int nrows)
+{
+    if (setjmp (jump))
+        fail ();
+
+    for (int y = 0; y < nrows; y++) {
+        JSAMPROW rows[] = {row.data ()};
+
+        unpack_rgb (data + std::size_t (y) * stride, cinfo.image_width,
+                    row.data ());
+        jpeg_write_scanlines (&cinfo, rows, 1);
+    }
+}
+
+void JpegWriter::finish ()
+{
+    if (setjmp (jump))
+        fail ();
+
+    jpeg_finish_compress (&cinfo);
+}
+
+void JpegWriter::start ()
+{
+    if (setjmp (jump))
+        fail ();
+
+    jpeg_set_defaults (&cinfo);
+    jpeg_set_quality (&cinfo, JPEG_QUALITY, TRUE);
+    jpeg_start_compress (&cinfo, TRUE);
+}
+
+void JpegWriter::fail ()
+{
+    if (stream_error)
+        std::rethrow_exception (stream_error);
+
+    throw Error ("Could not encode JPEG: " + error);
+}
+
+void JpegWriter::flush_buffer (std::size_t length)
+{
+    bool failed = false;
+
+    try {
+        gsize bytes_written;
+        stream->write_all (buffer.data (), length, bytes_written);
+
+    } catch (...) {
+        stream_error = std::current_exception ();
+        failed = true;
+    }
+
+    // Outside the handler, which must be left normally
+    if (failed)
+        std::longjmp (jump, 1);
+
+    destination.next_output_byte = buffer.data ();
+    destination.free_in_buffer = buffer.size ();
+}
+
+boolean JpegWriter::on_empty_output_buffer (j_compress_ptr cinfo)
+{
+    JpegWriter *self = static_cast<JpegWriter *> (cinfo->client_data);
+
+    // libjpeg leaves free_in_buffer as it was when it asks for more room
+    self->flush_buffer (self->buffer.size ());
+
+    return TRUE;
+}
+
+void JpegWriter::on_term_destination (j_compress_ptr cinfo)
+{
+    JpegWriter *self = static_cast<JpegWriter *> (cinfo->client_data);
+
+    self->flush_buffer (self->buffer.size () -
+                        self->destination.free_in_buffer);
+}
+
+void JpegWriter::on_error_exit (j_common_ptr cinfo)
+{
+    JpegWriter *self = static_cast<JpegWriter *> (cinfo->client_data);
+    char message[JMSG_LENGTH_MAX];
+
+    (*cinfo->err->format_message) (cinfo, message);
+    self->error = message;
+
+    std::longjmp (self->jump, 1);
+}
+
+void JpegWriter::on_output_message (j_common_ptr cinfo)
+{
+    char message[JMSG_LENGTH_MAX];
+
+    (*cinfo->err->format_message) (cinfo, message);
+    LOG(warning) << "JPEG encoder: " << message;
+}
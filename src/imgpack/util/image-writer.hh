@@ -0,0 +1,63 @@
+#ifndef IMGPACK_IMAGE_WRITER_HH
+#define IMGPACK_IMAGE_WRITER_HH
+
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <giomm.h>
+
+namespace ImgPack
+{
+    namespace Util
+    {
+        // Encodes an image a few rows at a time, writing each part to the
+        // output stream as soon as it is encoded. Images of any size can be
+        // written this way, since no more than a band of rows needs to be
+        // held in memory at once.
+        //
+        // Rows are in the layout of Cairo::FORMAT_RGB24: one native endian
+        // 32-bit word per pixel, with blue in the lowest byte.
+        class ImageWriter
+        {
+        public:
+            typedef std::shared_ptr<ImageWriter> Ptr;
+            class Error;
+
+            // Creates a writer for the format of the given name, as returned
+            // by Gdk::PixbufFormat::get_name (). Returns a null Ptr if that
+            // format cannot be written a band at a time.
+            static Ptr create (const std::string &format,
+                               const Glib::RefPtr<Gio::OutputStream> &stream,
+                               int width, int height);
+
+            // Largest width and height the writer for a format accepts, or 0
+            // if that format cannot be written a band at a time
+            static int max_size (const std::string &format);
+
+            virtual ~ImageWriter () {}
+
+            // Encodes the next nrows rows of the image, stride bytes apart.
+            // Throws Error if they cannot be encoded, or Glib::Error if they
+            // cannot be written to the stream.
+            virtual void write_rows (const unsigned char *data, int stride,
+                                     int nrows) = 0;
+
+            // Writes out whatever follows the last row of the image, which
+            // must have been written by then
+            virtual void finish () = 0;
+
+        protected:
+            ImageWriter () {}
+        };
+
+
+        class ImageWriter::Error : public std::runtime_error
+        {
+        public:
+            explicit Error (const std::string &message) :
+                std::runtime_error (message) {}
+        };
+    }
+}
+
+#endif  // IMGPACK_IMAGE_WRITER_HH
@@ -0,0 +1,468 @@
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#if defined (__GNUC__) && (defined (__x86_64__) || defined (__i386__))
+#define IMGPACK_RESAMPLER_X86 1
+#include <immintrin.h>
+#endif
+
+#include <imgpack/util/resampler.hh>
+#include <imgpack/util/thread-pool.hh>
+
+namespace ip = ImgPack;
+namespace ipu = ip::Util;
+
+using ipu::Resampler;
+
+namespace {
+    // Weights are fixed point with this many fractional bits, which leaves
+    // room in 32 bits for the sum of a few thousand taps of 8-bit values
+    const int PRECISION = 14;
+    const int ROUNDING = 1 << (PRECISION - 1);
+
+    // Destination rows given to each thread at least
+    const std::size_t BAND_GRAIN = 16;
+
+    const double LANCZOS_LOBES = 3;
+
+    inline guint8 clamp (int value)
+    {
+        return value < 0 ? 0 : value > 255 ? 255 : value;
+    }
+
+    // Source pixels contributing to each destination pixel along one axis:
+    // count[i] pixels from first[i], weighted by weights[i * stride...]
+    struct Contributions
+    {
+        std::vector<int> first;
+        std::vector<int> count;
+        std::vector<gint16> weights;
+        int stride;
+
+        Contributions (int src_size, int dest_size, Resampler::Filter filter);
+    };
+
+    double lanczos (double x)
+    {
+        if (x == 0)
+            return 1;
+
+        if (std::abs (x) >= LANCZOS_LOBES)
+            return 0;
+
+        double pi_x = M_PI * x;
+
+        return LANCZOS_LOBES * std::sin (pi_x) *
+            std::sin (pi_x / LANCZOS_LOBES) / (pi_x * pi_x);
+    }
+
+    Contributions::Contributions (int src_size, int dest_size,
+                                  Resampler::Filter filter) :
+        first (dest_size), count (dest_size)
+    {
+        double scale = double (src_size) / dest_size;
+
+        // Filters are stretched when scaling down, so that every source
+        // pixel is covered
+        double support = filter == Resampler::BOX ? scale / 2 :
+            LANCZOS_LOBES * std::max (scale, 1.0);
+
+        stride = int (std::ceil (support)) * 2 + 2;
+        weights.assign (std::size_t (dest_size) * stride, 0);
+
+        std::vector<double> taps (stride);
+
+        for (int i = 0; i < dest_size; i++) {
+            double center = (i + 0.5) * scale;
+            int begin = std::max (int (std::floor (center - support)), 0);
+            int end = std::min (int (std::ceil (center + support)), src_size);
+
+            if (end - begin > stride)
+                end = begin + stride;
+
+            double total = 0;
+
+            for (int j = begin; j < end; j++) {
+                double weight;
+
+                if (filter == Resampler::BOX)
+                    // Overlap of source pixel j with the destination pixel
+                    weight = std::max (0.0,
+                                       std::min (j + 1.0, center + support) -
+                                       std::max (double (j), center - support));
+                else
+                    weight = lanczos ((j + 0.5 - center) /
+                                      std::max (scale, 1.0));
+
+                taps[j - begin] = weight;
+                total += weight;
+            }
+
+            // Trim taps that ended up with no weight, so kernels skip them
+            while (end > begin + 1 && taps[end - begin - 1] == 0)
+                end--;
+
+            while (end > begin + 1 && taps[0] == 0) {
+                std::copy (taps.begin () + 1, taps.begin () + (end - begin),
+                           taps.begin ());
+                begin++;
+            }
+
+            first[i] = begin;
+            count[i] = end - begin;
+
+            // Rounding errors go to the largest tap, so that flat areas stay
+            // exactly flat
+            gint16 *row = &weights[std::size_t (i) * stride];
+            int sum = 0;
+            int largest = 0;
+
+            for (int j = 0; j < count[i]; j++) {
+                row[j] = std::floor (taps[j] / total * (1 << PRECISION) + 0.5);
+                sum += row[j];
+
+                if (row[j] > row[largest])
+                    largest = j;
+            }
+
+            row[largest] += (1 << PRECISION) - sum;
+        }
+    }
+
+    // Combines count rows of nbytes bytes into out, weighting each by the
+    // corresponding entry of weights
+    typedef void (*VerticalKernel) (const guint8 *const *rows,
+                                    const gint16 *weights, int count,
+                                    guint8 *out, int nbytes);
+
+    void vertical_scalar (const guint8 *const *rows, const gint16 *weights,
+                          int count, guint8 *out, int nbytes)
+    {
+        for (int i = 0; i < nbytes; i++) {
+            int sum = ROUNDING;
+
+            for (int k = 0; k < count; k++)
+                sum += rows[k][i] * weights[k];
+
+            out[i] = clamp (sum >> PRECISION);
+        }
+    }
+
+#ifdef IMGPACK_RESAMPLER_X86
+    // Weights k and k + 1 packed as the 16-bit halves of one 32-bit value,
+    // the second being 0 if there is no such pair
+    inline int weight_pair (const gint16 *weights, int k, bool pair)
+    {
+        return int (guint16 (weights[k]) |
+                    guint32 (guint16 (pair ? weights[k + 1] : 0)) << 16);
+    }
+
+    // Rows are taken two at a time, with their bytes interleaved as 16-bit
+    // values so that pmaddwd multiplies and adds a pair in one go
+    __attribute__ ((target ("sse2")))
+    void vertical_sse2 (const guint8 *const *rows, const gint16 *weights,
+                        int count, guint8 *out, int nbytes)
+    {
+        const __m128i zero = _mm_setzero_si128 ();
+        const __m128i rounding = _mm_set1_epi32 (ROUNDING);
+        int i = 0;
+
+        for (; i + 16 <= nbytes; i += 16) {
+            __m128i sum0 = rounding, sum1 = rounding;
+            __m128i sum2 = rounding, sum3 = rounding;
+
+            for (int k = 0; k < count; k += 2) {
+                bool pair = k + 1 < count;
+                __m128i a = _mm_loadu_si128 ((const __m128i *) (rows[k] + i));
+                __m128i b = pair ?
+                    _mm_loadu_si128 ((const __m128i *) (rows[k + 1] + i)) :
+                    zero;
+                __m128i w = _mm_set1_epi32 (weight_pair (weights, k, pair));
+
+                __m128i a_lo = _mm_unpacklo_epi8 (a, zero);
+                __m128i a_hi = _mm_unpackhi_epi8 (a, zero);
+                __m128i b_lo = _mm_unpacklo_epi8 (b, zero);
+                __m128i b_hi = _mm_unpackhi_epi8 (b, zero);
+
+                sum0 = _mm_add_epi32 (sum0, _mm_madd_epi16
+                                      (_mm_unpacklo_epi16 (a_lo, b_lo), w));
+                sum1 = _mm_add_epi32 (sum1, _mm_madd_epi16
+                                      (_mm_unpackhi_epi16 (a_lo, b_lo), w));
+                sum2 = _mm_add_epi32 (sum2, _mm_madd_epi16
+                                      (_mm_unpacklo_epi16 (a_hi, b_hi), w));
+                sum3 = _mm_add_epi32 (sum3, _mm_madd_epi16
+                                      (_mm_unpackhi_epi16 (a_hi, b_hi), w));
+            }
+
+            __m128i lo = _mm_packs_epi32 (_mm_srai_epi32 (sum0, PRECISION),
+                                          _mm_srai_epi32 (sum1, PRECISION));
+            __m128i hi = _mm_packs_epi32 (_mm_srai_epi32 (sum2, PRECISION),
+                                          _mm_srai_epi32 (sum3, PRECISION));
+
+            _mm_storeu_si128 ((__m128i *) (out + i), _mm_packus_epi16 (lo, hi));
+        }
+
+        std::vector<const guint8 *> tail (rows, rows + count);
+
+        for (auto &row : tail)
+            row += i;
+
+        vertical_scalar (tail.data (), weights, count, out + i, nbytes - i);
+    }
+
+    // As vertical_sse2, on twice the bytes at a time. Unpacking and packing
+    // both work within 128-bit lanes, so bytes end up back where they were.
+    __attribute__ ((target ("avx2")))
+    void vertical_avx2 (const guint8 *const *rows, const gint16 *weights,
+                        int count, guint8 *out, int nbytes)
+    {
+        const __m256i zero = _mm256_setzero_si256 ();
+        const __m256i rounding = _mm256_set1_epi32 (ROUNDING);
+        int i = 0;
+
+        for (; i + 32 <= nbytes; i += 32) {
+            __m256i sum0 = rounding, sum1 = rounding;
+            __m256i sum2 = rounding, sum3 = rounding;
+
+            for (int k = 0; k < count; k += 2) {
+                bool pair = k + 1 < count;
+                __m256i a =
+                    _mm256_loadu_si256 ((const __m256i *) (rows[k] + i));
+                __m256i b = pair ?
+                    _mm256_loadu_si256 ((const __m256i *) (rows[k + 1] + i)) :
+                    zero;
+                __m256i w =
+                    _mm256_set1_epi32 (weight_pair (weights, k, pair));
+
+                __m256i a_lo = _mm256_unpacklo_epi8 (a, zero);
+                __m256i a_hi = _mm256_unpackhi_epi8 (a, zero);
+                __m256i b_lo = _mm256_unpacklo_epi8 (b, zero);
+                __m256i b_hi = _mm256_unpackhi_epi8 (b, zero);
+
+                sum0 = _mm256_add_epi32 (sum0, _mm256_madd_epi16
+                                         (_mm256_unpacklo_epi16 (a_lo, b_lo),
+                                          w));
+                sum1 = _mm256_add_epi32 (sum1, _mm256_madd_epi16
+                                         (_mm256_unpackhi_epi16 (a_lo, b_lo),
+                                          w));
+                sum2 = _mm256_add_epi32 (sum2, _mm256_madd_epi16
+                                         (_mm256_unpacklo_epi16 (a_hi, b_hi),
+                                          w));
+                sum3 = _mm256_add_epi32 (sum3, _mm256_madd_epi16
+                                         (_mm256_unpackhi_epi16 (a_hi, b_hi),
+                                          w));
+            }
+
+            __m256i lo =
+                _mm256_packs_epi32 (_mm256_srai_epi32 (sum0, PRECISION),
+                                    _mm256_srai_epi32 (sum1, PRECISION));
+            __m256i hi =
+                _mm256_packs_epi32 (_mm256_srai_epi32 (sum2, PRECISION),
+                                    _mm256_srai_epi32 (sum3, PRECISION));
+
+            _mm256_storeu_si256 ((__m256i *) (out + i),
+                                 _mm256_packus_epi16 (lo, hi));
+        }
+
+        std::vector<const guint8 *> tail (rows, rows + count);
+
+        for (auto &row : tail)
+            row += i;
+
+        vertical_sse2 (tail.data (), weights, count, out + i, nbytes - i);
+    }
+#endif
+
+    struct Kernel
+    {
+        VerticalKernel vertical;
+        const char *name;
+    };
+
+    Kernel pick_kernel ()
+    {
+#ifdef IMGPACK_RESAMPLER_X86
+        __builtin_cpu_init ();
+
+        if (__builtin_cpu_supports ("avx2"))
+            return {vertical_avx2, "avx2"};
+
+        if (__builtin_cpu_supports ("sse2"))
+            return {vertical_sse2, "sse2"};
+#endif
+
+        return {vertical_scalar, "scalar"};
+    }
+
+    const Kernel &kernel ()
+    {
+        static const Kernel picked = pick_kernel ();
+
+        return picked;
+    }
+
+    void horizontal (const guint8 *in, const Contributions &contributions,
+                     int channels, guint8 *out, int dest_width)
+    {
+        for (int i = 0; i < dest_width; i++) {
+            const guint8 *src = in + contributions.first[i] * channels;
+            const gint16 *weights =
+                &contributions.weights[std::size_t (i) * contributions.stride];
+            int count = contributions.count[i];
+
+            for (int c = 0; c < channels; c++) {
+                int sum = ROUNDING;
+
+                for (int k = 0; k < count; k++)
+                    sum += src[k * channels + c] * weights[k];
+
+                out[i * channels + c] = clamp (sum >> PRECISION);
+            }
+        }
+    }
+}
+
+
+// Resampler definitions
+void Resampler::scale (const guint8 *src,
+                       int src_width, int src_height, int src_stride,
+                       guint8 *dest,
+                       int dest_width, int dest_height, int dest_stride,
+                       int channels, Filter filter, bool parallel)
+{
+    scale_rows (src, src_width, src_height, src_stride,
+                dest, dest_width, dest_height, dest_stride, 0, dest_height,
+                channels, filter, parallel);
+}
+
+void Resampler::scale_rows (const guint8 *src,
+                            int src_width, int src_height, int src_stride,
+                            guint8 *dest,
+                            int dest_width, int dest_height, int dest_stride,
+                            int first_row, int nrows,
+                            int channels, Filter filter, bool parallel)
+{
+    if (src_width <= 0 || src_height <= 0 || dest_width <= 0 ||
+        first_row >= dest_height || nrows <= 0)
+        return;
+
+    Plan (src_width, src_height, dest_width, dest_height, filter).scale_rows
+        (src, src_stride, dest, dest_stride, first_row, nrows, channels,
+         parallel);
+}
+
+Glib::RefPtr<Gdk::Pixbuf> Resampler::scale (const Glib::RefPtr<Gdk::Pixbuf> &
+                                            source,
+                                            int width, int height,
+                                            Filter filter, bool parallel)
+{
+    if (source->get_width () == width && source->get_height () == height)
+        return source;
+
+    Glib::RefPtr<Gdk::Pixbuf> dest =
+        Gdk::Pixbuf::create (Gdk::COLORSPACE_RGB, source->get_has_alpha (),
+                             8, width, height);
+
+    scale (source->get_pixels (), source->get_width (), source->get_height (),
+           source->get_rowstride (),
+           dest->get_pixels (), width, height, dest->get_rowstride (),
+           source->get_n_channels (), filter, parallel);
+
+    return dest;
+}
+
+const char *Resampler::kernel_name ()
+{
+    return kernel ().name;
+}
+
+
+// Resampler::Plan definitions
+struct Resampler::Plan::Private
+{
+    Private (int src_width, int src_height,
+             int dest_width, int dest_height, Filter filter) :
+        src_width (src_width), dest_width (dest_width),
+        dest_height (dest_height),
+        columns (src_width, dest_width, filter),
+        rows (src_height, dest_height, filter) {}
+
+    const int src_width;
+    const int dest_width;
+    const int dest_height;
+
+    const Contributions columns;
+    const Contributions rows;
+};
+
+Resampler::Plan::Plan (int src_width, int src_height,
+                       int dest_width, int dest_height, Filter filter) :
+    _priv (new Private (std::max (src_width, 1), std::max (src_height, 1),
+                        std::max (dest_width, 1), std::max (dest_height, 1),
+                        filter))
+{}
+
+Resampler::Plan::~Plan () {}
+
+void Resampler::Plan::scale_rows (const guint8 *src, int src_stride,
+                                  guint8 *dest, int dest_stride,
+                                  int first_row, int nrows, int channels,
+                                  bool parallel, int src_first_row) const
+{
+    first_row = std::max (first_row, 0);
+    nrows = std::min (nrows, _priv->dest_height - first_row);
+
+    if (nrows <= 0)
+        return;
+
+    const Contributions &columns = _priv->columns;
+    const Contributions &rows = _priv->rows;
+    int src_width = _priv->src_width;
+    int dest_width = _priv->dest_width;
+    VerticalKernel vertical = kernel ().vertical;
+
+    auto band = [&] (std::size_t begin, std::size_t end) {
+        // One vertically combined source row at a time
+        std::vector<guint8> combined (std::size_t (src_width) * channels);
+        std::vector<const guint8 *> inputs (rows.stride);
+
+        for (std::size_t y = begin; y < end; y++) {
+            int count = rows.count[y];
+
+            for (int k = 0; k < count; k++)
+                inputs[k] = src + std::size_t (rows.first[y] + k -
+                                               src_first_row) * src_stride;
+
+            vertical (inputs.data (), &rows.weights[y * rows.stride], count,
+                      combined.data (), src_width * channels);
+
+            horizontal (combined.data (), columns, channels,
+                        dest + (y - first_row) * dest_stride, dest_width);
+        }
+    };
+
+    if (parallel)
+        ThreadPool::instance ().parallel_for (first_row, first_row + nrows,
+                                              BAND_GRAIN, band);
+    else
+        band (first_row, first_row + nrows);
+}
+
+void Resampler::Plan::source_rows (int first_row, int nrows,
+                                   int &src_begin, int &src_end) const
+{
+    const Contributions &rows = _priv->rows;
+
+    first_row = std::max (first_row, 0);
+    nrows = std::min (nrows, _priv->dest_height - first_row);
+
+    src_begin = src_end = 0;
+
+    for (int y = first_row; y < first_row + nrows; y++) {
+        if (y == first_row || rows.first[y] < src_begin)
+            src_begin = rows.first[y];
+
+        src_end = std::max (src_end, rows.first[y] + rows.count[y]);
+    }
+}
@@ -0,0 +1,105 @@
+#ifndef IMGPACK_RESAMPLER_HH
+#define IMGPACK_RESAMPLER_HH
+
+#include <memory>
+#include <gdkmm/pixbuf.h>
+
+namespace ImgPack
+{
+    namespace Util
+    {
+        // Single pass image scaling with separable filters. Rows are first
+        // combined vertically, which touches every source pixel and uses
+        // SSE2 or AVX2 where the CPU has them, then horizontally into the
+        // destination row.
+        //
+        // Channels are filtered independently, so colours of transparent
+        // pixels bleed into their neighbours. Images are expected to be
+        // opaque, or nearly so.
+        class Resampler
+        {
+        public:
+            enum Filter {
+                // Averages the source pixels under each destination pixel,
+                // weighted by how much of them it covers. Fast, and free of
+                // aliasing when scaling down.
+                BOX,
+
+                // Three lobed Lanczos window. Sharper than BOX, and slower,
+                // for when quality matters more than speed.
+                LANCZOS
+            };
+
+            class Plan;
+
+            Resampler () = delete;
+
+            // Scales the 8-bit src into dest, both of which have the given
+            // number of interleaved channels and bytes per row. Splits the
+            // destination rows between the threads of the ThreadPool if
+            // parallel is set, which must not be done from within the pool.
+            static void scale (const guint8 *src,
+                               int src_width, int src_height, int src_stride,
+                               guint8 *dest,
+                               int dest_width, int dest_height, int dest_stride,
+                               int channels, Filter filter,
+                               bool parallel = false);
+
+            // As above, but only makes the nrows destination rows from
+            // first_row on, which are written to dest from its first row
+            static void scale_rows (const guint8 *src,
+                                    int src_width, int src_height,
+                                    int src_stride,
+                                    guint8 *dest,
+                                    int dest_width, int dest_height,
+                                    int dest_stride,
+                                    int first_row, int nrows,
+                                    int channels, Filter filter,
+                                    bool parallel = false);
+
+            // Returns source scaled to width x height, or source itself if it
+            // is that size already
+            static Glib::RefPtr<Gdk::Pixbuf>
+            scale (const Glib::RefPtr<Gdk::Pixbuf> &source,
+                   int width, int height, Filter filter = BOX,
+                   bool parallel = false);
+
+            // Name of the vertical kernel picked for this CPU
+            static const char *kernel_name ();
+        };
+
+
+        // Filter weights for scaling images of one size to another. Making
+        // them takes about as long as scaling a few rows, so an image which
+        // is scaled a few rows at a time should keep one Plan for all of
+        // them. Plans are immutable, so one may be used by many threads.
+        class Resampler::Plan
+        {
+        public:
+            Plan (int src_width, int src_height,
+                  int dest_width, int dest_height, Filter filter);
+            Plan (const Plan &) = delete;
+            ~Plan ();
+
+            // As Resampler::scale_rows (), for images of the planned sizes.
+            // src holds the source from row src_first_row on, which need go
+            // no further than the rows source_rows () asks for.
+            void scale_rows (const guint8 *src, int src_stride,
+                             guint8 *dest, int dest_stride,
+                             int first_row, int nrows, int channels,
+                             bool parallel = false,
+                             int src_first_row = 0) const;
+
+            // Sets [src_begin, src_end) to the source rows read to make the
+            // nrows destination rows from first_row on
+            void source_rows (int first_row, int nrows,
+                              int &src_begin, int &src_end) const;
+
+        private:
+            struct Private;
+            const std::unique_ptr<Private> _priv;
+        };
+    }
+}
+
+#endif  // IMGPACK_RESAMPLER_HH
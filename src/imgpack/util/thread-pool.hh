@@ -1,7 +1,10 @@
 #ifndef IMGPACK_THREAD_POOL_HH
 #define IMGPACK_THREAD_POOL_HH
 
+#include <algorithm>
+#include <exception>
 #include <future>
+#include <vector>
 #include <glibmm.h>
 #include <nihpp/singleton.hh>
 
@@ -25,6 +28,22 @@ namespace ImgPack
             template <typename T>
             std::future<typename std::result_of<T()>::type>
             async (T callable, Glib::Dispatcher &finish_signal);
+
+            // Same as above, for callers which wait on the std::future
+            // themselves instead of being notified on the main thread
+            template <typename T>
+            std::future<typename std::result_of<T()>::type>
+            async (T callable);
+
+            // Splits [begin, end) into contiguous chunks of at least grain
+            // items, at most one per thread, and calls body (chunk_begin,
+            // chunk_end) on each of them. The calling thread processes the
+            // first chunk itself and blocks until the others are done, so
+            // this must not be called from within the pool. Exceptions thrown
+            // by body are rethrown once every chunk has finished.
+            template <typename T>
+            void parallel_for (std::size_t begin, std::size_t end,
+                               std::size_t grain, T body);
         };
 
 
@@ -49,6 +68,75 @@ namespace ImgPack
 
             return promise->get_future ();
         }
+
+        template <typename T>
+        std::future<typename std::result_of<T ()>::type>
+        ThreadPool::async (T callable)
+        {
+            typedef typename std::result_of<T ()>::type ret;
+            std::shared_ptr<std::promise<ret> > promise (new std::promise<ret>);
+
+            push ([=]() {
+                    try {
+                        promise->set_value (std::move (callable ()));
+
+                    } catch (...) {
+                        promise->set_exception(std::current_exception ());
+                    }
+                });
+
+            return promise->get_future ();
+        }
+
+        template <typename T>
+        void ThreadPool::parallel_for (std::size_t begin, std::size_t end,
+                                       std::size_t grain, T body)
+        {
+            if (begin >= end)
+                return;
+
+            std::size_t count = end - begin;
+            std::size_t nchunks =
+                std::min<std::size_t> (std::max (get_max_threads (), 1),
+                                       std::max<std::size_t> (count / grain,
+                                                              1));
+
+            std::size_t chunk_size = (count + nchunks - 1) / nchunks;
+
+            std::vector<std::future<bool> > results;
+            results.reserve (nchunks - 1);
+
+            for (std::size_t i = begin + chunk_size; i < end; i += chunk_size) {
+                std::size_t chunk_end = std::min (i + chunk_size, end);
+
+                results.push_back (async ([=, &body] () {
+                            body (i, chunk_end);
+                            return true;
+                        }));
+            }
+
+            std::exception_ptr error;
+
+            try {
+                body (begin, std::min (begin + chunk_size, end));
+
+            } catch (...) {
+                error = std::current_exception ();
+            }
+
+            for (auto &result : results) {
+                try {
+                    result.get ();
+
+                } catch (...) {
+                    if (!error)
+                        error = std::current_exception ();
+                }
+            }
+
+            if (error)
+                std::rethrow_exception (error);
+        }
     }
 }
 